@@ -0,0 +1,279 @@
+/*
+ * budgie-art-cache.c
+ * 
+ * Copyright 2013 Ikey Doherty <ikey.doherty@gmail.com>
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ * 
+ * 
+ */
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include "budgie-art-cache.h"
+#include "util.h"
+
+/* A cached image, linked into the LRU list */
+typedef struct ArtEntry {
+        gchar *key;
+        GdkPixbuf *pixbuf;
+        gsize size;
+        GList link;
+} ArtEntry;
+
+/* Private storage */
+struct _BudgieArtCachePrivate {
+        /* Entries keyed by key, and in use order, most recent first */
+        GMutex lock;
+        GHashTable *entries;
+        GQueue order;
+        gsize size;
+        gsize budget;
+
+#if GLIB_CHECK_VERSION(2, 64, 0)
+        GMemoryMonitor *monitor;
+#endif
+};
+
+G_DEFINE_TYPE_WITH_PRIVATE(BudgieArtCache, budgie_art_cache, G_TYPE_OBJECT)
+
+/* Boilerplate GObject code */
+static void budgie_art_cache_class_init(BudgieArtCacheClass *klass);
+static void budgie_art_cache_init(BudgieArtCache *self);
+static void budgie_art_cache_dispose(GObject *object);
+static void budgie_art_cache_finalize(GObject *object);
+
+static void art_entry_free(gpointer data)
+{
+        ArtEntry *entry = data;
+
+        g_free(entry->key);
+        g_object_unref(entry->pixbuf);
+        g_slice_free(ArtEntry, entry);
+}
+
+/**
+ * Drop the least recently used images until size fits target. The
+ * lock must be held.
+ */
+static void _art_cache_trim(BudgieArtCache *self, gsize target)
+{
+        ArtEntry *entry;
+        GList *link;
+
+        while (self->priv->size > target &&
+               (link = g_queue_peek_tail_link(&self->priv->order)) != NULL) {
+                entry = link->data;
+                g_queue_unlink(&self->priv->order, link);
+                self->priv->size -= entry->size;
+                g_hash_table_remove(self->priv->entries, entry->key);
+        }
+}
+
+#if GLIB_CHECK_VERSION(2, 64, 0)
+static void low_memory_cb(GMemoryMonitor *monitor,
+                          GMemoryMonitorWarningLevel level,
+                          gpointer userdata)
+{
+        BudgieArtCache *self;
+
+        self = BUDGIE_ART_CACHE(userdata);
+
+        /* Images are easily decoded again, so give up half at the first
+         * warning and everything once it gets worse */
+        g_mutex_lock(&self->priv->lock);
+        if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_MEDIUM) {
+                _art_cache_trim(self, 0);
+        } else {
+                _art_cache_trim(self, self->priv->budget / 2);
+        }
+        g_mutex_unlock(&self->priv->lock);
+}
+#endif
+
+/* Initialisation */
+static void budgie_art_cache_class_init(BudgieArtCacheClass *klass)
+{
+        GObjectClass *g_object_class;
+
+        g_object_class = G_OBJECT_CLASS(klass);
+        g_object_class->dispose = &budgie_art_cache_dispose;
+        g_object_class->finalize = &budgie_art_cache_finalize;
+}
+
+static void budgie_art_cache_init(BudgieArtCache *self)
+{
+        self->priv = budgie_art_cache_get_instance_private(self);
+
+        g_mutex_init(&self->priv->lock);
+        self->priv->entries = g_hash_table_new_full(g_str_hash, g_str_equal,
+                NULL, art_entry_free);
+        g_queue_init(&self->priv->order);
+
+#if GLIB_CHECK_VERSION(2, 64, 0)
+        self->priv->monitor = g_memory_monitor_dup_default();
+        g_signal_connect(self->priv->monitor, "low-memory-warning",
+                G_CALLBACK(low_memory_cb), self);
+#endif
+}
+
+static void budgie_art_cache_dispose(GObject *object)
+{
+        BudgieArtCache *self;
+
+        self = BUDGIE_ART_CACHE(object);
+
+#if GLIB_CHECK_VERSION(2, 64, 0)
+        if (self->priv->monitor) {
+                g_signal_handlers_disconnect_by_data(self->priv->monitor, self);
+                g_object_unref(self->priv->monitor);
+                self->priv->monitor = NULL;
+        }
+#endif
+        g_mutex_lock(&self->priv->lock);
+        if (self->priv->entries) {
+                /* The links belong to the entries */
+                g_queue_init(&self->priv->order);
+                g_hash_table_unref(self->priv->entries);
+                self->priv->entries = NULL;
+                self->priv->size = 0;
+        }
+        g_mutex_unlock(&self->priv->lock);
+
+        /* Destruct */
+        G_OBJECT_CLASS (budgie_art_cache_parent_class)->dispose (object);
+}
+
+static void budgie_art_cache_finalize(GObject *object)
+{
+        BudgieArtCache *self;
+
+        self = BUDGIE_ART_CACHE(object);
+        g_mutex_clear(&self->priv->lock);
+
+        G_OBJECT_CLASS (budgie_art_cache_parent_class)->finalize (object);
+}
+
+/* API */
+BudgieArtCache* budgie_art_cache_new(gsize budget)
+{
+        BudgieArtCache *self;
+
+        self = g_object_new(BUDGIE_ART_CACHE_TYPE, NULL);
+        self->priv->budget = budget;
+
+        return self;
+}
+
+void budgie_art_cache_set_budget(BudgieArtCache *self, gsize budget)
+{
+        g_return_if_fail(self != NULL);
+
+        g_mutex_lock(&self->priv->lock);
+        self->priv->budget = budget;
+        _art_cache_trim(self, budget);
+        g_mutex_unlock(&self->priv->lock);
+}
+
+GdkPixbuf* budgie_art_cache_lookup(BudgieArtCache *self, const gchar *key)
+{
+        ArtEntry *entry;
+        GdkPixbuf *ret = NULL;
+
+        g_return_val_if_fail(self != NULL, NULL);
+        g_return_val_if_fail(key != NULL, NULL);
+
+        g_mutex_lock(&self->priv->lock);
+        entry = self->priv->entries ?
+                g_hash_table_lookup(self->priv->entries, key) : NULL;
+        if (entry) {
+                g_queue_unlink(&self->priv->order, &entry->link);
+                g_queue_push_head_link(&self->priv->order, &entry->link);
+                ret = g_object_ref(entry->pixbuf);
+        }
+        g_mutex_unlock(&self->priv->lock);
+
+        return ret;
+}
+
+void budgie_art_cache_insert(BudgieArtCache *self,
+                             const gchar *key,
+                             GdkPixbuf *pixbuf)
+{
+        ArtEntry *entry, *old;
+
+        g_return_if_fail(self != NULL);
+        g_return_if_fail(key != NULL);
+        g_return_if_fail(pixbuf != NULL);
+
+        entry = g_slice_new0(ArtEntry);
+        entry->key = g_strdup(key);
+        entry->pixbuf = g_object_ref(pixbuf);
+        entry->size = gdk_pixbuf_get_byte_length(pixbuf);
+        entry->link.data = entry;
+
+        g_mutex_lock(&self->priv->lock);
+        if (!self->priv->entries || entry->size > self->priv->budget) {
+                /* Disposed, or would never fit */
+                g_mutex_unlock(&self->priv->lock);
+                art_entry_free(entry);
+                return;
+        }
+        old = g_hash_table_lookup(self->priv->entries, key);
+        if (old) {
+                g_queue_unlink(&self->priv->order, &old->link);
+                self->priv->size -= old->size;
+                g_hash_table_remove(self->priv->entries, key);
+        }
+        _art_cache_trim(self, self->priv->budget - entry->size);
+        g_queue_push_head_link(&self->priv->order, &entry->link);
+        g_hash_table_insert(self->priv->entries, entry->key, entry);
+        self->priv->size += entry->size;
+        g_mutex_unlock(&self->priv->lock);
+}
+
+GdkPixbuf* budgie_art_cache_load(BudgieArtCache *self,
+                                 const gchar *path,
+                                 gint width,
+                                 gint height,
+                                 gboolean preserve_aspect)
+{
+        GdkPixbuf *ret;
+        GStatBuf st;
+        gchar *key;
+
+        g_return_val_if_fail(self != NULL, NULL);
+
+        if (!path || g_stat(path, &st) != 0) {
+                return NULL;
+        }
+
+        /* Two threads missing the same image both decode it, which is
+         * cheaper than holding the lock while decoding. A replaced image
+         * has a new mtime, and so misses. */
+        key = g_strdup_printf("%s@%ld@%dx%d%s", path, (long)st.st_mtime,
+                width, height, preserve_aspect ? "" : "!");
+        ret = budgie_art_cache_lookup(self, key);
+        if (!ret) {
+                ret = albumart_load(path, width, height, preserve_aspect);
+                if (ret) {
+                        budgie_art_cache_insert(self, key, ret);
+                }
+        }
+        g_free(key);
+
+        return ret;
+}
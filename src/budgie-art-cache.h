@@ -0,0 +1,110 @@
+/*
+ * budgie-art-cache.h
+ * 
+ * Copyright 2013 Ikey Doherty <ikey.doherty@gmail.com>
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ * 
+ * 
+ */
+#ifndef budgie_art_cache_h
+#define budgie_art_cache_h
+
+#include <glib-object.h>
+#include <gtk/gtk.h>
+
+typedef struct _BudgieArtCache BudgieArtCache;
+typedef struct _BudgieArtCacheClass   BudgieArtCacheClass;
+typedef struct _BudgieArtCachePrivate BudgieArtCachePrivate;
+
+#define BUDGIE_ART_CACHE_TYPE (budgie_art_cache_get_type())
+#define BUDGIE_ART_CACHE(obj)                  (G_TYPE_CHECK_INSTANCE_CAST ((obj), BUDGIE_ART_CACHE_TYPE, BudgieArtCache))
+#define IS_BUDGIE_ART_CACHE(obj)               (G_TYPE_CHECK_INSTANCE_TYPE ((obj), BUDGIE_ART_CACHE_TYPE))
+#define BUDGIE_ART_CACHE_CLASS(klass)          (G_TYPE_CHECK_CLASS_CAST ((klass), BUDGIE_ART_CACHE_TYPE, BudgieArtCacheClass))
+#define IS_BUDGIE_ART_CACHE_CLASS(klass)       (G_TYPE_CHECK_CLASS_TYPE ((klass), BUDGIE_ART_CACHE_TYPE))
+#define BUDGIE_ART_CACHE_GET_CLASS(obj)        (G_TYPE_INSTANCE_GET_CLASS ((obj), BUDGIE_ART_CACHE_TYPE, BudgieArtCacheClass))
+
+/* BudgieArtCache object */
+struct _BudgieArtCache {
+        GObject parent;
+
+        BudgieArtCachePrivate *priv;
+};
+
+/* BudgieArtCache class definition */
+struct _BudgieArtCacheClass {
+        GObjectClass parent_class;
+};
+
+GType budgie_art_cache_get_type(void);
+
+/* BudgieArtCache methods */
+
+/**
+ * Construct a new BudgieArtCache
+ *
+ * Decoded album art is kept in memory, up to a budget in bytes, with
+ * the least recently used images dropped first. Low memory warnings
+ * from the system shrink or empty the cache. It may be used from any
+ * thread.
+ *
+ * @param budget Bytes of pixel data to keep
+ * @return A new BudgieArtCache
+ */
+BudgieArtCache* budgie_art_cache_new(gsize budget);
+
+/**
+ * Change the budget, dropping images as needed to fit
+ * @param self BudgieArtCache instance
+ * @param budget Bytes of pixel data to keep
+ */
+void budgie_art_cache_set_budget(BudgieArtCache *self, gsize budget);
+
+/**
+ * Find an image in the cache, marking it as recently used
+ * @param self BudgieArtCache instance
+ * @param key Key the image was added with
+ * @return a new reference to the image, or NULL if not cached
+ */
+GdkPixbuf* budgie_art_cache_lookup(BudgieArtCache *self, const gchar *key);
+
+/**
+ * Add an image to the cache, replacing any with the same key
+ * @param self BudgieArtCache instance
+ * @param key Key to find the image by
+ * @param pixbuf The image, a reference is taken
+ */
+void budgie_art_cache_insert(BudgieArtCache *self,
+                             const gchar *key,
+                             GdkPixbuf *pixbuf);
+
+/**
+ * Load album art at a given size, as albumart_load does, decoding it
+ * only if it isn't already cached at that size
+ * @param self BudgieArtCache instance
+ * @param path Path of the image
+ * @param width Width to load at
+ * @param height Height to load at
+ * @param preserve_aspect Whether to fit within width and height
+ * @return a new reference to the image, or NULL if it couldn't be loaded
+ */
+GdkPixbuf* budgie_art_cache_load(BudgieArtCache *self,
+                                 const gchar *path,
+                                 gint width,
+                                 gint height,
+                                 gboolean preserve_aspect);
+
+#endif /* budgie_art_cache_h */
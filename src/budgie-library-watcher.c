@@ -0,0 +1,511 @@
+/*
+ * budgie-library-watcher.c
+ * 
+ * Copyright 2013 Ikey Doherty <ikey.doherty@gmail.com>
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ * 
+ * 
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <gio/gio.h>
+
+#include "budgie-library-watcher.h"
+#include "budgie-scanner.h"
+
+/* Quiet period before pending events are applied (milliseconds) */
+#define WATCH_SETTLE_MS 500
+
+/* Longest an event may wait while the tree is still busy (microseconds) */
+#define WATCH_MAX_DELAY (5 * G_USEC_PER_SEC)
+
+/* Interval between rescans once the watch limit is hit (seconds) */
+#define WATCH_RESCAN_INTERVAL 600
+
+/* Kernel limit on inotify watches for this user, and our fallback */
+#define WATCH_LIMIT_PATH "/proc/sys/fs/inotify/max_user_watches"
+#define WATCH_DEFAULT_LIMIT 8192
+
+typedef enum {
+        WATCH_ACTION_UPDATE = 1,
+        WATCH_ACTION_REMOVE
+} WatchAction;
+
+typedef enum {
+        WATCH_JOB_WATCH = 0, /* Add watches for a set of roots */
+        WATCH_JOB_APPLY, /* Apply a batch of coalesced events */
+        WATCH_JOB_RESCAN /* Rescan the roots, once watches ran out */
+} WatchJobType;
+
+typedef struct WatchJob {
+        WatchJobType type;
+        BudgieLibraryWatcher *self;
+        guint serial;
+        GSList *removed;
+        gchar **paths;
+} WatchJob;
+
+/* Private storage */
+struct _BudgieLibraryWatcherPrivate {
+        BudgieDB *db;
+        int n_params;
+        const gchar **mimes;
+        gchar **roots;
+
+        /* Directory monitors keyed by path, shared with the job thread */
+        GMutex lock;
+        GHashTable *monitors;
+        guint max_watches;
+        gboolean overflow;
+        guint serial;
+        guint rescan_id;
+
+        /* Coalesced events keyed by path, main thread only */
+        GHashTable *pending;
+        gint64 first_event;
+        gint64 last_event;
+        guint flush_id;
+
+        /* Runs jobs one at a time, in order */
+        GThreadPool *pool;
+};
+
+G_DEFINE_TYPE_WITH_PRIVATE(BudgieLibraryWatcher, budgie_library_watcher, G_TYPE_OBJECT)
+
+/* Boilerplate GObject code */
+static void budgie_library_watcher_class_init(BudgieLibraryWatcherClass *klass);
+static void budgie_library_watcher_init(BudgieLibraryWatcher *self);
+static void budgie_library_watcher_dispose(GObject *object);
+
+static void event_cb(GFileMonitor *monitor,
+                     GFile *file,
+                     GFile *other_file,
+                     GFileMonitorEvent event_type,
+                     gpointer userdata);
+static void job_run(gpointer data, gpointer userdata);
+
+/* Initialisation */
+static void budgie_library_watcher_class_init(BudgieLibraryWatcherClass *klass)
+{
+        GObjectClass *g_object_class;
+
+        g_object_class = G_OBJECT_CLASS(klass);
+        g_object_class->dispose = &budgie_library_watcher_dispose;
+}
+
+static void monitor_free(gpointer data)
+{
+        g_file_monitor_cancel(G_FILE_MONITOR(data));
+        g_object_unref(data);
+}
+
+static void budgie_library_watcher_init(BudgieLibraryWatcher *self)
+{
+        gchar *contents = NULL;
+        glong limit = 0;
+
+        self->priv = budgie_library_watcher_get_instance_private(self);
+
+        g_mutex_init(&self->priv->lock);
+        self->priv->monitors = g_hash_table_new_full(g_str_hash, g_str_equal,
+                g_free, monitor_free);
+        self->priv->pending = g_hash_table_new_full(g_str_hash, g_str_equal,
+                g_free, NULL);
+        self->priv->pool = g_thread_pool_new(job_run, self, 1, FALSE, NULL);
+
+        /* Leave half of the watches for the rest of the session */
+        if (g_file_get_contents(WATCH_LIMIT_PATH, &contents, NULL, NULL)) {
+                limit = strtol(contents, NULL, 10);
+                g_free(contents);
+        }
+        if (limit <= 0) {
+                limit = WATCH_DEFAULT_LIMIT;
+        }
+        self->priv->max_watches = (guint)(limit / 2);
+}
+
+static void budgie_library_watcher_dispose(GObject *object)
+{
+        BudgieLibraryWatcher *self;
+
+        self = BUDGIE_LIBRARY_WATCHER(object);
+        if (self->priv->pool) {
+                g_thread_pool_free(self->priv->pool, TRUE, TRUE);
+                self->priv->pool = NULL;
+        }
+        if (self->priv->flush_id > 0) {
+                g_source_remove(self->priv->flush_id);
+                self->priv->flush_id = 0;
+        }
+        if (self->priv->rescan_id > 0) {
+                g_source_remove(self->priv->rescan_id);
+                self->priv->rescan_id = 0;
+        }
+        if (self->priv->monitors) {
+                g_hash_table_unref(self->priv->monitors);
+                self->priv->monitors = NULL;
+        }
+        if (self->priv->pending) {
+                g_hash_table_unref(self->priv->pending);
+                self->priv->pending = NULL;
+        }
+        if (self->priv->roots) {
+                g_strfreev(self->priv->roots);
+                self->priv->roots = NULL;
+        }
+        if (self->priv->db) {
+                g_object_unref(self->priv->db);
+                self->priv->db = NULL;
+        }
+
+        /* Destruct */
+        G_OBJECT_CLASS(budgie_library_watcher_parent_class)->dispose(object);
+}
+
+/* Utility; return a new BudgieLibraryWatcher */
+BudgieLibraryWatcher* budgie_library_watcher_new(BudgieDB *db,
+                                                 int n_params,
+                                                 const gchar **mimes)
+{
+        BudgieLibraryWatcher *self;
+
+        self = g_object_new(BUDGIE_LIBRARY_WATCHER_TYPE, NULL);
+        self->priv->db = g_object_ref(db);
+        self->priv->n_params = n_params;
+        self->priv->mimes = mimes;
+        return BUDGIE_LIBRARY_WATCHER(self);
+}
+
+static void job_push(BudgieLibraryWatcher *self, WatchJob *job)
+{
+        job->self = g_object_ref(self);
+        g_thread_pool_push(self->priv->pool, job, NULL);
+}
+
+/**
+ * Start watching a single directory, called from the job thread
+ * @return FALSE if no more watches may be added
+ */
+static gboolean watch_directory(BudgieLibraryWatcher *self,
+                                const gchar *path,
+                                guint serial,
+                                gboolean *existing)
+{
+        GFileMonitor *monitor = NULL;
+        GFile *file = NULL;
+        GError *error = NULL;
+        gboolean ret = FALSE;
+
+        *existing = FALSE;
+        g_mutex_lock(&self->priv->lock);
+        /* Directories were replaced since this job was queued */
+        if (serial != self->priv->serial || self->priv->overflow) {
+                goto end;
+        }
+        if (g_hash_table_contains(self->priv->monitors, path)) {
+                *existing = TRUE;
+                ret = TRUE;
+                goto end;
+        }
+        if (g_hash_table_size(self->priv->monitors) >= self->priv->max_watches) {
+                g_warning("Watch limit reached, periodically rescanning instead");
+                self->priv->overflow = TRUE;
+                goto end;
+        }
+
+        file = g_file_new_for_path(path);
+        monitor = g_file_monitor_directory(file, G_FILE_MONITOR_NONE,
+                NULL, &error);
+        g_object_unref(file);
+        if (!monitor) {
+                g_warning("Unable to watch %s, periodically rescanning instead: %s",
+                        path, error->message);
+                g_error_free(error);
+                self->priv->overflow = TRUE;
+                goto end;
+        }
+        g_signal_connect(monitor, "changed", G_CALLBACK(event_cb), self);
+        g_hash_table_insert(self->priv->monitors, g_strdup(path), monitor);
+        ret = TRUE;
+
+end:
+        g_mutex_unlock(&self->priv->lock);
+        return ret;
+}
+
+/**
+ * Watch a directory and everything beneath it, called from the job thread
+ * @return FALSE if no more watches may be added
+ */
+static gboolean watch_tree(BudgieLibraryWatcher *self,
+                           const gchar *path,
+                           guint serial)
+{
+        GFile *file = NULL;
+        GFileInfo *next_file;
+        GFileEnumerator *listing;
+        gchar *full_path = NULL;
+        gboolean existing;
+        gboolean ret;
+
+        ret = watch_directory(self, path, serial, &existing);
+        if (!ret || existing) {
+                return ret;
+        }
+
+        file = g_file_new_for_path(path);
+        listing = g_file_enumerate_children(file,
+                G_FILE_ATTRIBUTE_STANDARD_NAME "," G_FILE_ATTRIBUTE_STANDARD_TYPE,
+                G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL, NULL);
+        g_object_unref(file);
+        if (!listing) {
+                return TRUE;
+        }
+
+        while (ret && (next_file = g_file_enumerator_next_file(listing, NULL, NULL)) != NULL) {
+                if (g_file_info_get_file_type(next_file) == G_FILE_TYPE_DIRECTORY) {
+                        full_path = g_strdup_printf("%s/%s", path,
+                                g_file_info_get_name(next_file));
+                        ret = watch_tree(self, full_path, serial);
+                        g_free(full_path);
+                }
+                g_object_unref(next_file);
+        }
+        g_file_enumerator_close(listing, NULL, NULL);
+        g_object_unref(listing);
+
+        return ret;
+}
+
+static gboolean is_child_path(gpointer key, gpointer value, gpointer userdata)
+{
+        return g_str_has_prefix((gchar*)key, (gchar*)userdata);
+}
+
+/**
+ * Drop the watches for a removed directory and its children
+ */
+static void unwatch_tree(BudgieLibraryWatcher *self, const gchar *path)
+{
+        gchar *prefix = NULL;
+
+        g_mutex_lock(&self->priv->lock);
+        /* Only directories that were watched can have watched children */
+        if (g_hash_table_remove(self->priv->monitors, path)) {
+                prefix = g_strdup_printf("%s/", path);
+                g_hash_table_foreach_remove(self->priv->monitors,
+                        is_child_path, prefix);
+                g_free(prefix);
+        }
+        g_mutex_unlock(&self->priv->lock);
+}
+
+static gboolean rescan_cb(gpointer userdata)
+{
+        BudgieLibraryWatcher *self;
+        WatchJob *job = NULL;
+
+        self = BUDGIE_LIBRARY_WATCHER(userdata);
+        job = g_new0(WatchJob, 1);
+        job->type = WATCH_JOB_RESCAN;
+        job->paths = g_strdupv(self->priv->roots);
+        job_push(self, job);
+
+        return TRUE;
+}
+
+/**
+ * Back on the main loop once a job is complete
+ */
+static gboolean job_done_cb(gpointer userdata)
+{
+        WatchJob *job = userdata;
+        BudgieLibraryWatcher *self = job->self;
+        gboolean overflow;
+
+        g_mutex_lock(&self->priv->lock);
+        overflow = self->priv->overflow && job->serial == self->priv->serial;
+        g_mutex_unlock(&self->priv->lock);
+
+        if (job->type == WATCH_JOB_WATCH && overflow && self->priv->rescan_id == 0) {
+                self->priv->rescan_id = g_timeout_add_seconds(WATCH_RESCAN_INTERVAL,
+                        rescan_cb, self);
+        }
+
+        g_slist_free_full(job->removed, g_free);
+        g_strfreev(job->paths);
+        g_free(job);
+        g_object_unref(self);
+
+        return FALSE;
+}
+
+/**
+ * Job thread, watches, applies or rescans
+ */
+static void job_run(gpointer data, gpointer userdata)
+{
+        WatchJob *job = data;
+        BudgieLibraryWatcher *self = job->self;
+        guint i;
+
+        switch (job->type) {
+                case WATCH_JOB_WATCH:
+                        for (i=0; job->paths[i] != NULL; i++) {
+                                if (!watch_tree(self, job->paths[i], job->serial))
+                                        break;
+                        }
+                        break;
+                case WATCH_JOB_APPLY:
+                        budgie_db_remove_paths(self->priv->db, job->removed);
+                        /* New directories need watching too */
+                        for (i=0; job->paths[i] != NULL; i++) {
+                                if (g_file_test(job->paths[i], G_FILE_TEST_IS_DIR))
+                                        watch_tree(self, job->paths[i], job->serial);
+                        }
+                        budgie_scanner_scan(self->priv->db, job->paths,
+                                self->priv->n_params, self->priv->mimes, 1,
+                                NULL, NULL);
+                        break;
+                case WATCH_JOB_RESCAN:
+                        budgie_scanner_scan(self->priv->db, job->paths,
+                                self->priv->n_params, self->priv->mimes, 0,
+                                NULL, NULL);
+                        break;
+        }
+
+        g_idle_add(job_done_cb, job);
+}
+
+/**
+ * Hand the coalesced events to the job thread once things settle down
+ */
+static gboolean flush_cb(gpointer userdata)
+{
+        BudgieLibraryWatcher *self;
+        GHashTableIter iter;
+        gpointer key, value;
+        GPtrArray *updated = NULL;
+        WatchJob *job = NULL;
+        gint64 now;
+
+        self = BUDGIE_LIBRARY_WATCHER(userdata);
+        now = g_get_monotonic_time();
+        if (now - self->priv->last_event < WATCH_SETTLE_MS * 1000 &&
+            now - self->priv->first_event < WATCH_MAX_DELAY) {
+                return TRUE;
+        }
+
+        job = g_new0(WatchJob, 1);
+        job->type = WATCH_JOB_APPLY;
+        g_mutex_lock(&self->priv->lock);
+        job->serial = self->priv->serial;
+        g_mutex_unlock(&self->priv->lock);
+
+        updated = g_ptr_array_new();
+        g_hash_table_iter_init(&iter, self->priv->pending);
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+                if (GPOINTER_TO_INT(value) == WATCH_ACTION_REMOVE) {
+                        job->removed = g_slist_prepend(job->removed, g_strdup(key));
+                } else {
+                        g_ptr_array_add(updated, g_strdup(key));
+                }
+        }
+        g_ptr_array_add(updated, NULL);
+        job->paths = (gchar**)g_ptr_array_free(updated, FALSE);
+        g_hash_table_remove_all(self->priv->pending);
+
+        job_push(self, job);
+        self->priv->flush_id = 0;
+
+        return FALSE;
+}
+
+/**
+ * Collect an event, the most recent event for a path wins
+ */
+static void event_cb(GFileMonitor *monitor,
+                     GFile *file,
+                     GFile *other_file,
+                     GFileMonitorEvent event_type,
+                     gpointer userdata)
+{
+        BudgieLibraryWatcher *self;
+        WatchAction action;
+        gchar *path = NULL;
+
+        self = BUDGIE_LIBRARY_WATCHER(userdata);
+        switch (event_type) {
+                case G_FILE_MONITOR_EVENT_CREATED:
+                case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+                case G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED:
+                        action = WATCH_ACTION_UPDATE;
+                        break;
+                case G_FILE_MONITOR_EVENT_DELETED:
+                        action = WATCH_ACTION_REMOVE;
+                        break;
+                default:
+                        /* Partial writes are picked up by the done hint */
+                        return;
+        }
+
+        path = g_file_get_path(file);
+        if (!path) {
+                return;
+        }
+        if (action == WATCH_ACTION_REMOVE) {
+                unwatch_tree(self, path);
+        }
+        g_hash_table_replace(self->priv->pending, path, GINT_TO_POINTER(action));
+
+        self->priv->last_event = g_get_monotonic_time();
+        if (self->priv->flush_id == 0) {
+                self->priv->first_event = self->priv->last_event;
+                self->priv->flush_id = g_timeout_add(WATCH_SETTLE_MS,
+                        flush_cb, self);
+        }
+}
+
+void budgie_library_watcher_set_directories(BudgieLibraryWatcher *self,
+                                            gchar **dirs)
+{
+        WatchJob *job = NULL;
+
+        g_return_if_fail(self != NULL);
+
+        g_mutex_lock(&self->priv->lock);
+        self->priv->serial++;
+        self->priv->overflow = FALSE;
+        g_hash_table_remove_all(self->priv->monitors);
+        g_mutex_unlock(&self->priv->lock);
+
+        if (self->priv->rescan_id > 0) {
+                g_source_remove(self->priv->rescan_id);
+                self->priv->rescan_id = 0;
+        }
+        if (self->priv->roots) {
+                g_strfreev(self->priv->roots);
+        }
+        self->priv->roots = g_strdupv(dirs);
+
+        /* Walking the tree may take a while, so do it off the main loop */
+        job = g_new0(WatchJob, 1);
+        job->type = WATCH_JOB_WATCH;
+        job->serial = self->priv->serial;
+        job->paths = g_strdupv(dirs);
+        job_push(self, job);
+}
@@ -0,0 +1,85 @@
+/*
+ * budgie-library-watcher.h
+ * 
+ * Copyright 2013 Ikey Doherty <ikey.doherty@gmail.com>
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ * 
+ * 
+ */
+#ifndef budgie_library_watcher_h
+#define budgie_library_watcher_h
+
+#include <glib-object.h>
+
+#include "db/budgie-db.h"
+
+typedef struct _BudgieLibraryWatcher BudgieLibraryWatcher;
+typedef struct _BudgieLibraryWatcherClass   BudgieLibraryWatcherClass;
+typedef struct _BudgieLibraryWatcherPrivate BudgieLibraryWatcherPrivate;
+
+#define BUDGIE_LIBRARY_WATCHER_TYPE (budgie_library_watcher_get_type())
+#define BUDGIE_LIBRARY_WATCHER(obj)                  (G_TYPE_CHECK_INSTANCE_CAST ((obj), BUDGIE_LIBRARY_WATCHER_TYPE, BudgieLibraryWatcher))
+#define IS_BUDGIE_LIBRARY_WATCHER(obj)               (G_TYPE_CHECK_INSTANCE_TYPE ((obj), BUDGIE_LIBRARY_WATCHER_TYPE))
+#define BUDGIE_LIBRARY_WATCHER_CLASS(klass)          (G_TYPE_CHECK_CLASS_CAST ((klass), BUDGIE_LIBRARY_WATCHER_TYPE, BudgieLibraryWatcherClass))
+#define IS_BUDGIE_LIBRARY_WATCHER_CLASS(klass)       (G_TYPE_CHECK_CLASS_TYPE ((klass), BUDGIE_LIBRARY_WATCHER_TYPE))
+#define BUDGIE_LIBRARY_WATCHER_GET_CLASS(obj)        (G_TYPE_INSTANCE_GET_CLASS ((obj), BUDGIE_LIBRARY_WATCHER_TYPE, BudgieLibraryWatcherClass))
+
+/* BudgieLibraryWatcher object */
+struct _BudgieLibraryWatcher {
+        GObject parent;
+
+        BudgieLibraryWatcherPrivate *priv;
+};
+
+/* BudgieLibraryWatcher class definition */
+struct _BudgieLibraryWatcherClass {
+        GObjectClass parent_class;
+};
+
+GType budgie_library_watcher_get_type(void);
+
+/* BudgieLibraryWatcher methods */
+
+/**
+ * Construct a new BudgieLibraryWatcher
+ *
+ * File system events are collected and coalesced, then applied to the
+ * database in small batches once the tree has settled. Views follow
+ * the changes through the database's own signals.
+ *
+ * @param db Database to keep up to date
+ * @param n_params Number of following mime type prefixes
+ * @param mimes Array of mime prefixes to watch (i.e. audio/), which
+ * must remain valid for the lifetime of the watcher
+ * @return A new BudgieLibraryWatcher
+ */
+BudgieLibraryWatcher* budgie_library_watcher_new(BudgieDB *db,
+                                                 int n_params,
+                                                 const gchar **mimes);
+
+/**
+ * Set the directories to watch, replacing any existing watches
+ *
+ * If the kernel watch limit would be exceeded, the watcher falls back
+ * to periodically rescanning the directories instead.
+ *
+ * @param dirs NULL terminated array of directories to watch
+ */
+void budgie_library_watcher_set_directories(BudgieLibraryWatcher *self,
+                                            gchar **dirs);
+
+#endif /* budgie_library_watcher_h */
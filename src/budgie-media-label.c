@@ -138,7 +138,7 @@ static void budgie_media_label_dispose(GObject *object)
 
         self = BUDGIE_MEDIA_LABEL(object);
         if (self->info) {
-                free_media_info(self->info);
+                media_info_unref(self->info);
                 self->info = NULL;
         }
         /* Destruct */
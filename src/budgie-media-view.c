@@ -24,6 +24,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <glib/gstdio.h>
 
 #include "budgie-media-view.h"
 #include "budgie-media-label.h"
@@ -36,9 +37,62 @@ static void budgie_media_view_class_init(BudgieMediaViewClass *klass);
 static void budgie_media_view_init(BudgieMediaView *self);
 static void budgie_media_view_dispose(GObject *object);
 
-static gboolean update_db_t(gpointer userdata);
-static gpointer update_db(gpointer userdata);
+static void update_db(BudgieMediaView *self);
+static void refresh_albums(BudgieMediaView *self);
+static void show_albums(BudgieMediaView *self, GArray *albums);
+static gboolean fill_albums(gpointer userdata);
+static void stop_albums(BudgieMediaView *self);
+static void library_changed_cb(BudgieLibrary *library, gpointer userdata);
+static void albums_ready_cb(GObject *source,
+                            GAsyncResult *result,
+                            gpointer userdata);
+static void album_art_thread(GTask *task,
+                             gpointer source,
+                             gpointer task_data,
+                             GCancellable *cancellable);
+static void album_art_ready_cb(GObject *source,
+                               GAsyncResult *result,
+                               gpointer userdata);
+static void queue_album_art(BudgieMediaView *self);
+static void clear_album_art(BudgieMediaView *self);
+static gchar *album_thumb_path(const gchar *cover);
+static GdkPixbuf *album_thumb_load(const gchar *path, gint64 mtime);
+static void album_thumb_save(const gchar *path, gint64 mtime, GdkPixbuf *pixbuf);
+static gchar *album_placeholder_name(BudgieMediaView *self);
+static void load_album_placeholder(BudgieMediaView *self);
+static void album_placeholder_thread(GTask *task,
+                                     gpointer source,
+                                     gpointer task_data,
+                                     GCancellable *cancellable);
+static void album_placeholder_ready_cb(GObject *source,
+                                       GAsyncResult *result,
+                                       gpointer userdata);
+static void prune_album_thumbs(BudgieMediaView *self);
+static void prune_album_thumbs_thread(GTask *task,
+                                      gpointer source,
+                                      gpointer task_data,
+                                      GCancellable *cancellable);
+static void items_changed_cb(BudgieDB *db, GArray *ids, gpointer userdata);
+static void items_removed_cb(BudgieDB *db, GArray *ids, gpointer userdata);
+static void remove_tracks(BudgieMediaView *self, GArray *ids);
 static void set_display(BudgieMediaView *self, GPtrArray *results);
+static void album_tracks_cb(GObject *source,
+                            GAsyncResult *result,
+                            gpointer userdata);
+static void load_tracks(BudgieMediaView *self, const gchar *mime);
+static GPtrArray *library_tracks(BudgieMediaView *self, guint max);
+static gboolean more_library_tracks(gpointer userdata);
+static void show_album_tracks(BudgieMediaView *self, GPtrArray *results);
+static void search_results_cb(GObject *source,
+                              GAsyncResult *result,
+                              gpointer userdata);
+static void first_tracks_cb(GObject *source,
+                            GAsyncResult *result,
+                            gpointer userdata);
+static void more_tracks_cb(GObject *source,
+                           GAsyncResult *result,
+                           gpointer userdata);
+static void stop_loading(BudgieMediaView *self);
 static void item_activated_cb(GtkWidget *widget,
                               GtkTreePath *tree_path,
                               gpointer userdata);
@@ -48,6 +102,7 @@ static void list_selection_cb(GtkTreeView *list,
                               GtkTreeViewColumn *column,
                               gpointer userdata);
 
+static void cover_size(GdkPixbuf *base, gint *width, gint *height);
 static GdkPixbuf *beautify(GdkPixbuf **source,
                            GdkPixbuf *base,
                            GdkPixbuf *overlay);
@@ -63,9 +118,43 @@ static void budgie_media_view_set_property(GObject *object,
                                            GParamSpec *pspec);
 
 enum {
-        PROP_0, PROP_DATABASE, N_PROPERTIES
+        PROP_0, PROP_DATABASE, PROP_LIBRARY, PROP_ART_CACHE, N_PROPERTIES
 };
 
+/* How long to gather database changes before refreshing albums (ms) */
+#define ALBUM_REFRESH_DELAY 1000
+
+/* Rows in the first page of tracks, and in each page after */
+#define TRACKS_FIRST_PAGE 100
+#define TRACKS_PAGE 500
+
+/* Time spent putting albums into the grid per idle callback (us), well
+ * inside a 16ms frame */
+#define ALBUM_FILL_BUDGET 8000
+
+/* Album art is decoded for the visible albums and this many either
+ * side, and dropped once an album is further away than ALBUM_ART_KEEP.
+ * At most ALBUM_ART_JOBS covers are decoded at once. */
+#define ALBUM_ART_PREFETCH 24
+#define ALBUM_ART_KEEP 120
+#define ALBUM_ART_JOBS 4
+
+/* Framed covers are kept in the user cache directory, until no album in
+ * the grid uses them, see prune_album_thumbs. Bump the frame version
+ * whenever album-base.png, album-overlay.png or beautify change, so that
+ * older thumbnails are rebuilt. */
+#define ALBUM_THUMB_DIR "budgie/album-thumbnails"
+#define ALBUM_THUMB_MAGIC "BUDGIETH"
+#define ALBUM_THUMB_FRAME 1
+
+/* Where the cover sits within the frame */
+#define COVER_X_PAD 20
+#define COVER_Y_PAD 6
+
+/* Shortest search worth running, and how many matches to show */
+#define SEARCH_MIN_LENGTH 2
+#define SEARCH_MAX_RESULTS 500
+
 struct LoadStruct {
         BudgieMediaView *self;
         gpointer data;
@@ -77,8 +166,16 @@ enum {
         ALBUM_ALBUM,
         ALBUM_ARTIST,
         ALBUM_ART_PATH,
+        ALBUM_ART_STATE,
         ALBUM_COLUMNS
 };
+
+/* Whether an album shows its cover, see queue_album_art */
+enum {
+        ART_PLACEHOLDER = 0,
+        ART_LOADING,
+        ART_LOADED
+};
 static GParamSpec *obj_properties[N_PROPERTIES] = { NULL, };
 
 /* Initialisation */
@@ -90,6 +187,13 @@ static void budgie_media_view_class_init(BudgieMediaViewClass *klass)
         obj_properties[PROP_DATABASE] =
         g_param_spec_pointer("database", "Database", "Database",
                 G_PARAM_CONSTRUCT | G_PARAM_WRITABLE);
+        obj_properties[PROP_LIBRARY] =
+        g_param_spec_pointer("library", "Library", "Library snapshot",
+                G_PARAM_WRITABLE);
+
+        obj_properties[PROP_ART_CACHE] =
+        g_param_spec_pointer("art-cache", "Art cache", "Decoded album art",
+                G_PARAM_WRITABLE);
 
         g_object_class->dispose = &budgie_media_view_dispose;
         g_object_class->set_property = &budgie_media_view_set_property;
@@ -103,13 +207,6 @@ static void budgie_media_view_class_init(BudgieMediaViewClass *klass)
                 1, G_TYPE_POINTER);
 }
 
-static gboolean update_db_t(gpointer userdata)
-{
-        __attribute__((unused)) GThread *thread;
-        thread = g_thread_new("update-db", &update_db, userdata);
-        return FALSE;
-}
-
 static void budgie_media_view_set_property(GObject *object,
                                            guint prop_id,
                                            const GValue *value,
@@ -120,10 +217,32 @@ static void budgie_media_view_set_property(GObject *object,
         self = BUDGIE_MEDIA_VIEW(object);
         switch (prop_id) {
                 case PROP_DATABASE:
+                        if (self->db) {
+                                g_signal_handlers_disconnect_by_data(self->db, self);
+                        }
                         self->db = g_value_get_pointer((GValue*)value);
                         if (!self->db)
                                 return;
-                        g_idle_add(update_db_t, self);
+                        g_signal_connect(self->db, "items-added",
+                                G_CALLBACK(items_changed_cb), self);
+                        g_signal_connect(self->db, "items-changed",
+                                G_CALLBACK(items_changed_cb), self);
+                        g_signal_connect(self->db, "items-removed",
+                                G_CALLBACK(items_removed_cb), self);
+                        update_db(self);
+                        break;
+                case PROP_LIBRARY:
+                        if (self->library) {
+                                g_signal_handlers_disconnect_by_data(self->library, self);
+                        }
+                        self->library = g_value_get_pointer((GValue*)value);
+                        if (!self->library)
+                                return;
+                        g_signal_connect(self->library, "changed",
+                                G_CALLBACK(library_changed_cb), self);
+                        break;
+                case PROP_ART_CACHE:
+                        self->art_cache = g_value_get_pointer((GValue*)value);
                         break;
                 default:
                         G_OBJECT_WARN_INVALID_PROPERTY_ID (object,
@@ -144,6 +263,12 @@ static void budgie_media_view_get_property(GObject *object,
                 case PROP_DATABASE:
                         g_value_set_pointer((GValue *)value, self->db);
                         break;
+                case PROP_LIBRARY:
+                        g_value_set_pointer((GValue *)value, self->library);
+                        break;
+                case PROP_ART_CACHE:
+                        g_value_set_pointer((GValue *)value, self->art_cache);
+                        break;
                 default:
                         G_OBJECT_WARN_INVALID_PROPERTY_ID (object,
                                 prop_id, pspec);
@@ -157,6 +282,7 @@ static void budgie_media_view_init(BudgieMediaView *self)
         GtkWidget *main_layout;
         GtkWidget *stack;
         GtkWidget *icon_view, *scroll;
+        GtkListStore *model;
         GtkWidget *button;
         GtkStyleContext *style;
         GtkWidget *view_page;
@@ -212,7 +338,13 @@ static void budgie_media_view_init(BudgieMediaView *self)
         self->stack = stack;
 
         /* Set up our icon view */
-        icon_view = gtk_icon_view_new();
+        model = gtk_list_store_new(ALBUM_COLUMNS, G_TYPE_STRING,
+                GDK_TYPE_PIXBUF, G_TYPE_STRING, G_TYPE_STRING,
+                G_TYPE_STRING, G_TYPE_INT);
+        gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(model),
+                ALBUM_TITLE, GTK_SORT_ASCENDING);
+        icon_view = gtk_icon_view_new_with_model(GTK_TREE_MODEL(model));
+        g_object_unref(model);
         self->icon_view = icon_view;
         scroll = gtk_scrolled_window_new(NULL, NULL);
         gtk_scrolled_window_set_kinetic_scrolling(GTK_SCROLLED_WINDOW(scroll),
@@ -220,6 +352,21 @@ static void budgie_media_view_init(BudgieMediaView *self)
         gtk_container_add(GTK_CONTAINER(scroll), icon_view);
         gtk_stack_add_named(GTK_STACK(stack), scroll, "albums");
 
+        /* Covers follow the visible range */
+        g_signal_connect_swapped(gtk_scrolled_window_get_vadjustment(
+                GTK_SCROLLED_WINDOW(scroll)), "value-changed",
+                G_CALLBACK(queue_album_art), self);
+        g_signal_connect_swapped(icon_view, "size-allocate",
+                G_CALLBACK(queue_album_art), self);
+
+        /* Every album starts out with the bare frame, once it's loaded */
+        self->album_base = gdk_pixbuf_new_from_file(DATADIR "/budgie/album-base.png", NULL);
+        self->album_overlay = gdk_pixbuf_new_from_file(DATADIR "/budgie/album-overlay.png", NULL);
+        load_album_placeholder(self);
+        self->album_art = g_hash_table_new_full(g_str_hash, g_str_equal,
+                g_free, (GDestroyNotify)gtk_tree_row_reference_free);
+        self->art_queue = g_queue_new();
+
         /* Relevant columns */
         gtk_icon_view_set_markup_column(GTK_ICON_VIEW(icon_view),
                 ALBUM_TITLE);
@@ -258,6 +405,12 @@ static void budgie_media_view_init(BudgieMediaView *self)
         self->video_tracks = view_page;
         g_signal_connect(BUDGIE_TRACK_LIST(view_page)->list, "row-activated",
                          G_CALLBACK(list_selection_cb), self);
+
+        view_page = budgie_track_list_new();
+        gtk_stack_add_named(GTK_STACK(stack), view_page, "search-tracks");
+        self->search_tracks = view_page;
+        g_signal_connect(BUDGIE_TRACK_LIST(view_page)->list, "row-activated",
+                         G_CALLBACK(list_selection_cb), self);
 }
 
 static void budgie_media_view_dispose(GObject *object)
@@ -266,6 +419,40 @@ static void budgie_media_view_dispose(GObject *object)
 
         self = BUDGIE_MEDIA_VIEW(object);
 
+        stop_loading(self);
+        if (self->db) {
+                g_signal_handlers_disconnect_by_data(self->db, self);
+                self->db = NULL;
+        }
+        if (self->library) {
+                g_signal_handlers_disconnect_by_data(self->library, self);
+                self->library = NULL;
+        }
+        if (self->album_refresh_id > 0) {
+                g_source_remove(self->album_refresh_id);
+                self->album_refresh_id = 0;
+        }
+        stop_albums(self);
+        if (self->album_cancellable) {
+                g_cancellable_cancel(self->album_cancellable);
+                g_object_unref(self->album_cancellable);
+                self->album_cancellable = NULL;
+        }
+        if (self->art_queue) {
+                clear_album_art(self);
+                g_queue_free(self->art_queue);
+                self->art_queue = NULL;
+                g_hash_table_unref(self->album_art);
+                self->album_art = NULL;
+        }
+        if (self->placeholder_cancellable) {
+                g_cancellable_cancel(self->placeholder_cancellable);
+                g_clear_object(&self->placeholder_cancellable);
+        }
+        g_clear_object(&self->album_base);
+        g_clear_object(&self->album_overlay);
+        g_clear_object(&self->album_placeholder);
+
         if (self->results) {
                 g_ptr_array_free(self->results, TRUE);
                 self->results = NULL;
@@ -289,93 +476,894 @@ GtkWidget* budgie_media_view_new(BudgieDB *database)
         return GTK_WIDGET(self);
 }
 
-static gpointer update_db(gpointer userdata)
+/**
+ * Header of a cached thumbnail, followed by the pixel rows as held by
+ * the GdkPixbuf, so that loading one is a single read
+ */
+typedef struct AlbumThumbHeader {
+        gchar magic[8];
+        guint32 frame; /* ALBUM_THUMB_FRAME when written */
+        guint32 has_alpha;
+        gint64 mtime; /* Of the cover it was made from */
+        guint32 width;
+        guint32 height;
+        guint32 rowstride;
+        guint32 reserved;
+} AlbumThumbHeader;
+
+/**
+ * A cover to decode for the album grid
+ */
+typedef struct AlbumArtJob {
+        gchar *album;
+        gchar *path;
+        GdkPixbuf *base;
+        GdkPixbuf *overlay;
+        BudgieArtCache *cache;
+} AlbumArtJob;
+
+static void album_art_job_free(gpointer data)
 {
-        BudgieMediaView *self;
-        GtkListStore *model;
-        GPtrArray *albums = NULL;
-        GPtrArray *results = NULL;
-        GdkPixbuf *pixbuf;
-        GdkPixbuf *base, *overlay;
+        AlbumArtJob *job = data;
+
+        g_free(job->album);
+        g_free(job->path);
+        g_object_unref(job->base);
+        g_object_unref(job->overlay);
+        if (job->cache) {
+                g_object_unref(job->cache);
+        }
+        g_slice_free(AlbumArtJob, job);
+}
+
+static gchar *album_markup(AlbumInfo *info)
+{
+        /* Pretty label */
+        return g_markup_printf_escaped("<big>%s\n<span color='#707070'>%s</span></big>",
+                info->album, info->band ? info->band : info->artist);
+}
+
+static gchar *album_art_path(AlbumInfo *info)
+{
+        MediaInfo current = { 0 };
+        gchar *album_id, *path;
+
+        /* Enough of a MediaInfo to find the album art */
+        current.album = info->album;
+        current.artist = info->artist;
+
+        album_id = albumart_name_for_media(&current, "jpeg");
+        if (!album_id) {
+                return NULL;
+        }
+        path = g_strdup_printf("%s/media-art/%s", g_get_user_cache_dir(),
+                album_id);
+        g_free(album_id);
+
+        return path;
+}
+
+/**
+ * Map each album in the model to its row
+ */
+static GHashTable *album_rows(GtkTreeModel *model)
+{
+        GHashTable *rows;
         GtkTreeIter iter;
-        gchar *album = NULL;
-        gchar *markup = NULL;
-        MediaInfo *current;
-        const gchar *cache;
-        gchar *album_id = NULL, *path = NULL;
-        int i;
+        gboolean valid;
+        gchar *album;
+
+        rows = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                (GDestroyNotify)gtk_tree_iter_free);
+        valid = gtk_tree_model_get_iter_first(model, &iter);
+        while (valid) {
+                gtk_tree_model_get(model, &iter, ALBUM_ALBUM, &album, -1);
+                g_hash_table_insert(rows, album, gtk_tree_iter_copy(&iter));
+                valid = gtk_tree_model_iter_next(model, &iter);
+        }
+
+        return rows;
+}
+
+/**
+ * Load the album grid, see refresh_albums
+ */
+static void update_db(BudgieMediaView *self)
+{
+        GtkListStore *model;
+
+        if (self->album_refresh_id > 0) {
+                g_source_remove(self->album_refresh_id);
+                self->album_refresh_id = 0;
+        }
+
+        /* A different database shares nothing with the current model */
+        model = GTK_LIST_STORE(gtk_icon_view_get_model(GTK_ICON_VIEW(self->icon_view)));
+        stop_albums(self);
+        clear_album_art(self);
+        gtk_list_store_clear(model);
+        if (self->album_cancellable) {
+                g_cancellable_cancel(self->album_cancellable);
+                g_object_unref(self->album_cancellable);
+                self->album_cancellable = NULL;
+        }
+        self->albums_dirty = FALSE;
+
+        refresh_albums(self);
+}
+
+/**
+ * Bring the album grid up to date with the database. Albums are fetched
+ * on the database's pool, or taken from the library snapshot, and
+ * compared with the model a slice at a time, see fill_albums. New and
+ * changed albums go in with the bare frame, and their covers are loaded
+ * once scrolled near, see queue_album_art.
+ */
+static void refresh_albums(BudgieMediaView *self)
+{
+        /* The library's first "changed" fills the grid */
+        if (self->library && !budgie_library_is_loaded(self->library)) {
+                return;
+        }
+
+        /* Only one refresh at a time, so both see the model settled */
+        if (self->album_cancellable) {
+                self->albums_dirty = TRUE;
+                return;
+        }
+        self->album_cancellable = g_cancellable_new();
+
+        if (self->library) {
+                show_albums(self, budgie_library_get_albums(self->library));
+                return;
+        }
+
+        budgie_db_get_albums_async(self->db, self->album_cancellable,
+                albums_ready_cb, self);
+}
+
+static void albums_done(BudgieMediaView *self)
+{
+        g_object_unref(self->album_cancellable);
+        self->album_cancellable = NULL;
+
+        if (self->albums_dirty) {
+                self->albums_dirty = FALSE;
+                refresh_albums(self);
+        }
+}
+
+static gboolean album_refresh_cb(gpointer userdata)
+{
+        BudgieMediaView *self;
 
         self = BUDGIE_MEDIA_VIEW(userdata);
+        self->album_refresh_id = 0;
+        refresh_albums(self);
+
+        return FALSE;
+}
 
-        /* No albums */
-        if (!budgie_db_get_all_by_field(self->db, MEDIA_QUERY_ALBUM, &albums)) {
+static void albums_ready_cb(GObject *source,
+                            GAsyncResult *result,
+                            gpointer userdata)
+{
+        GArray *albums;
+
+        albums = budgie_db_get_albums_finish(BUDGIE_DB(source), result, NULL);
+        if (!albums) {
+                /* Cancelled, self may be gone */
+                return;
+        }
+        show_albums(BUDGIE_MEDIA_VIEW(userdata), albums);
+}
+
+/**
+ * Start diffing the albums against the model. The first slice goes in
+ * right away and the rest when idle, so a large library fills the grid
+ * progressively. Takes ownership of albums.
+ */
+static void show_albums(BudgieMediaView *self, GArray *albums)
+{
+        GtkTreeModel *model;
+
+        if (albums->len == 0) {
                 fprintf(stderr, "No albums found\n");
+        }
+
+        model = gtk_icon_view_get_model(GTK_ICON_VIEW(self->icon_view));
+        self->album_list = albums;
+        self->albums_pos = 0;
+        self->albums_left = album_rows(model);
+
+        if (fill_albums(self)) {
+                self->albums_idle = g_idle_add(fill_albums, self);
+        }
+}
+
+/**
+ * Put in the next albums that are new or changed, for no longer than
+ * ALBUM_FILL_BUDGET. Once all are in, rows no album matched are removed.
+ */
+static gboolean fill_albums(gpointer userdata)
+{
+        BudgieMediaView *self;
+        GtkTreeModel *model;
+        GHashTableIter it;
+        GtkTreeIter *iter, added;
+        AlbumInfo *info;
+        gchar *markup, *expected, *artist, *path;
+        gboolean same, gone;
+        gint64 end;
+
+        self = BUDGIE_MEDIA_VIEW(userdata);
+        model = gtk_icon_view_get_model(GTK_ICON_VIEW(self->icon_view));
+        end = g_get_monotonic_time() + ALBUM_FILL_BUDGET;
+
+        while (self->albums_pos < self->album_list->len) {
+                /* Checking the clock for every album costs more than it saves */
+                if ((self->albums_pos & 15) == 15 &&
+                        g_get_monotonic_time() >= end) {
+                        queue_album_art(self);
+                        return TRUE;
+                }
+                info = &g_array_index(self->album_list, AlbumInfo, self->albums_pos);
+                self->albums_pos++;
+
+                expected = album_markup(info);
+                iter = g_hash_table_lookup(self->albums_left, info->album);
+                if (iter) {
+                        /* Same label and artist means the same art */
+                        gtk_tree_model_get(model, iter, ALBUM_TITLE, &markup,
+                                ALBUM_ARTIST, &artist, -1);
+                        same = g_str_equal(markup, expected) &&
+                                g_strcmp0(artist, info->artist) == 0;
+                        g_free(markup);
+                        g_free(artist);
+                        if (same) {
+                                g_hash_table_remove(self->albums_left, info->album);
+                                g_free(expected);
+                                continue;
+                        }
+                        g_hash_table_remove(self->album_art, info->album);
+                }
+
+                path = album_art_path(info);
+                if (iter) {
+                        gtk_list_store_set(GTK_LIST_STORE(model), iter,
+                                ALBUM_TITLE, expected,
+                                ALBUM_PIXBUF, self->album_placeholder,
+                                ALBUM_ARTIST, info->artist,
+                                ALBUM_ART_PATH, path,
+                                ALBUM_ART_STATE, ART_PLACEHOLDER,
+                                -1);
+                        g_hash_table_remove(self->albums_left, info->album);
+                } else {
+                        /* Lands in its sorted place, so the grid can be
+                         * shown while it fills */
+                        gtk_list_store_insert_with_values(GTK_LIST_STORE(model),
+                                &added, -1,
+                                ALBUM_TITLE, expected,
+                                ALBUM_PIXBUF, self->album_placeholder,
+                                ALBUM_ALBUM, info->album,
+                                ALBUM_ARTIST, info->artist,
+                                ALBUM_ART_PATH, path,
+                                ALBUM_ART_STATE, ART_PLACEHOLDER,
+                                -1);
+                }
+                g_free(expected);
+                g_free(path);
+        }
+
+        /* Whatever is left has gone */
+        gone = g_hash_table_size(self->albums_left) > 0;
+        g_hash_table_iter_init(&it, self->albums_left);
+        while (g_hash_table_iter_next(&it, NULL, (gpointer*)&iter)) {
+                gtk_list_store_remove(GTK_LIST_STORE(model), iter);
+        }
+        self->albums_idle = 0;
+        stop_albums(self);
+
+        /* Once at startup for albums lost while closed, then whenever
+         * a scan takes some away */
+        if (gone || !self->thumbs_pruned) {
+                self->thumbs_pruned = TRUE;
+                prune_album_thumbs(self);
+        }
+
+        albums_done(self);
+        queue_album_art(self);
+        return FALSE;
+}
+
+/**
+ * Forget the albums still to be put in the grid
+ */
+static void stop_albums(BudgieMediaView *self)
+{
+        if (self->albums_idle > 0) {
+                g_source_remove(self->albums_idle);
+                self->albums_idle = 0;
+        }
+        if (self->album_list) {
+                g_array_unref(self->album_list);
+                self->album_list = NULL;
+        }
+        if (self->albums_left) {
+                g_hash_table_unref(self->albums_left);
+                self->albums_left = NULL;
+        }
+}
+
+/**
+ * Drop every cover, and forget any still being decoded
+ */
+static void clear_album_art(BudgieMediaView *self)
+{
+        if (self->art_cancellable) {
+                g_cancellable_cancel(self->art_cancellable);
+                g_object_unref(self->art_cancellable);
+                self->art_cancellable = NULL;
+        }
+        if (self->art_update_id > 0) {
+                g_source_remove(self->art_update_id);
+                self->art_update_id = 0;
+        }
+        g_queue_free_full(self->art_queue,
+                (GDestroyNotify)gtk_tree_row_reference_free);
+        self->art_queue = g_queue_new();
+        g_hash_table_remove_all(self->album_art);
+        self->art_jobs = 0;
+}
+
+/**
+ * Where the framed thumbnail of a cover is cached. The cover's name is
+ * already its art key.
+ */
+static gchar *album_thumb_path(const gchar *cover)
+{
+        gchar *name, *ret;
+
+        name = g_path_get_basename(cover);
+        ret = g_strdup_printf("%s/%s/%s.thumb", g_get_user_cache_dir(),
+                ALBUM_THUMB_DIR, name);
+        g_free(name);
+
+        return ret;
+}
+
+/**
+ * The bare frame's name in the thumbnail cache. Like the covers it is
+ * only composed once for each frame version and size.
+ */
+static gchar *album_placeholder_name(BudgieMediaView *self)
+{
+        return g_strdup_printf("frame-%d-%dx%d", ALBUM_THUMB_FRAME,
+                gdk_pixbuf_get_width(self->album_base),
+                gdk_pixbuf_get_height(self->album_base));
+}
+
+/**
+ * Load the bare frame in a worker thread. Albums put in the grid before
+ * it arrives are left blank until then, see album_placeholder_ready_cb.
+ */
+static void load_album_placeholder(BudgieMediaView *self)
+{
+        AlbumArtJob *job;
+        GTask *task;
+
+        job = g_slice_new0(AlbumArtJob);
+        job->path = album_placeholder_name(self);
+        job->base = g_object_ref(self->album_base);
+        job->overlay = g_object_ref(self->album_overlay);
+
+        self->placeholder_cancellable = g_cancellable_new();
+        task = g_task_new(self, self->placeholder_cancellable,
+                album_placeholder_ready_cb, NULL);
+        g_task_set_task_data(task, job, album_art_job_free);
+        g_task_run_in_thread(task, album_placeholder_thread);
+        g_object_unref(task);
+}
+
+static void album_placeholder_thread(GTask *task,
+                                     gpointer source,
+                                     gpointer task_data,
+                                     GCancellable *cancellable)
+{
+        AlbumArtJob *job = task_data;
+        GdkPixbuf *pixbuf;
+        gchar *thumb;
+
+        thumb = album_thumb_path(job->path);
+        pixbuf = album_thumb_load(thumb, 0);
+        if (!pixbuf) {
+                pixbuf = beautify(NULL, job->base, job->overlay);
+                album_thumb_save(thumb, 0, pixbuf);
+        }
+        g_free(thumb);
+
+        g_task_return_pointer(task, pixbuf, g_object_unref);
+}
+
+static void album_placeholder_ready_cb(GObject *source,
+                                       GAsyncResult *result,
+                                       gpointer userdata)
+{
+        BudgieMediaView *self;
+        GtkTreeModel *model;
+        GtkTreeIter iter;
+        GdkPixbuf *pixbuf, *shown;
+        GError *error = NULL;
+        gboolean valid;
+
+        pixbuf = g_task_propagate_pointer(G_TASK(result), &error);
+        if (error) {
+                /* Cancelled, self is being disposed */
+                g_error_free(error);
+                return;
+        }
+
+        self = BUDGIE_MEDIA_VIEW(source);
+        g_clear_object(&self->placeholder_cancellable);
+        self->album_placeholder = pixbuf;
+
+        /* Fill in the albums left blank meanwhile */
+        model = gtk_icon_view_get_model(GTK_ICON_VIEW(self->icon_view));
+        valid = gtk_tree_model_get_iter_first(model, &iter);
+        while (valid) {
+                gtk_tree_model_get(model, &iter, ALBUM_PIXBUF, &shown, -1);
+                if (!shown) {
+                        gtk_list_store_set(GTK_LIST_STORE(model), &iter,
+                                ALBUM_PIXBUF, pixbuf, -1);
+                } else {
+                        g_object_unref(shown);
+                }
+                valid = gtk_tree_model_iter_next(model, &iter);
+        }
+}
+
+/**
+ * Delete the thumbnails of covers no album in the grid uses, in a worker
+ * thread. A cover framed while this runs may lose its new thumbnail,
+ * which is only rebuilt next time.
+ */
+static void prune_album_thumbs(BudgieMediaView *self)
+{
+        GtkTreeModel *model;
+        GtkTreeIter iter;
+        GHashTable *keep;
+        GTask *task;
+        gboolean valid;
+        gchar *path, *thumb;
+
+        model = gtk_icon_view_get_model(GTK_ICON_VIEW(self->icon_view));
+        keep = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        path = album_placeholder_name(self);
+        g_hash_table_add(keep, g_strdup_printf("%s.thumb", path));
+        g_free(path);
+        valid = gtk_tree_model_get_iter_first(model, &iter);
+        while (valid) {
+                gtk_tree_model_get(model, &iter, ALBUM_ART_PATH, &path, -1);
+                if (path) {
+                        thumb = album_thumb_path(path);
+                        g_hash_table_add(keep, g_path_get_basename(thumb));
+                        g_free(thumb);
+                        g_free(path);
+                }
+                valid = gtk_tree_model_iter_next(model, &iter);
+        }
+
+        task = g_task_new(NULL, NULL, NULL, NULL);
+        g_task_set_task_data(task, keep, (GDestroyNotify)g_hash_table_unref);
+        g_task_run_in_thread(task, prune_album_thumbs_thread);
+        g_object_unref(task);
+}
+
+static void prune_album_thumbs_thread(GTask *task,
+                                      gpointer source,
+                                      gpointer task_data,
+                                      GCancellable *cancellable)
+{
+        GHashTable *keep = task_data;
+        const gchar *name;
+        gchar *dir, *path;
+        GDir *thumbs;
+
+        dir = g_build_filename(g_get_user_cache_dir(), ALBUM_THUMB_DIR, NULL);
+        thumbs = g_dir_open(dir, 0, NULL);
+        if (thumbs) {
+                while ((name = g_dir_read_name(thumbs)) != NULL) {
+                        if (!g_str_has_suffix(name, ".thumb") ||
+                            g_hash_table_contains(keep, name)) {
+                                continue;
+                        }
+                        path = g_build_filename(dir, name, NULL);
+                        g_unlink(path);
+                        g_free(path);
+                }
+                g_dir_close(thumbs);
+        }
+        g_free(dir);
+
+        g_task_return_boolean(task, TRUE);
+}
+
+/**
+ * Load a cached thumbnail, if it was made from this version of the
+ * cover with the current frame
+ */
+static GdkPixbuf *album_thumb_load(const gchar *path, gint64 mtime)
+{
+        AlbumThumbHeader header;
+        GBytes *bytes, *pixels;
+        GdkPixbuf *ret;
+        gchar *data;
+        gsize length, needed;
+        guint channels;
+
+        if (!g_file_get_contents(path, &data, &length, NULL)) {
+                return NULL;
+        }
+        if (length < sizeof(header)) {
+                g_free(data);
+                return NULL;
+        }
+        memcpy(&header, data, sizeof(header));
+        channels = header.has_alpha ? 4 : 3;
+        needed = (gsize)header.rowstride * (header.height - 1) +
+                (gsize)header.width * channels;
+        if (memcmp(header.magic, ALBUM_THUMB_MAGIC, sizeof(header.magic)) != 0 ||
+            header.frame != ALBUM_THUMB_FRAME || header.mtime != mtime ||
+            header.width == 0 || header.height == 0 ||
+            header.rowstride < header.width * channels ||
+            needed > length - sizeof(header)) {
+                g_free(data);
                 return NULL;
         }
 
-        cache = g_get_user_cache_dir();
-        model = gtk_list_store_new(ALBUM_COLUMNS, G_TYPE_STRING,
-                GDK_TYPE_PIXBUF, G_TYPE_STRING, G_TYPE_STRING,
-                G_TYPE_STRING);
-
-        /* base and overlay image for album art */
-        base = gdk_pixbuf_new_from_file(DATADIR "/budgie/album-base.png", NULL);
-        overlay = gdk_pixbuf_new_from_file(DATADIR "/budgie/album-overlay.png", NULL);
-
-        for (i=0; i < albums->len; i++) {
-                album = (gchar *)albums->pdata[i];
-                /* Try to gain at least one artist */
-                if (!budgie_db_search_field(self->db, MEDIA_QUERY_ALBUM,
-                        MATCH_QUERY_EXACT, album, 1, &results))
-                        goto fail;
-                current = results->pdata[0];
-                if (current->album == NULL)
-                        goto albumfail;
-
-                album_id = albumart_name_for_media(current, "jpeg");
-                path = g_strdup_printf("%s/media-art/%s", cache, album_id);
-                g_free(album_id);
-                pixbuf = gdk_pixbuf_new_from_file(path, NULL);
-                if (!pixbuf)
-                        pixbuf = beautify(NULL, base, overlay);
-                else
-                        pixbuf = beautify(&pixbuf, base, overlay);
-                /* Pretty label */
-                if (current->band)
-                        markup = g_markup_printf_escaped("<big>%s\n<span color='#707070'>%s</span></big>",
-                                current->album, current->band);
-                else
-                        markup = g_markup_printf_escaped("<big>%s\n<span color='#707070'>%s</span></big>",
-                                current->album, current->artist);
-
-                /* Add this to the list store. */
-                gtk_list_store_insert_with_values(model, &iter, -1,
-                        ALBUM_TITLE, markup,
-                        ALBUM_PIXBUF, pixbuf,
-                        ALBUM_ALBUM, current->album,
-                        ALBUM_ARTIST, current->artist,
-                        ALBUM_ART_PATH, path,
-                        -1);
+        bytes = g_bytes_new_take(data, length);
+        pixels = g_bytes_new_from_bytes(bytes, sizeof(header),
+                length - sizeof(header));
+        ret = gdk_pixbuf_new_from_bytes(pixels, GDK_COLORSPACE_RGB,
+                header.has_alpha, 8, header.width, header.height,
+                header.rowstride);
+        g_bytes_unref(pixels);
+        g_bytes_unref(bytes);
 
-                if (pixbuf)
-                        g_object_unref(pixbuf);
-                g_free(markup);
+        return ret;
+}
 
-albumfail:
-                free_media_info(current);
-                g_ptr_array_free(results, TRUE);
-fail:
-                g_free(album);
+static void album_thumb_save(const gchar *path, gint64 mtime, GdkPixbuf *pixbuf)
+{
+        AlbumThumbHeader header = { { 0 } };
+        GByteArray *data;
+        GError *error = NULL;
+        gchar *dir;
+
+        memcpy(header.magic, ALBUM_THUMB_MAGIC, sizeof(header.magic));
+        header.frame = ALBUM_THUMB_FRAME;
+        header.has_alpha = gdk_pixbuf_get_has_alpha(pixbuf);
+        header.mtime = mtime;
+        header.width = gdk_pixbuf_get_width(pixbuf);
+        header.height = gdk_pixbuf_get_height(pixbuf);
+        header.rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+
+        data = g_byte_array_sized_new(sizeof(header) +
+                gdk_pixbuf_get_byte_length(pixbuf));
+        g_byte_array_append(data, (const guint8*)&header, sizeof(header));
+        g_byte_array_append(data, gdk_pixbuf_read_pixels(pixbuf),
+                gdk_pixbuf_get_byte_length(pixbuf));
+
+        dir = g_path_get_dirname(path);
+        g_mkdir_with_parents(dir, 0700);
+        g_free(dir);
+        if (!g_file_set_contents(path, (const gchar*)data->data, data->len,
+                &error)) {
+                g_warning("Unable to cache album art: %s", error->message);
+                g_error_free(error);
         }
-        gtk_tree_sortable_set_sort_column_id(GTK_TREE_SORTABLE(model),
-                ALBUM_TITLE, GTK_SORT_ASCENDING);
-        gtk_icon_view_set_model(GTK_ICON_VIEW(self->icon_view),
-                GTK_TREE_MODEL(model));
-        g_ptr_array_free(albums, TRUE);
-        g_object_unref(base);
-        g_object_unref(overlay);
+        g_byte_array_unref(data);
+}
+
+static void album_art_thread(GTask *task,
+                             gpointer source,
+                             gpointer task_data,
+                             GCancellable *cancellable)
+{
+        AlbumArtJob *job = task_data;
+        GdkPixbuf *pixbuf;
+        GStatBuf st;
+        gchar *thumb, *key;
+        gint width, height;
+
+        if (g_stat(job->path, &st) != 0) {
+                /* No cover */
+                g_task_return_pointer(task, NULL, NULL);
+                return;
+        }
+
+        /* Framed once, and only read back after that. Albums scrolled
+         * back into view usually find it still in memory, unless the
+         * cover has been replaced since. */
+        thumb = album_thumb_path(job->path);
+        key = g_strdup_printf("%s@%ld", thumb, (long)st.st_mtime);
+        pixbuf = job->cache ? budgie_art_cache_lookup(job->cache, key) : NULL;
+        if (pixbuf) {
+                g_free(key);
+                g_free(thumb);
+                g_task_return_pointer(task, pixbuf, g_object_unref);
+                return;
+        }
+        pixbuf = album_thumb_load(thumb, st.st_mtime);
+        if (!pixbuf) {
+                cover_size(job->base, &width, &height);
+                pixbuf = albumart_load(job->path, width, height, FALSE);
+                if (pixbuf) {
+                        pixbuf = beautify(&pixbuf, job->base, job->overlay);
+                        album_thumb_save(thumb, st.st_mtime, pixbuf);
+                }
+        }
+        if (pixbuf && job->cache) {
+                budgie_art_cache_insert(job->cache, key, pixbuf);
+        }
+        g_free(key);
+        g_free(thumb);
+
+        g_task_return_pointer(task, pixbuf, g_object_unref);
+}
+
+/**
+ * Start decoding queued covers, up to ALBUM_ART_JOBS at once
+ */
+static void start_album_art(BudgieMediaView *self)
+{
+        GtkTreeRowReference *ref;
+        GtkTreeModel *model;
+        GtkTreePath *tree_path;
+        GtkTreeIter iter;
+        AlbumArtJob *job;
+        GTask *task;
+        gint state;
+
+        if (!self->art_cancellable) {
+                self->art_cancellable = g_cancellable_new();
+        }
+        model = gtk_icon_view_get_model(GTK_ICON_VIEW(self->icon_view));
+
+        while (self->art_jobs < ALBUM_ART_JOBS &&
+               (ref = g_queue_pop_head(self->art_queue)) != NULL) {
+                tree_path = gtk_tree_row_reference_get_path(ref);
+                if (!tree_path || !gtk_tree_model_get_iter(model, &iter, tree_path)) {
+                        gtk_tree_path_free(tree_path);
+                        gtk_tree_row_reference_free(ref);
+                        continue;
+                }
+                gtk_tree_path_free(tree_path);
+
+                job = g_slice_new0(AlbumArtJob);
+                gtk_tree_model_get(model, &iter, ALBUM_ALBUM, &job->album,
+                        ALBUM_ART_PATH, &job->path,
+                        ALBUM_ART_STATE, &state, -1);
+                if (state != ART_PLACEHOLDER || !job->path) {
+                        /* Nothing to find, or already underway */
+                        if (state == ART_PLACEHOLDER) {
+                                gtk_list_store_set(GTK_LIST_STORE(model), &iter,
+                                        ALBUM_ART_STATE, ART_LOADED, -1);
+                                g_hash_table_insert(self->album_art,
+                                        g_strdup(job->album), ref);
+                                ref = NULL;
+                        }
+                        g_free(job->album);
+                        g_free(job->path);
+                        g_slice_free(AlbumArtJob, job);
+                        if (ref) {
+                                gtk_tree_row_reference_free(ref);
+                        }
+                        continue;
+                }
+                job->base = g_object_ref(self->album_base);
+                job->overlay = g_object_ref(self->album_overlay);
+                if (self->art_cache) {
+                        job->cache = g_object_ref(self->art_cache);
+                }
+
+                gtk_list_store_set(GTK_LIST_STORE(model), &iter,
+                        ALBUM_ART_STATE, ART_LOADING, -1);
+                g_hash_table_insert(self->album_art, g_strdup(job->album), ref);
+
+                self->art_jobs++;
+                task = g_task_new(self, self->art_cancellable,
+                        album_art_ready_cb, NULL);
+                g_task_set_task_data(task, job, album_art_job_free);
+                g_task_run_in_thread(task, album_art_thread);
+                g_object_unref(task);
+        }
+}
+
+static void album_art_ready_cb(GObject *source,
+                               GAsyncResult *result,
+                               gpointer userdata)
+{
+        BudgieMediaView *self;
+        GtkTreeRowReference *ref;
+        GtkTreeModel *model;
+        GtkTreePath *tree_path;
+        GtkTreeIter iter;
+        AlbumArtJob *job;
+        GdkPixbuf *pixbuf;
+        GError *error = NULL;
+        gint state;
+
+        pixbuf = g_task_propagate_pointer(G_TASK(result), &error);
+        if (error) {
+                /* Cancelled, the grid was cleared */
+                g_error_free(error);
+                return;
+        }
+
+        self = BUDGIE_MEDIA_VIEW(source);
+        self->art_jobs--;
+        job = g_task_get_task_data(G_TASK(result));
+        model = gtk_icon_view_get_model(GTK_ICON_VIEW(self->icon_view));
+
+        /* Only if the album is still waiting for this cover */
+        ref = g_hash_table_lookup(self->album_art, job->album);
+        tree_path = ref ? gtk_tree_row_reference_get_path(ref) : NULL;
+        if (tree_path && gtk_tree_model_get_iter(model, &iter, tree_path)) {
+                gtk_tree_model_get(model, &iter, ALBUM_ART_STATE, &state, -1);
+                if (state == ART_LOADING) {
+                        gtk_list_store_set(GTK_LIST_STORE(model), &iter,
+                                ALBUM_PIXBUF, pixbuf ? pixbuf : self->album_placeholder,
+                                ALBUM_ART_STATE, ART_LOADED, -1);
+                }
+        }
+        gtk_tree_path_free(tree_path);
+        if (pixbuf) {
+                g_object_unref(pixbuf);
+        }
+
+        start_album_art(self);
+}
+
+/**
+ * Bring covers in line with the visible range: drop those far from it,
+ * and queue those in or near it, nearest first
+ */
+static gboolean update_album_art(gpointer userdata)
+{
+        BudgieMediaView *self;
+        GtkTreeModel *model;
+        GtkTreePath *start, *end, *tree_path;
+        GtkTreeRowReference *ref;
+        GHashTableIter it;
+        GtkTreeIter iter;
+        gint first, last, keep_first, keep_last, n_rows, i, index;
+        gint state;
+
+        self = BUDGIE_MEDIA_VIEW(userdata);
+        self->art_update_id = 0;
+
+        if (!gtk_icon_view_get_visible_range(GTK_ICON_VIEW(self->icon_view),
+                &start, &end)) {
+                return FALSE;
+        }
+        first = gtk_tree_path_get_indices(start)[0];
+        last = gtk_tree_path_get_indices(end)[0];
+        gtk_tree_path_free(start);
+        gtk_tree_path_free(end);
+
+        model = gtk_icon_view_get_model(GTK_ICON_VIEW(self->icon_view));
+        n_rows = gtk_tree_model_iter_n_children(model, NULL);
+        keep_first = first - ALBUM_ART_KEEP;
+        keep_last = last + ALBUM_ART_KEEP;
+
+        /* Far away covers go back to the frame */
+        g_hash_table_iter_init(&it, self->album_art);
+        while (g_hash_table_iter_next(&it, NULL, (gpointer*)&ref)) {
+                tree_path = gtk_tree_row_reference_get_path(ref);
+                if (!tree_path) {
+                        g_hash_table_iter_remove(&it);
+                        continue;
+                }
+                index = gtk_tree_path_get_indices(tree_path)[0];
+                if (index < keep_first || index > keep_last) {
+                        gtk_tree_model_get_iter(model, &iter, tree_path);
+                        gtk_list_store_set(GTK_LIST_STORE(model), &iter,
+                                ALBUM_PIXBUF, self->album_placeholder,
+                                ALBUM_ART_STATE, ART_PLACEHOLDER, -1);
+                        g_hash_table_iter_remove(&it);
+                }
+                gtk_tree_path_free(tree_path);
+        }
+
+        /* Visible albums first, then the margin below and above */
+        g_queue_free_full(self->art_queue,
+                (GDestroyNotify)gtk_tree_row_reference_free);
+        self->art_queue = g_queue_new();
+        first = MAX(first - ALBUM_ART_PREFETCH, 0);
+        last = MIN(last + ALBUM_ART_PREFETCH, n_rows - 1);
+        for (i = first; i <= last; i++) {
+                tree_path = gtk_tree_path_new_from_indices(i, -1);
+                if (gtk_tree_model_get_iter(model, &iter, tree_path)) {
+                        gtk_tree_model_get(model, &iter,
+                                ALBUM_ART_STATE, &state, -1);
+                        if (state == ART_PLACEHOLDER) {
+                                g_queue_push_tail(self->art_queue,
+                                        gtk_tree_row_reference_new(model, tree_path));
+                        }
+                }
+                gtk_tree_path_free(tree_path);
+        }
+
+        start_album_art(self);
+
+        return FALSE;
+}
+
+/**
+ * The visible range may have moved, update covers once things settle
+ */
+static void queue_album_art(BudgieMediaView *self)
+{
+        /* Disposed */
+        if (!self->art_queue) {
+                return;
+        }
+        if (self->art_update_id == 0) {
+                self->art_update_id = g_idle_add(update_album_art, self);
+        }
+}
+
+/**
+ * Batched changes from the database, coalesced into one album refresh
+ */
+static void items_changed_cb(BudgieDB *db, GArray *ids, gpointer userdata)
+{
+        BudgieMediaView *self;
+
+        self = BUDGIE_MEDIA_VIEW(userdata);
+        /* The library follows the same changes, see library_changed_cb */
+        if (self->library) {
+                return;
+        }
+        if (self->album_refresh_id == 0) {
+                self->album_refresh_id = g_timeout_add(ALBUM_REFRESH_DELAY,
+                        album_refresh_cb, self);
+        }
+}
+
+/**
+ * The snapshot was loaded or updated. The first load fills the grid
+ * straight away, later updates are coalesced as with the database.
+ */
+static void library_changed_cb(BudgieLibrary *library, gpointer userdata)
+{
+        BudgieMediaView *self;
+        GtkTreeModel *model;
+        GtkTreeIter iter;
+
+        self = BUDGIE_MEDIA_VIEW(userdata);
+        if (!self->db) {
+                return;
+        }
+        model = gtk_icon_view_get_model(GTK_ICON_VIEW(self->icon_view));
+        if (!gtk_tree_model_get_iter_first(model, &iter)) {
+                refresh_albums(self);
+                return;
+        }
+        if (self->album_refresh_id == 0) {
+                self->album_refresh_id = g_timeout_add(ALBUM_REFRESH_DELAY,
+                        album_refresh_cb, self);
+        }
+}
+
+static void items_removed_cb(BudgieDB *db, GArray *ids, gpointer userdata)
+{
+        BudgieMediaView *self;
 
-        return NULL;
+        self = BUDGIE_MEDIA_VIEW(userdata);
+        remove_tracks(self, ids);
+        items_changed_cb(db, ids, userdata);
 }
 
 static void item_activated_cb(GtkWidget *widget,
@@ -390,14 +1378,11 @@ static void item_activated_cb(GtkWidget *widget,
         GValue v_path = G_VALUE_INIT;
         GdkPixbuf *pixbuf;
         const char *album, *path;
-        gchar *artist;
-        GPtrArray *results = NULL;
-        gchar *info_string = NULL;
-        MediaInfo *current = NULL;
 
         /* Grab the model and iter */
         self = BUDGIE_MEDIA_VIEW(userdata);
         track_list = BUDGIE_TRACK_LIST(self->album_tracks);
+        stop_loading(self);
 
         model = gtk_icon_view_get_model(GTK_ICON_VIEW(widget));
         gtk_tree_model_get_iter(model, &iter, tree_path);
@@ -415,16 +1400,68 @@ static void item_activated_cb(GtkWidget *widget,
                 "album-tracks");
 
         /* Set the image */
-        pixbuf = gdk_pixbuf_new_from_file_at_size(path, 256, 256, NULL);
+        if (self->art_cache) {
+                pixbuf = budgie_art_cache_load(self->art_cache, path,
+                        256, 256, TRUE);
+        } else {
+                pixbuf = albumart_load(path, 256, 256, TRUE);
+        }
         if (pixbuf)
                 gtk_image_set_from_pixbuf(GTK_IMAGE(track_list->image), pixbuf);
         else
                 gtk_image_set_from_icon_name(GTK_IMAGE(track_list->image),
                         "folder-music-symbolic", GTK_ICON_SIZE_INVALID);
 
-        if (!budgie_db_search_field(self->db, MEDIA_QUERY_ALBUM,
-                MATCH_QUERY_EXACT, (gchar*)album, -1, &results))
-                goto end;
+        if (self->library && budgie_library_is_loaded(self->library)) {
+                /* Albums are short enough to show in one go */
+                self->ids = budgie_library_filter(self->library,
+                        MEDIA_QUERY_ALBUM, MATCH_QUERY_EXACT, album);
+                self->ids_pos = 0;
+                show_album_tracks(self, library_tracks(self, self->ids->len));
+                g_array_unref(self->ids);
+                self->ids = NULL;
+        } else {
+                /* The tracks follow once the query completes */
+                self->cancellable = g_cancellable_new();
+                budgie_db_search_field_async(self->db, MEDIA_QUERY_ALBUM,
+                        MATCH_QUERY_EXACT, album, -1, self->cancellable,
+                        album_tracks_cb, self);
+        }
+
+        g_value_unset(&v_path);
+        g_value_unset(&v_album);
+}
+
+static void album_tracks_cb(GObject *source,
+                            GAsyncResult *result,
+                            gpointer userdata)
+{
+        GPtrArray *results;
+
+        results = budgie_db_search_field_finish(BUDGIE_DB(source), result, NULL);
+        if (!results) {
+                /* Cancelled, self may be gone */
+                return;
+        }
+        show_album_tracks(BUDGIE_MEDIA_VIEW(userdata), results);
+}
+
+/**
+ * Show the tracks of an album, with its name and artist
+ */
+static void show_album_tracks(BudgieMediaView *self, GPtrArray *results)
+{
+        BudgieTrackList *track_list;
+        gchar *info_string = NULL;
+        MediaInfo *current = NULL;
+        const gchar *artist;
+
+        if (results->len < 1) {
+                g_ptr_array_unref(results);
+                return;
+        }
+
+        track_list = BUDGIE_TRACK_LIST(self->album_tracks);
 
         current = (MediaInfo*)results->pdata[0];
         if (current->band)
@@ -433,22 +1470,18 @@ static void item_activated_cb(GtkWidget *widget,
                 artist = current->artist;
 
         info_string = g_markup_printf_escaped(
-                "<big>%s</big><span color='darkgrey'>\n%s</span>", album,
-                artist);
+                "<big>%s</big><span color='darkgrey'>\n%s</span>",
+                current->album, artist);
         gtk_label_set_markup(GTK_LABEL(track_list->current_label),
                 info_string);
         g_free(info_string);
 
         /* Got this far */
         set_display(self, results);
-end:
-        g_value_unset(&v_path);
-        g_value_unset(&v_album);
 }
 
 static gboolean load_media_cb(gpointer userdata)
 {
-        GPtrArray *results = NULL;
         GtkWidget *widget;
         BudgieMediaView *self;
         struct LoadStruct *load;
@@ -464,23 +1497,12 @@ static gboolean load_media_cb(gpointer userdata)
                 self->mode = MEDIA_MODE_SONGS;
 
                 /* Populate all songs */
-                if (!budgie_db_search_field(self->db, MEDIA_QUERY_MIME,
-                        MATCH_QUERY_START, "audio/", -1, &results))
-                        /** Raise a warning somewhere? */
-                        g_warning("No tracks found");
-
-                set_display(self, results);
+                load_tracks(self, "audio/");
         } else if (widget == self->videos) {
                 self->mode = MEDIA_MODE_VIDEOS;
 
                 /* Populate all videos */
-                if (!budgie_db_search_field(self->db, MEDIA_QUERY_MIME,
-                        MATCH_QUERY_START, "video/", -1, &results)) {
-                        /** Raise a warning somewhere? */
-                        g_warning("No tracks found");
-                }
-
-                set_display(self, results);
+                load_tracks(self, "video/");
         }
         switch (self->mode) {
                 case MEDIA_MODE_ALBUMS:
@@ -495,6 +1517,10 @@ static gboolean load_media_cb(gpointer userdata)
                         gtk_stack_set_visible_child_name(GTK_STACK(self->stack),
                                 "video-tracks");
                         break;
+                case MEDIA_MODE_SEARCH:
+                        gtk_stack_set_visible_child_name(GTK_STACK(self->stack),
+                                "search-tracks");
+                        break;
         }
 
         while (gtk_events_pending())
@@ -516,47 +1542,35 @@ static void button_clicked_cb(GtkWidget *widget, gpointer userdata)
         g_idle_add(load_media_cb, load);
 }
 
-static void set_display(BudgieMediaView *self, GPtrArray *results)
+static BudgieTrackList *current_track_list(BudgieMediaView *self)
 {
-        /* Media infos */
-        MediaInfo *current = NULL;
-        int i;
-        /* Info label */
-        gchar *info_string = NULL;
-        /* The list object which shows stuff. */
-        BudgieTrackList *track_list;
-        GtkTreeIter iter;
-
-        /* Do nothing when results is null */
-        if (!results) {
-                return;
-        }
-
-        /* Clean the list view */
         switch (self->mode) {
                 case MEDIA_MODE_SONGS:
-                        track_list = BUDGIE_TRACK_LIST(self->song_tracks);
-                        break;
+                        return BUDGIE_TRACK_LIST(self->song_tracks);
                 case MEDIA_MODE_VIDEOS:
-                        track_list = BUDGIE_TRACK_LIST(self->video_tracks);
-                        break;
+                        return BUDGIE_TRACK_LIST(self->video_tracks);
+                case MEDIA_MODE_SEARCH:
+                        return BUDGIE_TRACK_LIST(self->search_tracks);
                 default:
                         /* We need some sort of sensible default. */
-                        track_list = BUDGIE_TRACK_LIST(self->album_tracks);
-        }
-
-        /* Only store one set at a time */
-        if (self->results) {
-                g_ptr_array_free(self->results, TRUE);
-                self->results = NULL;
+                        return BUDGIE_TRACK_LIST(self->album_tracks);
         }
+}
 
-        /* Extract the fields.
-           results is given to us sorted (ORDER BY track ASC, id ASC)
-        */
-        gtk_list_store_clear(track_list->store);
+/**
+ * Append rows for results, from index start onwards
+ */
+static void append_tracks(BudgieMediaView *self,
+                          BudgieTrackList *track_list,
+                          GPtrArray *results,
+                          guint start)
+{
+        /* Media infos */
+        MediaInfo *current = NULL;
+        GtkTreeIter iter;
+        guint i;
 
-        for (i=0; i < results->len; i++) {
+        for (i=start; i < results->len; i++) {
                 current = (MediaInfo*)results->pdata[i];
 
                 /* Append it */
@@ -569,7 +1583,7 @@ static void set_display(BudgieMediaView *self, GPtrArray *results)
                         BUDGIE_TRACK_LIST_DB_GENRE, current->genre,
                         BUDGIE_TRACK_LIST_DB_PATH, current->path,
                         BUDGIE_TRACK_LIST_DB_MIME, current->mime,
-                        BUDGIE_TRACK_LIST_DB_INFO, current, /* A reference so we can find this again. */
+                        BUDGIE_TRACK_LIST_DB_INFO, current, /* Shared, so we can find this again. */
                         BUDGIE_TRACK_LIST_DB_PLAYING, NULL, /* Now-playing */
                         -1);
 
@@ -584,19 +1598,40 @@ static void set_display(BudgieMediaView *self, GPtrArray *results)
                         gtk_tree_view_set_cursor(GTK_TREE_VIEW(track_list->list), path, NULL, FALSE);
                 }
         }
+}
+
+static void update_count(BudgieMediaView *self,
+                         BudgieTrackList *track_list,
+                         guint count)
+{
+        /* Info label */
+        gchar *info_string = NULL;
 
         switch (self->mode) {
                 case MEDIA_MODE_VIDEOS:
                         gtk_image_set_from_icon_name(GTK_IMAGE(track_list->image),
                                 "folder-videos-symbolic", GTK_ICON_SIZE_INVALID);
-                        if (results->len == 0) {
+                        if (count == 0) {
                                 info_string = g_strdup_printf("No videos");
-                        } else if (results->len == 1) {
+                        } else if (count == 1) {
                                 info_string = g_strdup_printf("%d video",
-                                        results->len);
+                                        count);
                         } else {
                                 info_string = g_strdup_printf("%d videos",
-                                        results->len);
+                                        count);
+                        }
+                        break;
+                case MEDIA_MODE_SEARCH:
+                        gtk_image_set_from_icon_name(GTK_IMAGE(track_list->image),
+                                "edit-find-symbolic", GTK_ICON_SIZE_INVALID);
+                        if (count == 0) {
+                                info_string = g_strdup_printf("No results");
+                        } else if (count == 1) {
+                                info_string = g_strdup_printf("%d result",
+                                        count);
+                        } else {
+                                info_string = g_strdup_printf("%d results",
+                                        count);
                         }
                         break;
                 case MEDIA_MODE_SONGS:
@@ -604,23 +1639,51 @@ static void set_display(BudgieMediaView *self, GPtrArray *results)
                                 "folder-music-symbolic", GTK_ICON_SIZE_INVALID);
                         /* Fall through, because the terminology ("songs") is the same. */
                 default:
-                        if (results->len == 0) {
+                        if (count == 0) {
                                 info_string = g_strdup_printf("No songs");
-                        } else if (results->len == 1) {
+                        } else if (count == 1) {
                                 info_string = g_strdup_printf("%d song",
-                                        results->len);
+                                        count);
                         } else {
                                 info_string = g_strdup_printf("%d songs",
-                                       results->len);
+                                       count);
                         }
                         break;
         }
 
         gtk_label_set_text(GTK_LABEL(track_list->count_label), info_string);
+        g_free(info_string);
+}
+
+static void set_display(BudgieMediaView *self, GPtrArray *results)
+{
+        /* The list object which shows stuff. */
+        BudgieTrackList *track_list;
+
+        /* Do nothing when results is null */
+        if (!results) {
+                return;
+        }
+
+        /* Clean the list view */
+        track_list = current_track_list(self);
+
+        /* Only store one set at a time */
+        if (self->results) {
+                g_ptr_array_free(self->results, TRUE);
+                self->results = NULL;
+        }
+
+        /* Extract the fields.
+           results is given to us sorted (ORDER BY track ASC, id ASC)
+        */
+        gtk_list_store_clear(track_list->store);
+        append_tracks(self, track_list, results, 0);
+        update_count(self, track_list, results->len);
+
         if (self->mode != MEDIA_MODE_ALBUMS) {
                 gtk_label_set_text(GTK_LABEL(track_list->current_label), "");
         }
-        g_free(info_string);
         self->results = results;
 
         while (gtk_events_pending()) {
@@ -628,6 +1691,303 @@ static void set_display(BudgieMediaView *self, GPtrArray *results)
         }
 }
 
+/**
+ * Stop loading tracks into the current list
+ */
+static void stop_loading(BudgieMediaView *self)
+{
+        if (self->cancellable) {
+                g_cancellable_cancel(self->cancellable);
+                g_object_unref(self->cancellable);
+                self->cancellable = NULL;
+        }
+        if (self->cursor) {
+                budgie_db_cursor_close(self->cursor);
+                self->cursor = NULL;
+        }
+        if (self->ids_idle > 0) {
+                g_source_remove(self->ids_idle);
+                self->ids_idle = 0;
+        }
+        if (self->ids) {
+                g_array_unref(self->ids);
+                self->ids = NULL;
+        }
+}
+
+/**
+ * Drop removed tracks from the current list
+ */
+static void remove_tracks(BudgieMediaView *self, GArray *ids)
+{
+        BudgieTrackList *track_list;
+        GtkTreeModel *model;
+        GtkTreeIter iter;
+        GHashTable *removed;
+        GPtrArray *results;
+        MediaInfo *info, *current = NULL;
+        gboolean valid, drop;
+        guint i;
+
+        if (!self->results) {
+                return;
+        }
+
+        removed = g_hash_table_new(NULL, NULL);
+        for (i = 0; i < ids->len; i++) {
+                g_hash_table_add(removed,
+                        GINT_TO_POINTER(g_array_index(ids, gint, i)));
+        }
+
+        track_list = current_track_list(self);
+        model = GTK_TREE_MODEL(track_list->store);
+        valid = gtk_tree_model_get_iter_first(model, &iter);
+        while (valid) {
+                gtk_tree_model_get(model, &iter,
+                        BUDGIE_TRACK_LIST_DB_INFO, &info, -1);
+                drop = g_hash_table_contains(removed, GINT_TO_POINTER(info->id));
+                media_info_unref(info);
+                if (drop) {
+                        valid = gtk_list_store_remove(track_list->store, &iter);
+                } else {
+                        valid = gtk_tree_model_iter_next(model, &iter);
+                }
+        }
+
+        /* Keep the index pointing at the same track */
+        if (self->index >= 0 && self->index < self->results->len) {
+                current = self->results->pdata[self->index];
+        }
+        results = g_ptr_array_new_with_free_func(media_info_unref);
+        for (i = 0; i < self->results->len; i++) {
+                info = self->results->pdata[i];
+                if (g_hash_table_contains(removed, GINT_TO_POINTER(info->id))) {
+                        continue;
+                }
+                if (info == current) {
+                        self->index = results->len;
+                }
+                g_ptr_array_add(results, media_info_ref(info));
+        }
+        g_ptr_array_free(self->results, TRUE);
+        self->results = results;
+        g_hash_table_unref(removed);
+
+        update_count(self, track_list, self->results->len);
+}
+
+/**
+ * Ask for the next page of tracks, or finish once the last was short
+ */
+static void continue_loading(BudgieMediaView *self, guint fetched, guint page)
+{
+        if (fetched < page) {
+                budgie_db_cursor_close(self->cursor);
+                self->cursor = NULL;
+                return;
+        }
+        budgie_db_cursor_fetch_async(self->cursor, TRACKS_PAGE,
+                self->cancellable, more_tracks_cb, self);
+}
+
+/**
+ * Later pages of tracks, appended as they arrive
+ */
+static void more_tracks_cb(GObject *source,
+                           GAsyncResult *result,
+                           gpointer userdata)
+{
+        BudgieMediaView *self;
+        BudgieTrackList *track_list;
+        GPtrArray *results;
+        guint start, i;
+
+        results = budgie_db_cursor_fetch_finish(BUDGIE_DB(source), result, NULL);
+        if (!results) {
+                /* Cancelled, self may be gone */
+                return;
+        }
+
+        self = BUDGIE_MEDIA_VIEW(userdata);
+        track_list = current_track_list(self);
+        start = self->results->len;
+        for (i = 0; i < results->len; i++) {
+                g_ptr_array_add(self->results,
+                        media_info_ref(results->pdata[i]));
+        }
+        append_tracks(self, track_list, self->results, start);
+        update_count(self, track_list, self->results->len);
+
+        continue_loading(self, results->len, TRACKS_PAGE);
+        g_ptr_array_unref(results);
+}
+
+/**
+ * The first page of tracks, replacing the current display
+ */
+static void first_tracks_cb(GObject *source,
+                            GAsyncResult *result,
+                            gpointer userdata)
+{
+        BudgieMediaView *self;
+        GPtrArray *results;
+        guint fetched;
+
+        results = budgie_db_cursor_fetch_finish(BUDGIE_DB(source), result, NULL);
+        if (!results) {
+                /* Cancelled, self may be gone */
+                return;
+        }
+
+        self = BUDGIE_MEDIA_VIEW(userdata);
+        fetched = results->len;
+        if (fetched == 0) {
+                /** Raise a warning somewhere? */
+                g_warning("No tracks found");
+        }
+
+        set_display(self, results);
+        continue_loading(self, fetched, TRACKS_FIRST_PAGE);
+}
+
+/**
+ * The next page of tracks from the snapshot ids being loaded
+ */
+static GPtrArray *library_tracks(BudgieMediaView *self, guint max)
+{
+        GPtrArray *results;
+        MediaInfo *info;
+        gint id;
+
+        results = g_ptr_array_new_with_free_func(media_info_unref);
+        while (results->len < max && self->ids_pos < self->ids->len) {
+                id = g_array_index(self->ids, gint, self->ids_pos);
+                self->ids_pos++;
+                info = budgie_library_get_info(self->library, id);
+                if (info) {
+                        g_ptr_array_add(results, info);
+                }
+        }
+
+        return results;
+}
+
+/**
+ * Later pages of tracks from the snapshot, appended when idle
+ */
+static gboolean more_library_tracks(gpointer userdata)
+{
+        BudgieMediaView *self;
+        BudgieTrackList *track_list;
+        GPtrArray *results;
+        guint start, i;
+
+        self = BUDGIE_MEDIA_VIEW(userdata);
+        track_list = current_track_list(self);
+        results = library_tracks(self, TRACKS_PAGE);
+        start = self->results->len;
+        for (i = 0; i < results->len; i++) {
+                g_ptr_array_add(self->results,
+                        media_info_ref(results->pdata[i]));
+        }
+        append_tracks(self, track_list, self->results, start);
+        update_count(self, track_list, self->results->len);
+        g_ptr_array_unref(results);
+
+        if (self->ids_pos < self->ids->len) {
+                return TRUE;
+        }
+        self->ids_idle = 0;
+        g_array_unref(self->ids);
+        self->ids = NULL;
+        return FALSE;
+}
+
+/**
+ * Show all tracks of a given mime type, the first screen as soon as
+ * it's ready and the remainder a page at a time after
+ */
+static void load_tracks(BudgieMediaView *self, const gchar *mime)
+{
+        GPtrArray *results;
+
+        stop_loading(self);
+
+        /* Filtering the snapshot is quick enough to do right here */
+        if (self->library && budgie_library_is_loaded(self->library)) {
+                self->ids = budgie_library_filter(self->library,
+                        MEDIA_QUERY_MIME, MATCH_QUERY_START, mime);
+                self->ids_pos = 0;
+                results = library_tracks(self, TRACKS_FIRST_PAGE);
+                if (self->ids_pos < self->ids->len) {
+                        self->ids_idle = g_idle_add(more_library_tracks, self);
+                }
+                set_display(self, results);
+                return;
+        }
+
+        self->cancellable = g_cancellable_new();
+        self->cursor = budgie_db_cursor_open(self->db, MEDIA_QUERY_MIME,
+                MATCH_QUERY_START, mime);
+        budgie_db_cursor_fetch_async(self->cursor, TRACKS_FIRST_PAGE,
+                self->cancellable, first_tracks_cb, self);
+}
+
+/**
+ * Search results, replacing the current display
+ */
+static void search_results_cb(GObject *source,
+                              GAsyncResult *result,
+                              gpointer userdata)
+{
+        BudgieMediaView *self;
+        GPtrArray *results;
+
+        results = budgie_db_search_finish(BUDGIE_DB(source), result, NULL);
+        if (!results) {
+                /* Cancelled, self may be gone */
+                return;
+        }
+
+        self = BUDGIE_MEDIA_VIEW(userdata);
+        set_display(self, results);
+}
+
+void budgie_media_view_search(BudgieMediaView *self, const gchar *text)
+{
+        GtkWidget *button;
+
+        /* Too short to narrow anything down, go back to browsing */
+        if (!text || g_utf8_strlen(text, -1) < SEARCH_MIN_LENGTH) {
+                if (self->mode != MEDIA_MODE_SEARCH) {
+                        return;
+                }
+                stop_loading(self);
+                if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(self->songs))) {
+                        button = self->songs;
+                } else if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(self->videos))) {
+                        button = self->videos;
+                } else {
+                        button = self->albums;
+                }
+                button_clicked_cb(button, self);
+                return;
+        }
+
+        /* Any search still running is stale now, as is a page still
+         * loading, which is reloaded when the search is cleared */
+        stop_loading(self);
+        if (self->mode != MEDIA_MODE_SEARCH) {
+                self->mode = MEDIA_MODE_SEARCH;
+                gtk_stack_set_visible_child_name(GTK_STACK(self->stack),
+                        "search-tracks");
+        }
+
+        self->cancellable = g_cancellable_new();
+        budgie_db_search_async(self->db, text, SEARCH_MAX_RESULTS,
+                self->cancellable, search_results_cb, self);
+}
+
 static void list_selection_cb(GtkTreeView *list,
                               GtkTreePath *row,
                               GtkTreeViewColumn *column,
@@ -669,12 +2029,22 @@ static void list_selection_cb(GtkTreeView *list,
                                 }
                         }
                 }
-
+                media_info_unref(info);
         }
 }
 
 /**
- * TODO: CACHE!!!
+ * Size a cover is drawn at within the frame, load it at this size
+ */
+static void cover_size(GdkPixbuf *base, gint *width, gint *height)
+{
+        *width = (gdk_pixbuf_get_width(base)-COVER_X_PAD)-7;
+        *height = (gdk_pixbuf_get_height(base)-COVER_Y_PAD)-10;
+}
+
+/**
+ * Frame a cover, or just the frame if source is NULL. Thumbnails of the
+ * result are cached, see album_thumb_load.
  */
 static GdkPixbuf *beautify(GdkPixbuf **source,
                            GdkPixbuf *base,
@@ -684,8 +2054,6 @@ static GdkPixbuf *beautify(GdkPixbuf **source,
         int new_width, new_height;
         cairo_surface_t *surface;
         cairo_t *ctx;
-        int x_pad = 20;
-        int y_pad = 6;
         GdkPixbuf *scaled, *ret, *scaled_ret;
 
         /* Create a new surface to work from */
@@ -701,13 +2069,18 @@ static GdkPixbuf *beautify(GdkPixbuf **source,
 
         /* Draw the source image (album cover) */
         if (source) {
-                new_width = (width-x_pad)-7;
-                new_height = (height-y_pad)-10;
-                scaled = gdk_pixbuf_scale_simple(*source,
-                        new_width, new_height, GDK_INTERP_BILINEAR);
-                g_object_unref(*source);
+                /* Covers from albumart_load are already the right size */
+                cover_size(base, &new_width, &new_height);
+                if (gdk_pixbuf_get_width(*source) == new_width &&
+                    gdk_pixbuf_get_height(*source) == new_height) {
+                        scaled = *source;
+                } else {
+                        scaled = gdk_pixbuf_scale_simple(*source,
+                                new_width, new_height, GDK_INTERP_BILINEAR);
+                        g_object_unref(*source);
+                }
                 *source = NULL;
-                gdk_cairo_set_source_pixbuf(ctx, scaled, x_pad, y_pad);
+                gdk_cairo_set_source_pixbuf(ctx, scaled, COVER_X_PAD, COVER_Y_PAD);
                 cairo_paint(ctx);
                 g_object_unref(scaled);
         }
@@ -778,18 +2151,7 @@ void budgie_media_view_set_active(BudgieMediaView *self,
         BudgieTrackList *track_list;
         guint i;
 
-        switch (self->mode){
-                case MEDIA_MODE_SONGS:
-                        track_list = BUDGIE_TRACK_LIST(self->song_tracks);
-                        break;
-
-                case MEDIA_MODE_VIDEOS:
-                        track_list = BUDGIE_TRACK_LIST(self->video_tracks);
-                        break;
-
-                default:
-                        track_list = BUDGIE_TRACK_LIST(self->album_tracks);
-        }
+        track_list = current_track_list(self);
 
         /* Update the track listing. */
         budgie_track_list_update_playing(track_list, active);
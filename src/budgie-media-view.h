@@ -27,6 +27,8 @@
 #include <gtk/gtk.h>
 
 #include "db/budgie-db.h"
+#include "db/budgie-library.h"
+#include "budgie-art-cache.h"
 #include "budgie-track-list.h"
 
 typedef struct _BudgieMediaView BudgieMediaView;
@@ -43,6 +45,7 @@ typedef enum {
         MEDIA_MODE_ALBUMS = 0,
         MEDIA_MODE_SONGS,
         MEDIA_MODE_VIDEOS,
+        MEDIA_MODE_SEARCH,
 } BudgieMediaMode;
 
 typedef enum {
@@ -56,6 +59,8 @@ typedef enum {
 struct _BudgieMediaView {
         GtkBin parent;
         BudgieDB *db;
+        BudgieLibrary *library;
+        BudgieArtCache *art_cache;
 
         GtkWidget *stack;
 
@@ -74,9 +79,45 @@ struct _BudgieMediaView {
         GtkWidget *album_tracks;
         GtkWidget *song_tracks;
         GtkWidget *video_tracks;
+        GtkWidget *search_tracks;
 
         gchar *current_path;
         gint index;
+
+        /* Tracks still being loaded into the current list, from the
+         * database or from the library snapshot */
+        BudgieDBCursor *cursor;
+        GCancellable *cancellable;
+        GArray *ids;
+        guint ids_pos;
+        guint ids_idle;
+
+        /* Album grid still being loaded, and whether it's out of date.
+         * album_list holds the fetched albums, put in from albums_pos on
+         * when idle, and albums_left the rows not yet matched to one. */
+        GCancellable *album_cancellable;
+        gboolean albums_dirty;
+        guint album_refresh_id;
+        GArray *album_list;
+        guint albums_pos;
+        GHashTable *albums_left;
+        guint albums_idle;
+
+        /* Album covers, only decoded for albums near the visible range.
+         * album_art maps each album showing or loading a cover to its
+         * row, and art_queue holds rows waiting for a cover.
+         * album_placeholder is NULL until loaded, and thumbs_pruned is
+         * set once stale thumbnails have been swept. */
+        GdkPixbuf *album_base;
+        GdkPixbuf *album_overlay;
+        GdkPixbuf *album_placeholder;
+        GCancellable *placeholder_cancellable;
+        gboolean thumbs_pruned;
+        GHashTable *album_art;
+        GQueue *art_queue;
+        GCancellable *art_cancellable;
+        guint art_jobs;
+        guint art_update_id;
 };
 
 /* BudgieMediaView class definition */
@@ -110,4 +151,11 @@ MediaInfo* budgie_media_view_get_info(BudgieMediaView *self,
 void budgie_media_view_set_active(BudgieMediaView *self,
                                   MediaInfo *active);
 
+/**
+ * Search all media, showing the best matches in place of the current
+ * page. Text too short to search returns to the selected page.
+ * @param text Search text, as typed
+ */
+void budgie_media_view_search(BudgieMediaView *self, const gchar *text);
+
 #endif /* budgie_media_view_h */
@@ -0,0 +1,631 @@
+/*
+ * budgie-scanner.c
+ * 
+ * Copyright 2013 Ikey Doherty <ikey.doherty@gmail.com>
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ * 
+ * 
+ */
+#include <gio/gio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <taglib/tag_c.h>
+
+#include "budgie-scanner.h"
+
+/* Maximum number of files queued or parsed but not yet collected */
+#define MAX_PENDING 256
+
+/* Number of tracks committed to the database per transaction */
+#define BATCH_SIZE 200
+
+/* Maximum number of batches waiting for the database writer */
+#define MAX_BATCHES 4
+
+/* Marks the end of the batch queue, as GAsyncQueue can't hold NULL */
+static gint end_of_scan;
+
+typedef struct ScanJob {
+        guint64 seq;
+        gchar *path;
+        gchar *mime;
+        GFileInfo *info;
+        MediaInfo *media;
+} ScanJob;
+
+typedef struct ScanBatch {
+        GSList *tracks; /* New or changed tracks, in reverse walk order */
+        GArray *unchanged; /* Ids of unchanged tracks, to stamp as seen */
+        guint length;
+} ScanBatch;
+
+/* A media directory that was walked without errors */
+typedef struct ScanRoot {
+        const gchar *path;
+        guint64 device;
+        guint files;
+} ScanRoot;
+
+typedef struct BudgieScanner {
+        BudgieDB *db;
+        int n_params;
+        const gchar **mimes;
+        GThreadPool *pool;
+
+        GMutex lock;
+        GCond cond;
+        /* Next sequence number to hand out, and next one to collect */
+        guint64 next_seq;
+        guint64 emit_seq;
+        /* Jobs finished ahead of emit_seq, keyed by sequence number */
+        GHashTable *done;
+        /* Batch currently being collected */
+        ScanBatch *batch;
+        /* Set when part of the current root couldn't be read, and the
+         * number of files found beneath it */
+        gboolean walk_failed;
+        guint walk_files;
+
+        /* Artist, album, genre and mime strings of this scan's tracks.
+         * The tracks only live until their batch is written, so the
+         * strings go with the scan instead of staying interned. */
+        GMutex names_lock;
+        GStringChunk *names;
+
+        /* Batches waiting to be committed by the writer thread */
+        GAsyncQueue *queue;
+        GMutex queue_lock;
+        GCond queue_cond;
+        guint n_queued;
+        guint n_written;
+        BudgieScanFunc func;
+        gpointer userdata;
+} BudgieScanner;
+
+/**
+ * Return a copy of a taglib string, or NULL if it is empty
+ */
+static gchar *tag_string(char *value)
+{
+        gchar *ret = NULL;
+
+        if (!value) {
+                return NULL;
+        }
+        if (strlen(value) != 0) {
+                ret = g_strdup(value);
+        }
+        taglib_free(value);
+        return ret;
+}
+
+/**
+ * Return the scan's shared copy of a string
+ */
+static const gchar *scan_name(BudgieScanner *self, const gchar *value)
+{
+        const gchar *ret;
+
+        g_mutex_lock(&self->names_lock);
+        ret = g_string_chunk_insert_const(self->names, value);
+        g_mutex_unlock(&self->names_lock);
+        return ret;
+}
+
+/**
+ * Return the scan's shared copy of a taglib string, or NULL if it is
+ * empty
+ */
+static const gchar *tag_name(BudgieScanner *self, char *value)
+{
+        const gchar *ret = NULL;
+
+        if (!value) {
+                return NULL;
+        }
+        if (strlen(value) != 0) {
+                ret = scan_name(self, value);
+        }
+        taglib_free(value);
+        return ret;
+}
+
+/**
+ * Using taglib we'll query the relevant tags.
+ *
+ * String management must be disabled, as taglib otherwise tracks
+ * returned strings in a global list that isn't safe to share between
+ * threads.
+ */
+static MediaInfo* media_from_file(BudgieScanner *self,
+                                  gchar *path,
+                                  GFileInfo *file_info,
+                                  const gchar *file_mime)
+{
+        MediaInfo* media = NULL;
+        TagLib_File *tagfile = NULL;
+        TagLib_Tag *tag = NULL;
+
+        media = media_info_new();
+
+        tagfile = taglib_file_new(path);
+        if (!tagfile) {
+                g_message("%s provides no tag information", path);
+                goto end;
+        }
+
+        tag = taglib_file_tag(tagfile);
+        if (!tag) {
+                goto clean;
+        }
+
+        /* Set fields from taglib */
+        media->track_no = taglib_tag_track(tag);
+        media->title = tag_string(taglib_tag_title(tag));
+        media->album = tag_name(self, taglib_tag_album(tag));
+        media->artist = tag_name(self, taglib_tag_artist(tag));
+        media->genre = tag_name(self, taglib_tag_genre(tag));
+
+clean:
+        taglib_file_free(tagfile);
+end:
+
+        if (!media->title) {
+                media->title = g_strdup(g_file_info_get_display_name(file_info));
+        }
+        media->path = g_strdup(path);
+        media->mime = scan_name(self, file_mime);
+
+        /* Stamp, so that we can skip this file next time if unchanged */
+        media->mtime = (gint64)g_file_info_get_attribute_uint64(file_info,
+                G_FILE_ATTRIBUTE_TIME_MODIFIED);
+        media->size = g_file_info_get_size(file_info);
+        media->inode = g_file_info_get_attribute_uint64(file_info,
+                G_FILE_ATTRIBUTE_UNIX_INODE);
+
+        return media;
+}
+
+/**
+ * Whether the database already holds up to date information for this file
+ */
+static gint file_unchanged(BudgieDB *db, const gchar *path, GFileInfo *file_info)
+{
+        gint64 mtime, size;
+        guint64 inode;
+
+        if (!db) {
+                return 0;
+        }
+
+        mtime = (gint64)g_file_info_get_attribute_uint64(file_info,
+                G_FILE_ATTRIBUTE_TIME_MODIFIED);
+        size = g_file_info_get_size(file_info);
+        inode = g_file_info_get_attribute_uint64(file_info,
+                G_FILE_ATTRIBUTE_UNIX_INODE);
+
+        return budgie_db_file_unchanged(db, path, mtime, size, inode);
+}
+
+static void scan_job_free(ScanJob *job)
+{
+        g_free(job->path);
+        g_free(job->mime);
+        g_object_unref(job->info);
+        g_free(job);
+}
+
+/**
+ * Return the batch being collected, called with the lock held
+ */
+static ScanBatch *scan_batch_get(BudgieScanner *self)
+{
+        if (!self->batch) {
+                self->batch = g_new0(ScanBatch, 1);
+                self->batch->unchanged = g_array_new(FALSE, FALSE, sizeof(gint));
+        }
+        return self->batch;
+}
+
+static void scan_batch_free(ScanBatch *batch)
+{
+        g_slist_free_full(batch->tracks, media_info_unref);
+        g_array_free(batch->unchanged, TRUE);
+        g_free(batch);
+}
+
+/**
+ * Hand the current batch to the database writer, waiting if the
+ * writer is already too far behind
+ */
+static void scan_batch_flush(BudgieScanner *self)
+{
+        if (!self->batch) {
+                return;
+        }
+
+        g_mutex_lock(&self->queue_lock);
+        while (self->n_queued >= MAX_BATCHES) {
+                g_cond_wait(&self->queue_cond, &self->queue_lock);
+        }
+        self->n_queued++;
+        g_mutex_unlock(&self->queue_lock);
+
+        self->batch->tracks = g_slist_reverse(self->batch->tracks);
+        g_async_queue_push(self->queue, self->batch);
+        self->batch = NULL;
+}
+
+/**
+ * Database writer thread, commits each batch in its own transaction
+ */
+static gpointer scan_writer(gpointer userdata)
+{
+        BudgieScanner *self = userdata;
+        ScanBatch *batch = NULL;
+        guint length;
+
+        while ((batch = g_async_queue_pop(self->queue)) != (gpointer)&end_of_scan) {
+                length = g_slist_length(batch->tracks);
+                budgie_db_update(self->db, batch->tracks);
+                budgie_db_touch(self->db, batch->unchanged);
+                scan_batch_free(batch);
+
+                g_mutex_lock(&self->queue_lock);
+                self->n_queued--;
+                self->n_written += length;
+                g_cond_broadcast(&self->queue_cond);
+                g_mutex_unlock(&self->queue_lock);
+
+                if (self->func) {
+                        self->func(self->n_written, self->userdata);
+                }
+        }
+
+        return NULL;
+}
+
+/**
+ * Store a finished job, and collect every job that is now in order
+ */
+static void scan_job_finish(BudgieScanner *self, ScanJob *job)
+{
+        ScanBatch *batch = NULL;
+
+        g_mutex_lock(&self->lock);
+        g_hash_table_insert(self->done, &job->seq, job);
+        while ((job = g_hash_table_lookup(self->done, &self->emit_seq)) != NULL) {
+                g_hash_table_remove(self->done, &self->emit_seq);
+                batch = scan_batch_get(self);
+                batch->tracks = g_slist_prepend(batch->tracks, job->media);
+                scan_job_free(job);
+                self->emit_seq++;
+                if (++batch->length >= BATCH_SIZE) {
+                        scan_batch_flush(self);
+                }
+        }
+        g_cond_broadcast(&self->cond);
+        g_mutex_unlock(&self->lock);
+}
+
+/**
+ * Worker thread, parses tags for a single file
+ */
+static void scan_job_run(gpointer data, gpointer userdata)
+{
+        ScanJob *job = data;
+        BudgieScanner *self = userdata;
+
+        job->media = media_from_file(self, job->path, job->info, job->mime);
+        scan_job_finish(self, job);
+}
+
+static void scan_job_push(BudgieScanner *self,
+                          const gchar *path,
+                          GFileInfo *info,
+                          const gchar *mime)
+{
+        ScanJob *job = NULL;
+        GError *error = NULL;
+
+        job = g_new0(ScanJob, 1);
+        job->path = g_strdup(path);
+        job->mime = g_strdup(mime);
+        job->info = g_object_ref(info);
+
+        /* Don't let the walk run too far ahead of the tag readers */
+        g_mutex_lock(&self->lock);
+        while (self->next_seq - self->emit_seq >= MAX_PENDING) {
+                g_cond_wait(&self->cond, &self->lock);
+        }
+        job->seq = self->next_seq++;
+        g_mutex_unlock(&self->lock);
+
+        if (self->pool && g_thread_pool_push(self->pool, job, &error)) {
+                return;
+        }
+        if (error) {
+                g_warning("Unable to queue %s: %s", path, error->message);
+                g_error_free(error);
+        }
+        scan_job_run(job, self);
+}
+
+/**
+ * Record an unchanged file, so that it is stamped as seen by this scan
+ */
+static void scan_unchanged_push(BudgieScanner *self, gint id)
+{
+        ScanBatch *batch = NULL;
+
+        g_mutex_lock(&self->lock);
+        batch = scan_batch_get(self);
+        g_array_append_val(batch->unchanged, id);
+        if (++batch->length >= BATCH_SIZE) {
+                scan_batch_flush(self);
+        }
+        g_mutex_unlock(&self->lock);
+}
+
+/* Attributes needed to filter and stamp each file */
+#define SCAN_ATTRIBUTES "standard::*," G_FILE_ATTRIBUTE_TIME_MODIFIED "," \
+        G_FILE_ATTRIBUTE_UNIX_INODE
+
+/**
+ * Queue a single file for tag reading, if it is wanted and has changed
+ */
+static void scan_file(BudgieScanner *self, const gchar *path, GFileInfo *info)
+{
+        const gchar *file_mime;
+        gint id;
+        guint i;
+
+        /* Not exactly a regex but it'll do for now */
+        file_mime = g_file_info_get_content_type(info);
+        if (!file_mime) {
+                return;
+        }
+        for (i=0; i < self->n_params; i++) {
+                if (g_str_has_prefix(file_mime, self->mimes[i])) {
+                        /* Only hit taglib for new or modified files */
+                        id = file_unchanged(self->db, path, info);
+                        if (id > 0) {
+                                scan_unchanged_push(self, id);
+                        } else {
+                                scan_job_push(self, path, info, file_mime);
+                        }
+                        break;
+                }
+        }
+}
+
+static void search_directory(BudgieScanner *self, const gchar *path)
+{
+        GFile *file = NULL;
+        GFileInfo *next_file;
+        GFileType type;
+        GFileEnumerator *listing;
+        GError *error = NULL;
+        const gchar *next_path;
+        gchar *full_path = NULL;
+
+        file = g_file_new_for_path(path);
+        type = g_file_query_file_type(file, G_FILE_QUERY_INFO_NONE, NULL);
+        if (type == G_FILE_TYPE_REGULAR) {
+                /* Single file, i.e. one reported by the library watcher */
+                next_file = g_file_query_info(file, SCAN_ATTRIBUTES,
+                        G_FILE_QUERY_INFO_NONE, NULL, NULL);
+                if (next_file) {
+                        scan_file(self, path, next_file);
+                        g_object_unref(next_file);
+                }
+        } else if (type == G_FILE_TYPE_DIRECTORY) {
+                /* Enumerate children (needs less query flags!) */
+                listing = g_file_enumerate_children(file, SCAN_ATTRIBUTES,
+                        G_FILE_QUERY_INFO_NONE, NULL, NULL);
+                if (!listing) {
+                        self->walk_failed = TRUE;
+                        goto end;
+                }
+
+                /* Lets go through them */
+                while ((next_file = g_file_enumerator_next_file(listing, NULL, &error)) != NULL) {
+                        next_path = g_file_info_get_name(next_file);
+                        full_path = g_strdup_printf("%s/%s", path, next_path);
+
+                        /* Recurse if its a directory */
+                        if (g_file_info_get_file_type(next_file) == G_FILE_TYPE_DIRECTORY) {
+                                search_directory(self, full_path);
+                        } else {
+                                self->walk_files++;
+                                scan_file(self, full_path, next_file);
+                        }
+                        g_free(full_path);
+                        g_object_unref(next_file);
+                        full_path = NULL;
+                }
+                /* The rest of this directory wasn't seen */
+                if (error) {
+                        g_warning("Unable to list %s: %s", path, error->message);
+                        g_error_free(error);
+                        self->walk_failed = TRUE;
+                }
+                g_file_enumerator_close(listing, NULL, NULL);
+                g_object_unref(listing);
+        } else {
+                self->walk_failed = TRUE;
+        }
+
+end:
+        g_object_unref(file);
+}
+
+/**
+ * The device a media directory is on, or 0 if it can't be read
+ */
+static guint64 root_device(const gchar *path)
+{
+        GFile *file;
+        GFileInfo *info;
+        guint64 ret = 0;
+
+        file = g_file_new_for_path(path);
+        info = g_file_query_info(file, G_FILE_ATTRIBUTE_UNIX_DEVICE,
+                G_FILE_QUERY_INFO_NONE, NULL, NULL);
+        if (info) {
+                ret = g_file_info_get_attribute_uint32(info,
+                        G_FILE_ATTRIBUTE_UNIX_DEVICE);
+                g_object_unref(info);
+        }
+        g_object_unref(file);
+
+        return ret;
+}
+
+/**
+ * Whether the tracks under a walked root that the scan didn't see may be
+ * removed. An unmounted drive leaves an empty directory behind, or the
+ * filesystem beneath the mountpoint, so the files having all gone or a
+ * different device with files missing are both taken as the media being
+ * elsewhere for now.
+ */
+static gboolean root_prunable(BudgieDB *db, ScanRoot *root, gint64 generation)
+{
+        guint64 recorded;
+        gint stale;
+
+        stale = budgie_db_count_stale(db, root->path, generation);
+        if (stale == 0) {
+                return TRUE;
+        }
+        if (root->files == 0) {
+                g_message("Nothing found in %s, keeping its %d tracks",
+                        root->path, stale);
+                return FALSE;
+        }
+        recorded = budgie_db_get_root_device(db, root->path);
+        if (recorded != 0 && recorded != root->device) {
+                g_message("%s is on another device, keeping its %d missing tracks",
+                        root->path, stale);
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+guint budgie_scanner_scan(BudgieDB *db,
+                          gchar **dirs,
+                          int n_params,
+                          const gchar **mimes,
+                          guint workers,
+                          BudgieScanFunc func,
+                          gpointer userdata)
+{
+        BudgieScanner self = { 0 };
+        GThread *writer = NULL;
+        GError *error = NULL;
+        GArray *walked = NULL;
+        ScanRoot root;
+        gint64 generation;
+        guint i;
+
+        if (workers == 0) {
+                workers = g_get_num_processors();
+        }
+
+        /* Required before taglib is used from more than one thread */
+        taglib_set_string_management_enabled(FALSE);
+
+        self.db = db;
+        self.n_params = n_params;
+        self.mimes = mimes;
+        self.done = g_hash_table_new(g_int64_hash, g_int64_equal);
+        g_mutex_init(&self.lock);
+        g_cond_init(&self.cond);
+        g_mutex_init(&self.names_lock);
+        self.names = g_string_chunk_new(4096);
+        self.queue = g_async_queue_new();
+        g_mutex_init(&self.queue_lock);
+        g_cond_init(&self.queue_cond);
+        self.func = func;
+        self.userdata = userdata;
+
+        /* Everything written or seen from here on carries this generation */
+        generation = budgie_db_begin_scan(db);
+        walked = g_array_new(FALSE, FALSE, sizeof(ScanRoot));
+
+        writer = g_thread_new("scan-writer", &scan_writer, &self);
+
+        self.pool = g_thread_pool_new(scan_job_run, &self, (gint)workers,
+                FALSE, &error);
+        if (!self.pool) {
+                g_warning("Unable to create scan threads: %s", error->message);
+                g_error_free(error);
+        }
+
+        for (i=0; i < g_strv_length(dirs); i++) {
+                self.walk_failed = FALSE;
+                self.walk_files = 0;
+                search_directory(&self, dirs[i]);
+                /* Don't prune an unreadable tree, see root_prunable for
+                 * unmounted ones */
+                if (!self.walk_failed &&
+                    g_file_test(dirs[i], G_FILE_TEST_IS_DIR)) {
+                        root.path = dirs[i];
+                        root.device = root_device(dirs[i]);
+                        root.files = self.walk_files;
+                        g_array_append_val(walked, root);
+                }
+        }
+
+        /* Wait for all queued files to be parsed */
+        if (self.pool) {
+                g_thread_pool_free(self.pool, FALSE, TRUE);
+        }
+
+        /* Commit the remainder, and wait for the writer to finish */
+        scan_batch_flush(&self);
+        g_async_queue_push(self.queue, &end_of_scan);
+        g_thread_join(writer);
+
+        /* Drop anything under the walked roots that this scan didn't see,
+         * and remember the device each was pruned on */
+        for (i=0; i < walked->len; i++) {
+                root = g_array_index(walked, ScanRoot, i);
+                if (!root_prunable(db, &root, generation)) {
+                        continue;
+                }
+                budgie_db_prune(db, root.path, generation);
+                if (root.device != 0) {
+                        budgie_db_set_root_device(db, root.path, root.device);
+                }
+        }
+        g_array_free(walked, TRUE);
+
+        /* Every batch has been written and freed, and its names with it */
+        g_string_chunk_free(self.names);
+        g_mutex_clear(&self.names_lock);
+        g_async_queue_unref(self.queue);
+        g_hash_table_unref(self.done);
+        g_mutex_clear(&self.lock);
+        g_cond_clear(&self.cond);
+        g_mutex_clear(&self.queue_lock);
+        g_cond_clear(&self.queue_cond);
+
+        return self.n_written;
+}
@@ -0,0 +1,66 @@
+/*
+ * budgie-scanner.h
+ * 
+ * Copyright 2013 Ikey Doherty <ikey.doherty@gmail.com>
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ * 
+ * 
+ */
+#ifndef budgie_scanner_h
+#define budgie_scanner_h
+
+#include <glib.h>
+
+#include "db/budgie-db.h"
+
+/**
+ * Called from the database writer thread after each committed batch
+ * @param n_written Total number of tracks written so far
+ * @param userdata User data passed to budgie_scanner_scan
+ */
+typedef void (*BudgieScanFunc)(guint n_written, gpointer userdata);
+
+/**
+ * Search directories for media, and store it in the database
+ *
+ * The directory walk happens on the calling thread, and feeds a bounded
+ * queue of tag readers. Parsed tracks are collected in walk order, so
+ * the output does not depend on the number of workers, and are handed
+ * in batches to a single database writer thread. Tracks become visible
+ * in the database while the scan is still running.
+ *
+ * Once complete, tracks beneath each fully walked directory that were
+ * not seen by this scan are removed from the database.
+ *
+ * @param db Database to update, also used to skip unchanged files
+ * @param dirs NULL terminated array of directories or files to search
+ * @param n_params Number of following mime type prefixes
+ * @param mimes Array of mime prefixes to find (i.e. audio/)
+ * @param workers Number of tag reading threads, or 0 for one per CPU
+ * @param func Function to call after each committed batch, or NULL
+ * @param userdata User data to pass to func
+ * @return the number of new or changed tracks written
+ */
+guint budgie_scanner_scan(BudgieDB *db,
+                          gchar **dirs,
+                          int n_params,
+                          const gchar **mimes,
+                          guint workers,
+                          BudgieScanFunc func,
+                          gpointer userdata);
+
+#endif /* budgie_scanner_h */
@@ -104,7 +104,7 @@ static void budgie_track_list_init(BudgieTrackList *self)
                 G_TYPE_STRING, /* Genre */
                 G_TYPE_STRING, /* File path */
                 G_TYPE_STRING, /* MIME type */
-                G_TYPE_POINTER, /* MediaInfo */
+                MEDIA_INFO_TYPE, /* MediaInfo */
                 G_TYPE_STRING /* Now-playing */
                 );
 
@@ -199,5 +199,6 @@ void budgie_track_list_update_playing(BudgieTrackList *self, MediaInfo *now_play
                                 BUDGIE_TRACK_LIST_DB_PLAYING, NULL,
                                 -1);
                 }
+                media_info_unref(info);
         } while (gtk_tree_model_iter_next(model, &iter));
 }
@@ -30,6 +30,10 @@
 #include "common.h"
 #include "budgie-window.h"
 #include "budgie-media-view.h"
+#include "budgie-scanner.h"
+
+/* Media types found in the media directories */
+static const gchar *media_mimes[] = { "audio/", "video/" };
 
 /* Private storage */
 struct _BudgieWindowPrivate {
@@ -56,8 +60,11 @@ static void init_styles(BudgieWindow *self);
 
 static gboolean load_media_t(gpointer data);
 static gpointer load_media(gpointer data);
+static gboolean load_media_done(gpointer data);
+static void library_checked_cb(GObject *source, GAsyncResult *result, gpointer userdata);
 
 /* Callbacks */
+static void set_media(BudgieWindow *self, MediaInfo *media);
 static void play_cb(GtkWidget *widget, gpointer userdata);
 static void pause_cb(GtkWidget *widget, gpointer userdata);
 static void next_cb(GtkWidget *widget, gpointer userdata);
@@ -74,6 +81,7 @@ static void settings_changed(GSettings *settings, gchar *key, gpointer userdata)
 static void toolbar_cb(BudgieControlBar *bar, int action, gboolean toggle, gpointer userdata);
 static void seek_cb(BudgieStatusArea *status, gint64 value, gpointer userdata);
 static void media_selected_cb(BudgieMediaView *view, gpointer info, gpointer userdata);
+static void search_changed_cb(GtkSearchEntry *entry, gpointer userdata);
 static void error_dismiss_cb(GtkWidget *widget, gpointer userdata);
 
 /* GStreamer callbacks */
@@ -110,9 +118,8 @@ static void budgie_window_init(BudgieWindow *self)
         GtkWidget *layout;
         GtkWidget *settings_view;
         GstBus *bus;
-        GSList *tracks;
+        BudgieDBCursor *cursor;
         GdkVisual *visual;
-        guint length;
         gchar **media_dirs = NULL;
         const gchar *dirs[3];
         gboolean b_value;
@@ -149,6 +156,16 @@ static void budgie_window_init(BudgieWindow *self)
         }
         self->media_dirs = media_dirs;
         self->db = budgie_db_new();
+        if (g_settings_get_boolean(self->priv->settings, BUDGIE_LIBRARY_SNAPSHOT)) {
+                self->library = budgie_library_new(self->db);
+        }
+        self->art_cache = budgie_art_cache_new((gsize)g_settings_get_int(
+                self->priv->settings, BUDGIE_ART_CACHE_SIZE) * 1024 * 1024);
+
+        /* Keep the library up to date while we're running */
+        self->watcher = budgie_library_watcher_new(self->db,
+                G_N_ELEMENTS(media_mimes), media_mimes);
+        budgie_library_watcher_set_directories(self->watcher, media_dirs);
 
         init_styles(self);
 
@@ -279,6 +296,8 @@ static void budgie_window_init(BudgieWindow *self)
 
         /* Browse view */
         view = budgie_media_view_new(NULL);
+        g_object_set(view, "library", self->library,
+                "art-cache", self->art_cache, NULL);
         g_signal_connect(view, "media-selected",
                 G_CALLBACK(media_selected_cb), self);
         self->view = view;
@@ -308,12 +327,14 @@ static void budgie_window_init(BudgieWindow *self)
         gtk_stack_add_named(GTK_STACK(stack), settings_view, "settings");
         self->settings = settings_view;
 
-        /* search button. */
-        search = gtk_button_new_from_icon_name("edit-find-symbolic", GTK_ICON_SIZE_SMALL_TOOLBAR);
-        gtk_button_set_relief(GTK_BUTTON(search), GTK_RELIEF_NONE);
-        /* currently disabled. on account of its not implemeneted.
-         * gtk_header_bar_pack_end(GTK_HEADER_BAR(header), search);*/
+        /* Search entry. search-changed is already debounced by GTK, so
+         * each query is only run once typing pauses. */
+        search = gtk_search_entry_new();
+        gtk_entry_set_placeholder_text(GTK_ENTRY(search), "Search");
+        gtk_header_bar_pack_end(GTK_HEADER_BAR(header), search);
         gtk_widget_set_margin_end(search, 10);
+        g_signal_connect(search, "search-changed",
+                G_CALLBACK(search_changed_cb), self);
         self->search = search;
 
         /* Initialise gstreamer */
@@ -330,15 +351,12 @@ static void budgie_window_init(BudgieWindow *self)
 
         g_timeout_add(1000, refresh_cb, self);
 
-        tracks = budgie_db_get_all_media(self->db);
-        length = g_slist_length(tracks);
-        g_slist_free_full(tracks, free_media_info);
-        /* Start thread from idle queue */
-        if (length == 0) {
-                g_idle_add(load_media_t, self);
-        } else {
-                g_object_set(view, "database", self->db, NULL);
-        }
+        /* Only need to know whether the library is empty. The fetch
+         * keeps the cursor alive until it completes. */
+        cursor = budgie_db_cursor_open(self->db, MEDIA_QUERY_TITLE,
+                MATCH_QUERY_EXACT, NULL);
+        budgie_db_cursor_fetch_async(cursor, 1, NULL, library_checked_cb, self);
+        budgie_db_cursor_close(cursor);
 
         gtk_widget_realize(window);
         gtk_widget_show_all(window);
@@ -369,9 +387,15 @@ static void budgie_window_dispose(GObject *object)
                 g_free(self->priv->uri);
                 self->priv->uri = NULL;
         }
+        set_media(self, NULL);
 
         g_strfreev(self->media_dirs);
         g_object_unref(self->priv->settings);
+        g_object_unref(self->watcher);
+        if (self->library) {
+                g_object_unref(self->library);
+        }
+        g_object_unref(self->art_cache);
         g_object_unref(self->db);
 
         gst_element_set_state(self->gst_player, GST_STATE_NULL);
@@ -403,6 +427,18 @@ static void init_styles(BudgieWindow *self)
         self->css_provider = css_provider;
 }
 
+/**
+ * Change the current media, holding a reference on it while we play
+ */
+static void set_media(BudgieWindow *self, MediaInfo *media)
+{
+        if (media) {
+                media_info_ref(media);
+        }
+        media_info_unref(self->priv->media);
+        self->priv->media = media;
+}
+
 static void play_cb(GtkWidget *widget, gpointer userdata)
 {
         BudgieWindow *self;
@@ -517,7 +553,7 @@ static void next_cb(GtkWidget *widget, gpointer userdata)
                 /* Revisit */
                 return;
         }
-        self->priv->media = next;
+        set_media(self, next);
         gst_element_set_state(self->gst_player, GST_STATE_NULL);
         /* In future only do this if not paused */
         play_cb(NULL, userdata);
@@ -538,7 +574,7 @@ static void prev_cb(GtkWidget *widget, gpointer userdata)
                 /* Revisit */
                 return;
         }
-        self->priv->media = prev;
+        set_media(self, prev);
         gst_element_set_state(self->gst_player, GST_STATE_NULL);
         /* In future only do this if not paused */
         play_cb(NULL, userdata);
@@ -659,50 +695,85 @@ static void _gst_error_cb(GstBus *bus, GstMessage *msg, gpointer userdata)
         budgie_status_area_set_media(BUDGIE_STATUS_AREA(self->status), NULL);
 }
 
+/**
+ * Show the library, and scan straight away if it's empty
+ */
+static void library_checked_cb(GObject *source, GAsyncResult *result, gpointer userdata)
+{
+        BudgieWindow *self;
+        GPtrArray *first;
+
+        self = BUDGIE_WINDOW(userdata);
+        first = budgie_db_cursor_fetch_finish(BUDGIE_DB(source), result, NULL);
+        g_object_set(self->view, "database", self->db, NULL);
+        if (!first || first->len == 0) {
+                load_media_t(self);
+        }
+        if (first) {
+                g_ptr_array_unref(first);
+        }
+}
+
+/* What the reload thread scans. The directories are its own copy, as
+ * settings_changed replaces self->media_dirs on the main thread. */
+typedef struct LoadMedia {
+        BudgieWindow *self;
+        gchar **dirs;
+        guint workers;
+} LoadMedia;
+
 static gboolean load_media_t(gpointer data)
 {
         BudgieWindow *self;
+        LoadMedia *load;
+        gint workers;
         __attribute__((unused)) GThread *thread;
 
         self = BUDGIE_WINDOW(data);
         budgie_control_bar_set_action_enabled(BUDGIE_CONTROL_BAR(self->toolbar),
                 BUDGIE_ACTION_RELOAD, FALSE);
 
-        thread = g_thread_new("reload-media", &load_media, data);
+        workers = g_settings_get_int(self->priv->settings, BUDGIE_SCAN_WORKERS);
+        load = g_new0(LoadMedia, 1);
+        load->self = g_object_ref(self);
+        load->dirs = g_strdupv(self->media_dirs);
+        load->workers = (guint)MAX(workers, 0);
+
+        thread = g_thread_new("reload-media", &load_media, load);
 
         return FALSE;
 }
 
 static gpointer load_media(gpointer data)
 {
-        BudgieWindow *self;
-        GSList *tracks = NULL;
-        guint length, i;
-        const gchar *mimes[2];
+        LoadMedia *load;
 
-        self = BUDGIE_WINDOW(data);
-        if (self->media_dirs) {
-                g_strfreev(self->media_dirs);
-                self->media_dirs = g_settings_get_strv(self->priv->settings, BUDGIE_MEDIA_DIRS);
-        }
+        load = data;
+        /* The view follows along through the database's signals */
+        budgie_scanner_scan(load->self->db, load->dirs,
+                G_N_ELEMENTS(media_mimes), media_mimes,
+                load->workers, NULL, NULL);
 
-        length = g_strv_length(self->media_dirs);
-        mimes[0] = "audio/";
-        mimes[1] = "video/";
-        for (i=0; i < length; i++) {
-                search_directory(self->media_dirs[i], &tracks, 2, mimes);
-        }
+        g_idle_add(load_media_done, load);
+
+        return NULL;
+}
 
-        /* Update the database with the tracklist */
-        budgie_db_update(self->db, tracks);
-        g_slist_free_full(tracks, free_media_info);
+/**
+ * Back on the main thread once a reload has finished
+ */
+static gboolean load_media_done(gpointer data)
+{
+        LoadMedia *load;
 
-        budgie_control_bar_set_action_enabled(BUDGIE_CONTROL_BAR(self->toolbar),
+        load = data;
+        budgie_control_bar_set_action_enabled(BUDGIE_CONTROL_BAR(load->self->toolbar),
                 BUDGIE_ACTION_RELOAD, TRUE);
+        g_strfreev(load->dirs);
+        g_object_unref(load->self);
+        g_free(load);
 
-        g_object_set(BUDGIE_MEDIA_VIEW(self->view), "database", self->db, NULL);
-
-        return NULL;
+        return FALSE;
 }
 
 static gboolean draw_cb(GtkWidget *widget, cairo_t *cr, gpointer userdata) {
@@ -827,6 +898,19 @@ static void settings_changed(GSettings *settings, gchar *key, gpointer userdata)
                 budgie_control_bar_set_action_state(BUDGIE_CONTROL_BAR(self->toolbar),
                         BUDGIE_ACTION_REPEAT, bool_value);
                 self->priv->repeat = bool_value;
+        } else if (g_str_equal(key, BUDGIE_MEDIA_DIRS)) {
+                /* Any reload in progress scans its own copy */
+                g_strfreev(self->media_dirs);
+                self->media_dirs = g_settings_get_strv(self->priv->settings,
+                        BUDGIE_MEDIA_DIRS);
+                if (self->watcher) {
+                        budgie_library_watcher_set_directories(self->watcher,
+                                self->media_dirs);
+                }
+        } else if (g_str_equal(key, BUDGIE_ART_CACHE_SIZE) && self->art_cache) {
+                budgie_art_cache_set_budget(self->art_cache,
+                        (gsize)g_settings_get_int(self->priv->settings,
+                        BUDGIE_ART_CACHE_SIZE) * 1024 * 1024);
         }
 }
 static void toolbar_cb(BudgieControlBar *bar, int action, gboolean toggle, gpointer userdata)
@@ -900,11 +984,20 @@ static void media_selected_cb(BudgieMediaView *view, gpointer info, gpointer use
 
         self = BUDGIE_WINDOW(userdata);
         media = (MediaInfo*)info;
-        self->priv->media = media;
+        set_media(self, media);
         gst_element_set_state(self->gst_player, GST_STATE_NULL);
         play_cb(NULL, userdata);
 }
 
+static void search_changed_cb(GtkSearchEntry *entry, gpointer userdata)
+{
+        BudgieWindow *self;
+
+        self = BUDGIE_WINDOW(userdata);
+        budgie_media_view_search(BUDGIE_MEDIA_VIEW(self->view),
+                gtk_entry_get_text(GTK_ENTRY(entry)));
+}
+
 static void error_dismiss_cb(GtkWidget *widget, gpointer userdata)
 {
         BudgieWindow *self;
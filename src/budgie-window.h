@@ -33,7 +33,10 @@
 #include "budgie-control-bar.h"
 #include "budgie-settings-view.h"
 #include "util.h"
+#include "budgie-library-watcher.h"
 #include "db/budgie-db.h"
+#include "db/budgie-library.h"
+#include "budgie-art-cache.h"
 
 #define PLAYER_CSS "\
 .titlebar, .header {\
@@ -84,6 +87,9 @@ struct _BudgieWindow {
         GtkWidget *toolbar;
 
         BudgieDB *db;
+        BudgieLibrary *library;
+        BudgieLibraryWatcher *watcher;
+        BudgieArtCache *art_cache;
 
         GtkWidget *status;
         GtkWidget *view;
@@ -43,5 +43,17 @@
  * Whether we sport a dark theme or not
  */
 #define BUDGIE_DARK "dark-theme"
+/**
+ * Number of tag reading threads used when scanning, 0 for one per CPU
+ */
+#define BUDGIE_SCAN_WORKERS "scan-workers"
+/**
+ * Whether to keep an in-memory snapshot of the library for the views
+ */
+#define BUDGIE_LIBRARY_SNAPSHOT "library-snapshot"
+/**
+ * Megabytes of decoded album art to keep in memory
+ */
+#define BUDGIE_ART_CACHE_SIZE "art-cache-size"
 
 #endif /* common_h */
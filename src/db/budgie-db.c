@@ -27,11 +27,99 @@
 
 #include "budgie-db.h"
 
+/**
+ * Query shapes with a long-lived prepared statement. Field queries have
+ * one statement per MediaQuery, and searches one per MediaQuery and
+ * MatchQuery pair.
+ */
+enum {
+        DB_STMT_UPDATE = 0,
+        DB_STMT_UPDATE_BATCH,
+        DB_STMT_PATH_ROW,
+        DB_STMT_ADD_ARTIST,
+        DB_STMT_ADD_ALBUM,
+        DB_STMT_ADD_GENRE,
+        DB_STMT_PRUNE_ARTIST,
+        DB_STMT_PRUNE_ALBUM,
+        DB_STMT_PRUNE_GENRE,
+        DB_STMT_GET_MEDIA,
+        DB_STMT_GET_ID,
+        DB_STMT_SERIAL,
+        DB_STMT_FILE_UNCHANGED,
+        DB_STMT_TOUCH,
+        DB_STMT_PRUNE,
+        DB_STMT_PRUNE_IDS,
+        DB_STMT_STALE,
+        DB_STMT_ROOT_DEVICE,
+        DB_STMT_SET_ROOT_DEVICE,
+        DB_STMT_REMOVE_PATH,
+        DB_STMT_REMOVE_PATH_IDS,
+        DB_STMT_ALL_MEDIA,
+        DB_STMT_PAGE_ALL,
+        DB_STMT_ALBUMS,
+        DB_STMT_FTS,
+        DB_STMT_ALL_BY_FIELD,
+        DB_STMT_SEARCH = DB_STMT_ALL_BY_FIELD + MEDIA_QUERY_MAX,
+        DB_STMT_PAGE = DB_STMT_SEARCH + MEDIA_QUERY_MAX * MATCH_QUERY_MAX,
+        DB_STMT_MAX = DB_STMT_PAGE + MEDIA_QUERY_MAX * MATCH_QUERY_MAX
+};
+
+/* The name tables, in the order of their DB_STMT_PRUNE_* statements */
+enum {
+        DB_NAMES_ARTIST = 0,
+        DB_NAMES_ALBUM,
+        DB_NAMES_GENRE,
+        DB_NAMES_MAX
+};
+
+/* Maximum number of reader connections, opened as needed */
+#define DB_MAX_READERS 4
+
+/* Oldest SQLite with UPSERT, which budgie_db_update relies on */
+#define DB_SQLITE_MIN_VERSION 3024000
+
+/* How long a connection waits on a lock before giving up (ms) */
+#define DB_BUSY_TIMEOUT 5000
+
+/* Rows written by each upsert in budgie_db_update. At twelve parameters
+ * a row this stays under SQLite's default limit of 999. */
+#define DB_UPDATE_BATCH 64
+
+/* A connection, with its own cache of prepared statements */
+typedef struct BudgieDBConn {
+        sqlite3 *db;
+        sqlite3_stmt *stmts[DB_STMT_MAX];
+        BudgieDB *owner;
+} BudgieDBConn;
+
 /* Private storage */
 struct _BudgieDBPrivate {
         gchar *storage_path;
-        sqlite3 *db;
         char *zErrMesg;
+        gint64 generation;
+
+        /* Serial as of the latest change signal emitted, main context
+         * only. See budgie_db_get_emitted_serial. */
+        gint64 emitted_serial;
+
+        /* The only connection that writes, guarded by write_lock */
+        BudgieDBConn *writer;
+        GMutex write_lock;
+
+        /* Idle reader connections. With WAL, reads don't wait for writes */
+        GAsyncQueue *readers;
+        GMutex reader_lock;
+        guint n_readers;
+
+        /* Runs _async queries, one thread per reader at most */
+        GThreadPool *pool;
+
+        /* Where change signals are emitted */
+        GMainContext *context;
+
+        /* See budgie_db_set_plan_func */
+        BudgieDBPlanFunc plan_func;
+        gpointer plan_data;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(BudgieDB, budgie_db, G_TYPE_OBJECT)
@@ -41,24 +129,283 @@ static void budgie_db_class_init(BudgieDBClass *klass);
 static void budgie_db_init(BudgieDB *self);
 static void budgie_db_dispose(GObject *object);
 
-/* Used to keep the database thread safe */
-static GMutex _lock;
-
 /* Utility functions */
 static gboolean _db_create(BudgieDB *self);
-static gchar* _sanitize_value(gchar *val);
+static gboolean _db_migrate(BudgieDB *self);
+static gboolean _db_supported(BudgieDBConn *conn);
+static void _db_clear_error(BudgieDB *self);
+static gint64 _db_last_generation(BudgieDB *self);
+static BudgieDBConn* _db_conn_open(BudgieDB *self);
+static void _db_conn_close(BudgieDBConn *conn);
+static BudgieDBConn* _db_reader_get(BudgieDB *self);
+static void _db_reader_put(BudgieDB *self, BudgieDBConn *conn);
+static gchar* _db_escape_like(const gchar *term);
+static gchar* _db_search_pattern(MatchQuery match, const gchar *term);
+static sqlite3_stmt* _db_search_statement(BudgieDBConn *conn,
+                                          MediaQuery query,
+                                          MatchQuery match);
+static sqlite3_stmt* _db_statement(BudgieDBConn *conn, guint id, const gchar *sql);
+static void _db_statement_done(BudgieDBConn *conn, sqlite3_stmt *stmt);
+static void _db_emit(BudgieDB *self,
+                     const gchar *signal,
+                     GArray *ids,
+                     gint64 serial);
+static gint64 _db_writer_serial(BudgieDB *self);
+static void _db_job_run(gpointer data, gpointer userdata);
+static void _db_run_async(BudgieDB *self, GTask *task, GTaskThreadFunc func);
+static GPtrArray* _db_search(BudgieDB *self,
+                             MediaQuery query,
+                             MatchQuery match,
+                             const gchar *term,
+                             gint max,
+                             GCancellable *cancellable);
+static gchar* _db_fts_query(const gchar *text);
+static GPtrArray* _db_fts_search(BudgieDB *self,
+                                 const gchar *text,
+                                 gint max,
+                                 GCancellable *cancellable);
+static BudgieDBCursor* _db_cursor_ref(BudgieDBCursor *cursor);
+static void _db_cursor_unref(BudgieDBCursor *cursor);
+static guint _db_cursor_fetch(BudgieDBCursor *cursor,
+                              guint max,
+                              GPtrArray *results,
+                              GCancellable *cancellable);
+
+/* Column names, indexed by MediaQuery */
+static const gchar *_db_fields[MEDIA_QUERY_MAX] = {
+        "title",
+        "artist",
+        "album",
+        "genre",
+        "mimetype"
+};
+
+/* Tables holding the distinct values of each field, if normalised */
+static const gchar *_db_tables[MEDIA_QUERY_MAX] = {
+        NULL,
+        "artists",
+        "albums",
+        "genres",
+        NULL
+};
+
+/**
+ * Schema upgrades for existing databases, applied in order. The index of
+ * each entry is the version it upgrades from, and the resulting version
+ * is recorded using PRAGMA user_version.
+ */
+static const gchar *_db_migrations[] = {
+        /* 0 -> 1: File stamps, so that rescans may skip unchanged files */
+        "ALTER TABLE items ADD COLUMN mtime INTEGER NOT NULL DEFAULT 0;"
+        "ALTER TABLE items ADD COLUMN size INTEGER NOT NULL DEFAULT 0;"
+        "ALTER TABLE items ADD COLUMN inode INTEGER NOT NULL DEFAULT 0;",
+        /* 1 -> 2: Scan generations, so that rows not seen may be pruned */
+        "ALTER TABLE items ADD COLUMN generation INTEGER NOT NULL DEFAULT 0;"
+        "CREATE TABLE scans("
+        "generation INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "started INTEGER NOT NULL);",
+        /* 2 -> 3: Indexes for field lookups, and the (track, id) ordering
+         * every listing uses. Prefix LIKE on the mimetype needs NOCASE. */
+        "CREATE INDEX IF NOT EXISTS items_album ON items(album, track);"
+        "CREATE INDEX IF NOT EXISTS items_artist ON items(artist, track);"
+        "CREATE INDEX IF NOT EXISTS items_genre ON items(genre, track);"
+        "CREATE INDEX IF NOT EXISTS items_mimetype ON items(mimetype COLLATE NOCASE, track);"
+        "CREATE INDEX IF NOT EXISTS items_track ON items(track, ID, album);",
+        /* 3 -> 4: Full-text index over the tag fields, kept in step with
+         * items by triggers. Prefix indexes make search-as-you-type cheap
+         * for the first few characters. */
+        "CREATE VIRTUAL TABLE items_fts USING fts5("
+        "title, artist, album, band, genre,"
+        "content='items', content_rowid='ID', prefix='2 3');"
+        "CREATE TRIGGER items_fts_insert AFTER INSERT ON items BEGIN "
+        "INSERT INTO items_fts(rowid, title, artist, album, band, genre) "
+        "VALUES (new.ID, new.title, new.artist, new.album, new.band, new.genre); "
+        "END;"
+        "CREATE TRIGGER items_fts_delete AFTER DELETE ON items BEGIN "
+        "INSERT INTO items_fts(items_fts, rowid, title, artist, album, band, genre) "
+        "VALUES ('delete', old.ID, old.title, old.artist, old.album, old.band, old.genre); "
+        "END;"
+        "CREATE TRIGGER items_fts_update "
+        "AFTER UPDATE OF title, artist, album, band, genre ON items BEGIN "
+        "INSERT INTO items_fts(items_fts, rowid, title, artist, album, band, genre) "
+        "VALUES ('delete', old.ID, old.title, old.artist, old.album, old.band, old.genre); "
+        "INSERT INTO items_fts(rowid, title, artist, album, band, genre) "
+        "VALUES (new.ID, new.title, new.artist, new.album, new.band, new.genre); "
+        "END;"
+        "INSERT INTO items_fts(items_fts) VALUES ('rebuild');",
+        /* 4 -> 5: A serial bumped by every change to the browse data, so
+         * that caches of it can tell whether they're stale */
+        "CREATE TABLE changes(serial INTEGER NOT NULL);"
+        "INSERT INTO changes VALUES (0);"
+        "CREATE TRIGGER changes_insert AFTER INSERT ON items BEGIN "
+        "UPDATE changes SET serial = serial + 1; END;"
+        "CREATE TRIGGER changes_delete AFTER DELETE ON items BEGIN "
+        "UPDATE changes SET serial = serial + 1; END;"
+        "CREATE TRIGGER changes_update AFTER UPDATE OF "
+        "title, track, artist, album, band, genre, path, mimetype ON items BEGIN "
+        "UPDATE changes SET serial = serial + 1; END;",
+        /* 5 -> 6: Artists (and bands), albums and genres move into their
+         * own tables, referenced by id from tracks. items becomes a view
+         * joining them back up, so readers keep working. Writes go to
+         * tracks, and the triggers move with them. */
+        "CREATE TABLE artists(ID INTEGER PRIMARY KEY, name TEXT NOT NULL UNIQUE);"
+        "CREATE TABLE albums(ID INTEGER PRIMARY KEY, name TEXT NOT NULL UNIQUE);"
+        "CREATE TABLE genres(ID INTEGER PRIMARY KEY, name TEXT NOT NULL UNIQUE);"
+        "INSERT OR IGNORE INTO artists(name) SELECT artist FROM items WHERE artist IS NOT NULL;"
+        "INSERT OR IGNORE INTO artists(name) SELECT band FROM items WHERE band IS NOT NULL;"
+        "INSERT OR IGNORE INTO albums(name) SELECT album FROM items WHERE album IS NOT NULL;"
+        "INSERT OR IGNORE INTO genres(name) SELECT genre FROM items WHERE genre IS NOT NULL;"
+        "CREATE TABLE tracks("
+        "ID INTEGER PRIMARY KEY NOT NULL,"
+        "title TEXT NOT NULL,"
+        "track INTEGER NOT NULL,"
+        "artist INTEGER REFERENCES artists(ID),"
+        "album INTEGER REFERENCES albums(ID),"
+        "band INTEGER REFERENCES artists(ID),"
+        "genre INTEGER REFERENCES genres(ID),"
+        "path TEXT NOT NULL UNIQUE,"
+        "mimetype TEXT NOT NULL,"
+        "mtime INTEGER NOT NULL DEFAULT 0,"
+        "size INTEGER NOT NULL DEFAULT 0,"
+        "inode INTEGER NOT NULL DEFAULT 0,"
+        "generation INTEGER NOT NULL DEFAULT 0);"
+        "INSERT INTO tracks SELECT i.ID, i.title, i.track, ar.ID, al.ID, b.ID, g.ID, "
+        "i.path, i.mimetype, i.mtime, i.size, i.inode, i.generation FROM items i "
+        "LEFT JOIN artists ar ON ar.name = i.artist "
+        "LEFT JOIN albums al ON al.name = i.album "
+        "LEFT JOIN artists b ON b.name = i.band "
+        "LEFT JOIN genres g ON g.name = i.genre;"
+        "DROP TABLE items_fts;"
+        "DROP TABLE items;"
+        "CREATE VIEW items AS SELECT t.ID AS ID, t.title AS title, t.track AS track, "
+        "ar.name AS artist, al.name AS album, b.name AS band, g.name AS genre, "
+        "t.path AS path, t.mimetype AS mimetype, t.mtime AS mtime, t.size AS size, "
+        "t.inode AS inode, t.generation AS generation FROM tracks t "
+        "LEFT JOIN artists ar ON ar.ID = t.artist "
+        "LEFT JOIN albums al ON al.ID = t.album "
+        "LEFT JOIN artists b ON b.ID = t.band "
+        "LEFT JOIN genres g ON g.ID = t.genre;"
+        "CREATE INDEX tracks_album ON tracks(album, track);"
+        "CREATE INDEX tracks_artist ON tracks(artist, track);"
+        "CREATE INDEX tracks_band ON tracks(band);"
+        "CREATE INDEX tracks_genre ON tracks(genre, track);"
+        "CREATE INDEX tracks_mimetype ON tracks(mimetype COLLATE NOCASE, track);"
+        "CREATE INDEX tracks_track ON tracks(track, ID, album);"
+        "CREATE VIRTUAL TABLE items_fts USING fts5("
+        "title, artist, album, band, genre,"
+        "content='items', content_rowid='ID', prefix='2 3');"
+        "CREATE TRIGGER items_fts_insert AFTER INSERT ON tracks BEGIN "
+        "INSERT INTO items_fts(rowid, title, artist, album, band, genre) "
+        "SELECT ID, title, artist, album, band, genre FROM items WHERE ID = new.ID; "
+        "END;"
+        "CREATE TRIGGER items_fts_delete BEFORE DELETE ON tracks BEGIN "
+        "INSERT INTO items_fts(items_fts, rowid, title, artist, album, band, genre) "
+        "SELECT 'delete', ID, title, artist, album, band, genre FROM items WHERE ID = old.ID; "
+        "END;"
+        "CREATE TRIGGER items_fts_update_old "
+        "BEFORE UPDATE OF title, artist, album, band, genre ON tracks BEGIN "
+        "INSERT INTO items_fts(items_fts, rowid, title, artist, album, band, genre) "
+        "SELECT 'delete', ID, title, artist, album, band, genre FROM items WHERE ID = old.ID; "
+        "END;"
+        "CREATE TRIGGER items_fts_update_new "
+        "AFTER UPDATE OF title, artist, album, band, genre ON tracks BEGIN "
+        "INSERT INTO items_fts(rowid, title, artist, album, band, genre) "
+        "SELECT ID, title, artist, album, band, genre FROM items WHERE ID = new.ID; "
+        "END;"
+        "INSERT INTO items_fts(items_fts) VALUES ('rebuild');"
+        "CREATE TRIGGER changes_insert AFTER INSERT ON tracks BEGIN "
+        "UPDATE changes SET serial = serial + 1; END;"
+        "CREATE TRIGGER changes_delete AFTER DELETE ON tracks BEGIN "
+        "UPDATE changes SET serial = serial + 1; END;"
+        "CREATE TRIGGER changes_update AFTER UPDATE OF "
+        "title, track, artist, album, band, genre, path, mimetype ON tracks BEGIN "
+        "UPDATE changes SET serial = serial + 1; END;",
+        /* 6 -> 7: The device each media directory was last pruned on, so
+         * that another filesystem mounted there (or none) isn't taken to
+         * mean its tracks have gone */
+        "CREATE TABLE roots(path TEXT PRIMARY KEY, device INTEGER NOT NULL);",
+        /* 7 -> 8: The upsert sets every column, which fires every UPDATE
+         * OF trigger. Only act on the columns that really changed, so a
+         * file whose tags are the same leaves the search index and the
+         * change serial alone. */
+        "DROP TRIGGER items_fts_update_old;"
+        "DROP TRIGGER items_fts_update_new;"
+        "DROP TRIGGER changes_update;"
+        "CREATE TRIGGER items_fts_update_old "
+        "BEFORE UPDATE OF title, artist, album, band, genre ON tracks "
+        "WHEN old.title IS NOT new.title OR old.artist IS NOT new.artist "
+        "OR old.album IS NOT new.album OR old.band IS NOT new.band "
+        "OR old.genre IS NOT new.genre BEGIN "
+        "INSERT INTO items_fts(items_fts, rowid, title, artist, album, band, genre) "
+        "SELECT 'delete', ID, title, artist, album, band, genre FROM items WHERE ID = old.ID; "
+        "END;"
+        "CREATE TRIGGER items_fts_update_new "
+        "AFTER UPDATE OF title, artist, album, band, genre ON tracks "
+        "WHEN old.title IS NOT new.title OR old.artist IS NOT new.artist "
+        "OR old.album IS NOT new.album OR old.band IS NOT new.band "
+        "OR old.genre IS NOT new.genre BEGIN "
+        "INSERT INTO items_fts(rowid, title, artist, album, band, genre) "
+        "SELECT ID, title, artist, album, band, genre FROM items WHERE ID = new.ID; "
+        "END;"
+        "CREATE TRIGGER changes_update AFTER UPDATE OF "
+        "title, track, artist, album, band, genre, path, mimetype ON tracks "
+        "WHEN old.title IS NOT new.title OR old.track IS NOT new.track "
+        "OR old.artist IS NOT new.artist OR old.album IS NOT new.album "
+        "OR old.band IS NOT new.band OR old.genre IS NOT new.genre "
+        "OR old.path IS NOT new.path OR old.mimetype IS NOT new.mimetype BEGIN "
+        "UPDATE changes SET serial = serial + 1; END;",
+};
 
 /* MediaInfo API */
-MediaInfo* new_media_info(sqlite3_stmt *stmt)
+G_DEFINE_BOXED_TYPE(MediaInfo, media_info, media_info_ref, media_info_unref)
+
+MediaInfo* media_info_new(void)
 {
         MediaInfo *ret;
 
-        ret = malloc(sizeof(MediaInfo));
-        if (!ret){
-                g_error("Couldn't allocate memory for a new record!");
-                return NULL;
+        ret = g_slice_new0(MediaInfo);
+        ret->ref_count = 1;
+
+        return ret;
+}
+
+MediaInfo* media_info_ref(MediaInfo *info)
+{
+        g_return_val_if_fail(info != NULL, NULL);
+
+        g_atomic_int_inc(&info->ref_count);
+        return info;
+}
+
+void media_info_unref(gpointer p_info)
+{
+        MediaInfo *info;
+
+        info = (MediaInfo*)p_info;
+        if (!info || !g_atomic_int_dec_and_test(&info->ref_count)) {
+                return;
         }
 
+        /* The remaining strings are shared, see MediaInfo */
+        g_free(info->title);
+        g_free(info->path);
+        g_slice_free(MediaInfo, info);
+}
+
+/**
+ * Intern a column, so repeated artists, albums etc. share one string
+ */
+static const gchar *_db_column_intern(sqlite3_stmt *stmt, gint column)
+{
+        return g_intern_string((const gchar*)sqlite3_column_text(stmt, column));
+}
+
+MediaInfo* new_media_info(sqlite3_stmt *stmt)
+{
+        MediaInfo *ret;
+
+        ret = media_info_new();
+
         ret->id = sqlite3_column_int(stmt, BUDGIE_DB_COLUMN_ID);
 
         ret->title = g_strdup((gchar*)
@@ -67,59 +414,23 @@ MediaInfo* new_media_info(sqlite3_stmt *stmt)
 
         ret->track_no = sqlite3_column_int(stmt, BUDGIE_DB_COLUMN_TRACK);
 
-        ret->artist = g_strdup((gchar *)
-                               sqlite3_column_text(stmt,
-                                                   BUDGIE_DB_COLUMN_ARTIST));
-
-        ret->album = g_strdup((gchar *)
-                              sqlite3_column_text(stmt,
-                                                  BUDGIE_DB_COLUMN_ALBUM));
-
-        ret->band = g_strdup((gchar *)
-                             sqlite3_column_text(stmt,
-                                                 BUDGIE_DB_COLUMN_BAND));
-
-        ret->genre = g_strdup((gchar *)
-                              sqlite3_column_text(stmt,
-                                                  BUDGIE_DB_COLUMN_GENRE));
+        ret->artist = _db_column_intern(stmt, BUDGIE_DB_COLUMN_ARTIST);
+        ret->album = _db_column_intern(stmt, BUDGIE_DB_COLUMN_ALBUM);
+        ret->band = _db_column_intern(stmt, BUDGIE_DB_COLUMN_BAND);
+        ret->genre = _db_column_intern(stmt, BUDGIE_DB_COLUMN_GENRE);
 
         ret->path = g_strdup((gchar *)
                              sqlite3_column_text(stmt,
                                                  BUDGIE_DB_COLUMN_PATH));
 
-        ret->mime = g_strdup((gchar *)
-                             sqlite3_column_text(stmt,
-                                                 BUDGIE_DB_COLUMN_MIME));
-
-        return ret;
-}
+        ret->mime = _db_column_intern(stmt, BUDGIE_DB_COLUMN_MIME);
 
-void free_media_info(gpointer p_info)
-{
-        MediaInfo *info;
+        ret->mtime = sqlite3_column_int64(stmt, BUDGIE_DB_COLUMN_MTIME);
+        ret->size = sqlite3_column_int64(stmt, BUDGIE_DB_COLUMN_SIZE);
+        ret->inode = (guint64)sqlite3_column_int64(stmt, BUDGIE_DB_COLUMN_INODE);
+        ret->generation = sqlite3_column_int64(stmt, BUDGIE_DB_COLUMN_GENERATION);
 
-        info = (MediaInfo*)p_info;
-        if (info->title) {
-                g_free(info->title);
-        }
-        if (info->artist) {
-                g_free(info->artist);
-        }
-        if (info->album) {
-                g_free(info->album);
-        }
-        if (info->band) {
-                g_free(info->band);
-        }
-        if (info->genre) {
-                g_free(info->genre);
-        }
-        if (info->path) {
-                g_free(info->path);
-        }
-        if (info->mime) {
-                g_free(info->mime);
-        }
+        return ret;
 }
 
 /* Initialisation */
@@ -129,11 +440,26 @@ static void budgie_db_class_init(BudgieDBClass *klass)
 
         g_object_class = G_OBJECT_CLASS(klass);
         g_object_class->dispose = &budgie_db_dispose;
+
+        /* Each carries a GArray of the gint ids affected, in batches */
+        g_signal_new("items-added",
+                G_TYPE_FROM_CLASS(klass), G_SIGNAL_RUN_FIRST,
+                0, NULL, NULL, NULL, G_TYPE_NONE,
+                1, G_TYPE_ARRAY);
+        g_signal_new("items-changed",
+                G_TYPE_FROM_CLASS(klass), G_SIGNAL_RUN_FIRST,
+                0, NULL, NULL, NULL, G_TYPE_NONE,
+                1, G_TYPE_ARRAY);
+        g_signal_new("items-removed",
+                G_TYPE_FROM_CLASS(klass), G_SIGNAL_RUN_FIRST,
+                0, NULL, NULL, NULL, G_TYPE_NONE,
+                1, G_TYPE_ARRAY);
 }
 
 static void budgie_db_init(BudgieDB *self)
 {
         const gchar *config;
+        BudgieDBConn *reader;
         gint stat;
         self->priv = budgie_db_get_instance_private(self);
 
@@ -142,41 +468,132 @@ static void budgie_db_init(BudgieDB *self)
         self->priv->storage_path = g_strdup_printf("%s/%s", config,
                 CONFIG_NAME);
 
+        g_mutex_init(&self->priv->write_lock);
+        g_mutex_init(&self->priv->reader_lock);
+        self->priv->readers = g_async_queue_new();
+        self->priv->pool = g_thread_pool_new(_db_job_run, NULL,
+                DB_MAX_READERS, FALSE, NULL);
+        self->priv->context = g_main_context_ref_thread_default();
+
         /* Open the database */
-        stat = sqlite3_open(self->priv->storage_path, &self->priv->db);
+        self->priv->writer = _db_conn_open(self);
+        if (!self->priv->writer) {
+                g_error("Failed to open the database!");
+                return;
+        }
+        if (!_db_supported(self->priv->writer)) {
+                g_error("SQLite %s can't be used, 3.24.0 or later built "
+                        "with FTS5 is required", sqlite3_libversion());
+                return;
+        }
 
+        /* WAL lets readers carry on while a scan is writing */
+        stat = sqlite3_exec(self->priv->writer->db,
+                "PRAGMA journal_mode = WAL; PRAGMA synchronous = NORMAL;",
+                NULL, NULL, &self->priv->zErrMesg);
         if (stat != SQLITE_OK) {
-                g_error("Failed to open the database! %s", sqlite3_errmsg(self->priv->db));
-                sqlite3_close(self->priv->db);
+                g_warning("Unable to enable WAL: %s", self->priv->zErrMesg);
+                _db_clear_error(self);
         }
 
         /* Create a database if necessary */
         if (!_db_create(self)){
           g_error("Failed to initialise the database!");
-          sqlite3_close(self->priv->db);
+          _db_conn_close(self->priv->writer);
+          self->priv->writer = NULL;
+          return;
+        }
+
+        self->priv->generation = _db_last_generation(self);
+        self->priv->emitted_serial = _db_writer_serial(self);
+
+        /* Always have one reader, so that a reader is never waited for
+         * without one existing */
+        reader = _db_conn_open(self);
+        if (!reader) {
+                g_error("Failed to open the database for reading!");
+                return;
         }
+        sqlite3_exec(reader->db, "PRAGMA query_only = 1", NULL, NULL, NULL);
+        self->priv->n_readers = 1;
+        _db_reader_put(self, reader);
+}
+
+/**
+ * Build the bound value for a search, see _db_search_statement
+ */
+static gchar* _db_search_pattern(MatchQuery match, const gchar *term)
+{
+        gchar *e_term, *pattern;
+
+        if (match == MATCH_QUERY_EXACT) {
+                return g_strdup(term);
+        }
+
+        /* Wildcards within the term itself must match literally */
+        e_term = _db_escape_like(term);
+        switch (match) {
+                case MATCH_QUERY_START:
+                        pattern = g_strdup_printf("%s%%", e_term);
+                        break;
+                case MATCH_QUERY_END:
+                        pattern = g_strdup_printf("%%%s", e_term);
+                        break;
+                case MATCH_QUERY_ANYWHERE:
+                default:
+                        pattern = g_strdup_printf("%%%s%%", e_term);
+        }
+        g_free(e_term);
+
+        return pattern;
 }
 
-static gchar* _sanitize_value(gchar *val){
-        gint i;
-        gchar *res, *c;
+/**
+ * Return the search statement for a field and match type. The first
+ * parameter is the pattern, the second the limit, where a negative
+ * limit is no limit at all.
+ */
+static sqlite3_stmt* _db_search_statement(BudgieDBConn *conn,
+                                          MediaQuery query,
+                                          MatchQuery match)
+{
+        sqlite3_stmt *stmt;
+        const gchar *like_match;
+        gchar *sql;
+        guint id;
 
-        if (val == NULL){
-                res = g_strdup("");
-                return res;
+        id = DB_STMT_SEARCH + query * MATCH_QUERY_MAX + match;
+        stmt = conn->stmts[id];
+        if (stmt) {
+                return stmt;
         }
 
-        /* Lazy implementation. */
-        res = g_strnfill(strlen(val) * 2, '\0');
-        i = 0;
-        for (c = val; *c != '\0'; c++){
-                if (*c == '\''){
-                        res[i++] = '\'';
+        like_match = match == MATCH_QUERY_EXACT ? "== ?" : "LIKE ? ESCAPE '\\'";
+        sql = g_strdup_printf("SELECT * FROM items WHERE %s %s ORDER BY track ASC, id ASC LIMIT ?;",
+                _db_fields[query], like_match);
+        stmt = _db_statement(conn, id, sql);
+        g_free(sql);
+
+        return stmt;
+}
+
+/**
+ * Escape LIKE wildcards within a search term, for use with ESCAPE '\'
+ */
+static gchar* _db_escape_like(const gchar *term)
+{
+        GString *res;
+        const gchar *c;
+
+        res = g_string_sized_new(strlen(term) + 2);
+        for (c = term; *c != '\0'; c++){
+                if (*c == '%' || *c == '_' || *c == '\\'){
+                        g_string_append_c(res, '\\');
                 }
-                res[i++] = *c;
+                g_string_append_c(res, *c);
         }
 
-        return res;
+        return g_string_free(res, FALSE);
 }
 
 static gboolean _db_create(BudgieDB *self){
@@ -194,7 +611,7 @@ static gboolean _db_create(BudgieDB *self){
                 "mimetype TEXT NOT NULL"
                 ");");
 
-        stat = sqlite3_exec(self->priv->db, sql,
+        stat = sqlite3_exec(self->priv->writer->db, sql,
                             NULL, NULL, &self->priv->zErrMesg);
         g_free(sql);
         if (stat != SQLITE_OK && stat != SQLITE_DONE){
@@ -203,248 +620,1371 @@ static gboolean _db_create(BudgieDB *self){
                 return FALSE;
         }
 
-        return TRUE;
+        return _db_migrate(self);
 }
 
-static void budgie_db_dispose(GObject *object)
+static gboolean _db_migrate(BudgieDB *self)
 {
-        BudgieDB *self;
+        sqlite3_stmt *stmt = NULL;
+        gchar *sql;
+        gint version = 0;
+        gint stat;
+        guint i;
 
-        self = BUDGIE_DB(object);
-        if (self->priv->storage_path) {
-                g_free(self->priv->storage_path);
-                self->priv->storage_path = NULL;
+        stat = sqlite3_prepare_v2(self->priv->writer->db, "PRAGMA user_version",
+                -1, &stmt, NULL);
+        if (stat == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+                version = sqlite3_column_int(stmt, 0);
         }
+        sqlite3_finalize(stmt);
 
-        sqlite3_close(self->priv->db);
+        for (i = version; i < G_N_ELEMENTS(_db_migrations); i++) {
+                sql = g_strdup_printf("BEGIN; %s PRAGMA user_version = %d; COMMIT;",
+                        _db_migrations[i], i + 1);
+                stat = sqlite3_exec(self->priv->writer->db, sql,
+                                    NULL, NULL, &self->priv->zErrMesg);
+                g_free(sql);
+                if (stat != SQLITE_OK) {
+                        g_warning("Failed to migrate the database to version %d: %s",
+                                i + 1, self->priv->zErrMesg);
+                        _db_clear_error(self);
+                        sqlite3_exec(self->priv->writer->db, "ROLLBACK",
+                                NULL, NULL, NULL);
+                        return FALSE;
+                }
+        }
 
-        /* Destruct */
-        G_OBJECT_CLASS(budgie_db_parent_class)->dispose(object);
+        return TRUE;
 }
 
-/* Utility; return a new BudgieDB */
-BudgieDB* budgie_db_new(void)
+/**
+ * Whether this SQLite has everything the schema and queries use. FTS5
+ * may be left out of a build, so try creating a throwaway index.
+ */
+static gboolean _db_supported(BudgieDBConn *conn)
 {
-        BudgieDB *self;
+        if (sqlite3_libversion_number() < DB_SQLITE_MIN_VERSION) {
+                return FALSE;
+        }
 
-        self = g_object_new(BUDGIE_DB_TYPE, NULL);
-        return BUDGIE_DB(self);
+        return sqlite3_exec(conn->db,
+                "CREATE VIRTUAL TABLE temp.fts5_probe USING fts5(x);"
+                "DROP TABLE temp.fts5_probe;",
+                NULL, NULL, NULL) == SQLITE_OK;
 }
 
-gboolean budgie_db_update(BudgieDB *self, GSList *tracks)
+/**
+ * Release the message left by a failed sqlite3_exec, once reported
+ */
+static void _db_clear_error(BudgieDB *self)
 {
-        GSList *ref;
-        MediaInfo *info;
-        sqlite3_stmt *stmt;
-        gint stat;
-        gint c;
-
-        g_return_val_if_fail(self != NULL, FALSE);
-
-        gchar *sql = g_strdup(""
-                "insert or replace "
-                "into items(ID, title, track, artist, album, "
-                "           band, genre, path, mimetype) "
-                "values ( (select id from items where path == ?), "
-                              "         ?, ?, ?, ?, ?, ?, ?, ?);");
-
-        g_mutex_lock(&_lock);
+        sqlite3_free(self->priv->zErrMesg);
+        self->priv->zErrMesg = NULL;
+}
 
-        /* BEGIN */
-        stat = sqlite3_exec(self->priv->db, "BEGIN",
-                NULL, NULL, &self->priv->zErrMesg);
-        if (stat != SQLITE_OK) {
-                g_error("SQL error: %d", stat);
-                g_error("Further info: %s", self->priv->zErrMesg);
+static gint64 _db_last_generation(BudgieDB *self)
+{
+        sqlite3_stmt *stmt = NULL;
+        gint64 ret = 0;
 
-                g_free(sql);
-                g_mutex_unlock(&_lock);
-                return FALSE;
+        if (sqlite3_prepare_v2(self->priv->writer->db, "SELECT MAX(generation) FROM scans",
+                -1, &stmt, NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+                ret = sqlite3_column_int64(stmt, 0);
         }
+        sqlite3_finalize(stmt);
 
-        stat = sqlite3_prepare_v2(self->priv->db, (const char *) sql, -1,
-                &stmt, NULL);
-        if (stat != SQLITE_OK){
-                g_error("SQL error: %d", stat);
-                g_error("Failed to update the database!");
+        return ret;
+}
 
-                sqlite3_finalize(stmt);
-                g_free(sql);
-                g_mutex_unlock(&_lock);
-                return FALSE;
+static BudgieDBConn* _db_conn_open(BudgieDB *self)
+{
+        BudgieDBConn *conn;
+
+        conn = g_new0(BudgieDBConn, 1);
+        if (sqlite3_open(self->priv->storage_path, &conn->db) != SQLITE_OK) {
+                g_warning("Failed to open the database! %s",
+                        sqlite3_errmsg(conn->db));
+                sqlite3_close(conn->db);
+                g_free(conn);
+                return NULL;
         }
+        sqlite3_busy_timeout(conn->db, DB_BUSY_TIMEOUT);
+        conn->owner = self;
 
-        /* Now, go through the list and add all these new things. */
-        c = 0;
-        for (ref = tracks; ref != NULL; ref = g_slist_next(ref)) {
-                c++;
-                info = (MediaInfo*) ref->data;
-                sqlite3_reset(stmt);
+        return conn;
+}
+
+static void _db_conn_close(BudgieDBConn *conn)
+{
+        guint i;
 
-                /* Bind the values. */
-                stat = sqlite3_bind_text(stmt, 1, info->path, -1, NULL);
-                stat = sqlite3_bind_text(stmt, 2, info->title, -1, NULL);
-                stat = sqlite3_bind_int(stmt, 3, info->track_no);
-                stat = sqlite3_bind_text(stmt, 4, info->artist, -1, NULL);
-                stat = sqlite3_bind_text(stmt, 5, info->album, -1, NULL);
-                stat = sqlite3_bind_text(stmt, 6, info->band, -1, NULL);
-                stat = sqlite3_bind_text(stmt, 7, info->genre, -1, NULL);
-                stat = sqlite3_bind_text(stmt, 8, info->path, -1, NULL);
-                stat = sqlite3_bind_text(stmt, 9, info->mime, -1, NULL);
-
-                do {
-                        stat = sqlite3_step(stmt);
-                } while (stat == SQLITE_ROW);
-
-                if (stat != SQLITE_DONE){
-                        g_warning("SQL failed to add an item: %d", stat);
+        for (i=0; i < DB_STMT_MAX; i++) {
+                if (conn->stmts[i]) {
+                        sqlite3_finalize(conn->stmts[i]);
                 }
         }
+        sqlite3_close(conn->db);
+        g_free(conn);
+}
 
-        /* END */
-        stat = sqlite3_exec(self->priv->db, "COMMIT",
-                NULL, NULL, &self->priv->zErrMesg);
+/**
+ * Take an idle reader connection, opening another if all are busy and
+ * the limit allows. Must be handed back with _db_reader_put.
+ */
+static BudgieDBConn* _db_reader_get(BudgieDB *self)
+{
+        BudgieDBConn *conn;
 
-        g_message("Added %d tracks\n", c);
+        conn = g_async_queue_try_pop(self->priv->readers);
+        if (conn) {
+                return conn;
+        }
 
-        /* Wrap up */
-        g_free(sql);
-        sqlite3_finalize(stmt);
-        g_mutex_unlock(&_lock);
+        g_mutex_lock(&self->priv->reader_lock);
+        if (self->priv->n_readers < DB_MAX_READERS) {
+                conn = _db_conn_open(self);
+                if (conn) {
+                        sqlite3_exec(conn->db, "PRAGMA query_only = 1",
+                                NULL, NULL, NULL);
+                        self->priv->n_readers++;
+                }
+        }
+        g_mutex_unlock(&self->priv->reader_lock);
 
-        return TRUE;
+        if (!conn) {
+                conn = g_async_queue_pop(self->priv->readers);
+        }
+        return conn;
 }
 
-MediaInfo* budgie_db_get_media(BudgieDB *self, gchar *path)
+static void _db_reader_put(BudgieDB *self, BudgieDBConn *conn)
 {
-        MediaInfo *ret;
-        gchar *s_path;
-        gchar *sql;
-        sqlite3_stmt *stmt = NULL;
-        int stat;
-
-        s_path = _sanitize_value(path);
-        ret = malloc(sizeof(MediaInfo));
-        if (!ret) {
-                goto end;
-        }
-
-        sql = g_strdup_printf("SELECT * FROM items WHERE path == '%s'",
-                       s_path);
+        g_async_queue_push(self->priv->readers, conn);
+}
 
-        g_mutex_lock(&_lock);
+/**
+ * Return the cached statement for a query shape, preparing it on first
+ * use. The connection must not be in use elsewhere, and the statement
+ * handed back to _db_statement_done once finished with.
+ */
+static sqlite3_stmt* _db_statement(BudgieDBConn *conn, guint id, const gchar *sql)
+{
+        sqlite3_stmt **stmt;
 
-        stat = sqlite3_prepare_v2(self->priv->db, (const char *)sql,
-                -1, &stmt, NULL);
-        stat = sqlite3_step(stmt);
-        if (stat == SQLITE_DONE){
-                /* Ran out of things :( */
-                goto end;
+        stmt = &conn->stmts[id];
+        if (*stmt) {
+                return *stmt;
         }
-        else if (stat == SQLITE_ERROR){
-                g_error("SQL error: %s", sqlite3_errmsg(self->priv->db));
-                goto end;
+        if (sqlite3_prepare_v2(conn->db, sql, -1, stmt, NULL) != SQLITE_OK) {
+                g_warning("SQL error: %s", sqlite3_errmsg(conn->db));
+                *stmt = NULL;
         }
-        else if (stat == SQLITE_ROW){
-                /* We have data to process */
-                ret = new_media_info(stmt);
+        return *stmt;
+}
+
+/**
+ * Pass the plan of a statement to the plan function, with the values it
+ * ran with bound in, as a LIKE pattern can change the plan
+ */
+static void _db_statement_plan(BudgieDBConn *conn, sqlite3_stmt *stmt)
+{
+        BudgieDBPrivate *priv = conn->owner->priv;
+        sqlite3_stmt *explain;
+        GString *plan;
+        gchar *bound, *sql;
+
+        bound = sqlite3_expanded_sql(stmt);
+        if (!bound) {
+                return;
         }
+        sql = g_strdup_printf("EXPLAIN QUERY PLAN %s", bound);
+        sqlite3_free(bound);
 
-end:
-        if (stmt){
-                sqlite3_finalize(stmt);
+        if (sqlite3_prepare_v2(conn->db, sql, -1, &explain, NULL) != SQLITE_OK) {
+                g_warning("SQL error: %s", sqlite3_errmsg(conn->db));
+                g_free(sql);
+                return;
         }
+        g_free(sql);
 
-        g_mutex_unlock(&_lock);
-        g_free(s_path);
+        /* One line per step of the plan, as the sqlite3 shell prints */
+        plan = g_string_new(NULL);
+        while (sqlite3_step(explain) == SQLITE_ROW) {
+                if (plan->len > 0) {
+                        g_string_append_c(plan, '\n');
+                }
+                g_string_append(plan, (const gchar*)sqlite3_column_text(explain, 3));
+        }
+        sqlite3_finalize(explain);
 
-        return ret;
+        priv->plan_func(sqlite3_sql(stmt), plan->str, priv->plan_data);
+        g_string_free(plan, TRUE);
 }
 
-GSList* budgie_db_get_all_media(BudgieDB* self)
+/**
+ * Reset a cached statement, ready for the next use
+ */
+static void _db_statement_done(BudgieDBConn *conn, sqlite3_stmt *stmt)
 {
-        GSList *ret = NULL;
-        MediaInfo *info;
-        gchar *sql;
-        sqlite3_stmt *stmt = NULL;
-        int stat;
-
-        g_mutex_lock(&_lock);
+        if (!stmt) {
+                return;
+        }
+        if (conn->owner->priv->plan_func) {
+                _db_statement_plan(conn, stmt);
+        }
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+}
 
-        sql = g_strdup("SELECT * FROM items ORDER BY track ASC, id ASC");
+static void budgie_db_dispose(GObject *object)
+{
+        BudgieDB *self;
+        BudgieDBConn *conn;
 
-        /* Iterate until we run out of things */
-        stat = sqlite3_prepare_v2(self->priv->db, (const char *)sql,
-                -1, &stmt, NULL);
-        stat = sqlite3_step(stmt);
-        while (stat == SQLITE_ROW){
-                /* We have data to process */
-                info = new_media_info(stmt);
+        self = BUDGIE_DB(object);
 
-                ret = g_slist_append(ret, info);
+        /* Pending jobs hold a reference, so there are none. Don't wait,
+         * as the last reference may be dropped by a pool thread. */
+        if (self->priv->pool) {
+                g_thread_pool_free(self->priv->pool, FALSE, FALSE);
+                self->priv->pool = NULL;
+        }
 
-                /* Continue. */
-                stat = sqlite3_step(stmt);
+        if (self->priv->context) {
+                g_main_context_unref(self->priv->context);
+                self->priv->context = NULL;
         }
 
-        if (stat == SQLITE_ERROR){
-                g_error("SQL error: %s", sqlite3_errmsg(self->priv->db));
+        if (self->priv->storage_path) {
+                g_free(self->priv->storage_path);
+                self->priv->storage_path = NULL;
         }
 
-        /* Wrap up */
-        if (stmt){
-                sqlite3_finalize(stmt);
+        if (self->priv->readers) {
+                while ((conn = g_async_queue_try_pop(self->priv->readers)) != NULL) {
+                        _db_conn_close(conn);
+                }
+                g_async_queue_unref(self->priv->readers);
+                self->priv->readers = NULL;
         }
 
-        g_mutex_unlock(&_lock);
-        g_free(sql);
+        if (self->priv->writer) {
+                _db_conn_close(self->priv->writer);
+                self->priv->writer = NULL;
+        }
 
-        return ret;
+        /* Destruct */
+        G_OBJECT_CLASS(budgie_db_parent_class)->dispose(object);
 }
 
-gboolean budgie_db_get_all_by_field(BudgieDB *self,
-                                    MediaQuery query,
-                                    GPtrArray **results)
+/* A change signal waiting to be emitted */
+typedef struct DBEmit {
+        BudgieDB *self;
+        const gchar *signal;
+        GArray *ids;
+        gint64 serial;
+} DBEmit;
+
+static gboolean _db_emit_cb(gpointer data)
+{
+        DBEmit *emit = data;
+
+        if (emit->serial > emit->self->priv->emitted_serial) {
+                emit->self->priv->emitted_serial = emit->serial;
+        }
+        if (emit->ids->len > 0) {
+                g_signal_emit_by_name(emit->self, emit->signal, emit->ids);
+        }
+        return FALSE;
+}
+
+static void _db_emit_free(gpointer data)
+{
+        DBEmit *emit = data;
+
+        g_object_unref(emit->self);
+        g_array_unref(emit->ids);
+        g_slice_free(DBEmit, emit);
+}
+
+/**
+ * Emit signal with ids on the main context, taking ownership of ids.
+ * serial is the change serial once the write is committed, read with
+ * the write lock held, for the last signal of the write only, and 0
+ * otherwise. Must be called without the write lock held.
+ */
+static void _db_emit(BudgieDB *self,
+                     const gchar *signal,
+                     GArray *ids,
+                     gint64 serial)
+{
+        DBEmit *emit;
+
+        if (ids->len == 0 && serial <= 0) {
+                g_array_unref(ids);
+                return;
+        }
+
+        emit = g_slice_new(DBEmit);
+        emit->self = g_object_ref(self);
+        emit->signal = signal;
+        emit->ids = ids;
+        emit->serial = serial;
+        g_main_context_invoke_full(self->priv->context, G_PRIORITY_DEFAULT,
+                _db_emit_cb, emit, _db_emit_free);
+}
+
+/**
+ * Append the ids selected by stmt to ids, leaving stmt reset
+ */
+static void _db_collect_ids(sqlite3_stmt *stmt, GArray *ids)
+{
+        gint id;
+
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+                id = sqlite3_column_int(stmt, 0);
+                g_array_append_val(ids, id);
+        }
+        sqlite3_reset(stmt);
+}
+
+/* A GTask to run on the query pool */
+typedef struct DBJob {
+        GTask *task;
+        GTaskThreadFunc func;
+} DBJob;
+
+static void _db_job_run(gpointer data, gpointer userdata)
+{
+        DBJob *job = data;
+
+        if (!g_task_return_error_if_cancelled(job->task)) {
+                job->func(job->task, g_task_get_source_object(job->task),
+                        g_task_get_task_data(job->task),
+                        g_task_get_cancellable(job->task));
+        }
+        g_object_unref(job->task);
+        g_slice_free(DBJob, job);
+}
+
+/**
+ * Run func for task on the query pool, taking ownership of task. The
+ * result is delivered on the thread-default main context that created it.
+ */
+static void _db_run_async(BudgieDB *self, GTask *task, GTaskThreadFunc func)
+{
+        DBJob *job;
+
+        job = g_slice_new(DBJob);
+        job->task = task;
+        job->func = func;
+        g_thread_pool_push(self->priv->pool, job, NULL);
+}
+
+/* Utility; return a new BudgieDB */
+BudgieDB* budgie_db_new(void)
+{
+        BudgieDB *self;
+
+        self = g_object_new(BUDGIE_DB_TYPE, NULL);
+        return BUDGIE_DB(self);
+}
+
+/**
+ * Build an upsert of rows tracks. Existing paths keep their row and id.
+ * Every column is set, but the triggers only act on values that differ.
+ * Names are resolved to ids, see _db_add_names.
+ */
+static gchar* _db_upsert_sql(guint rows)
+{
+        GString *sql;
+        guint i;
+
+        sql = g_string_new("INSERT INTO tracks(title, track, artist, album, "
+                "band, genre, path, mimetype, mtime, size, inode, generation) "
+                "VALUES ");
+        for (i = 0; i < rows; i++) {
+                g_string_append(sql, i == 0 ? "" : ", ");
+                g_string_append(sql, "(?, ?, "
+                        "(SELECT ID FROM artists WHERE name = ?), "
+                        "(SELECT ID FROM albums WHERE name = ?), "
+                        "(SELECT ID FROM artists WHERE name = ?), "
+                        "(SELECT ID FROM genres WHERE name = ?), "
+                        "?, ?, ?, ?, ?, ?)");
+        }
+        g_string_append(sql, " ON CONFLICT(path) DO UPDATE SET "
+                "title = excluded.title, track = excluded.track, "
+                "artist = excluded.artist, album = excluded.album, "
+                "band = excluded.band, genre = excluded.genre, "
+                "mimetype = excluded.mimetype, mtime = excluded.mtime, "
+                "size = excluded.size, inode = excluded.inode, "
+                "generation = excluded.generation;");
+
+        return g_string_free(sql, FALSE);
+}
+
+/**
+ * Add a single name to one of the name tables, if it isn't already there
+ */
+static void _db_add_name(BudgieDBConn *conn,
+                         guint id,
+                         const gchar *table,
+                         const gchar *name)
+{
+        sqlite3_stmt *stmt;
+        gchar *sql;
+
+        if (!name) {
+                return;
+        }
+        stmt = conn->stmts[id];
+        if (!stmt) {
+                sql = g_strdup_printf("INSERT OR IGNORE INTO %s(name) VALUES (?)",
+                        table);
+                stmt = _db_statement(conn, id, sql);
+                g_free(sql);
+        }
+        if (!stmt) {
+                return;
+        }
+        sqlite3_bind_text(stmt, 1, name, -1, NULL);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+                g_warning("SQL failed to add %s: %s", name,
+                        sqlite3_errmsg(conn->db));
+        }
+        _db_statement_done(conn, stmt);
+}
+
+/**
+ * Make sure every name info refers to has an id, ready for the upsert
+ */
+static void _db_add_names(BudgieDBConn *conn, MediaInfo *info)
+{
+        _db_add_name(conn, DB_STMT_ADD_ARTIST, "artists", info->artist);
+        _db_add_name(conn, DB_STMT_ADD_ARTIST, "artists", info->band);
+        _db_add_name(conn, DB_STMT_ADD_ALBUM, "albums", info->album);
+        _db_add_name(conn, DB_STMT_ADD_GENRE, "genres", info->genre);
+}
+
+/**
+ * Drop names no longer referenced by any track. Each check is a probe
+ * of a tracks index, so this is cheap next to the name tables' size.
+ */
+static void _db_prune_names(BudgieDB *self)
+{
+        gint stat;
+
+        stat = sqlite3_exec(self->priv->writer->db,
+                "DELETE FROM artists WHERE "
+                "NOT EXISTS (SELECT 1 FROM tracks WHERE artist = artists.ID) AND "
+                "NOT EXISTS (SELECT 1 FROM tracks WHERE band = artists.ID);"
+                "DELETE FROM albums WHERE "
+                "NOT EXISTS (SELECT 1 FROM tracks WHERE album = albums.ID);"
+                "DELETE FROM genres WHERE "
+                "NOT EXISTS (SELECT 1 FROM tracks WHERE genre = genres.ID);",
+                NULL, NULL, &self->priv->zErrMesg);
+        if (stat != SQLITE_OK) {
+                g_warning("SQL failed to prune names: %s", self->priv->zErrMesg);
+                _db_clear_error(self);
+        }
+}
+
+/**
+ * Remember that a retagged track no longer uses name, when it doesn't
+ */
+static void _db_lose_name(GHashTable *lost,
+                          const guchar *name,
+                          const gchar *replacement)
+{
+        if (name && g_strcmp0((const gchar*)name, replacement) != 0) {
+                g_hash_table_add(lost, g_strdup((const gchar*)name));
+        }
+}
+
+/**
+ * Drop the names retagged tracks stopped using, if no other track still
+ * does. Unlike _db_prune_names this costs a few index probes per name,
+ * not a sweep of the name tables.
+ */
+static void _db_prune_lost(BudgieDBConn *conn, GHashTable **lost)
+{
+        static const gchar *sql[DB_NAMES_MAX] = {
+                "DELETE FROM artists WHERE name = ? AND "
+                "NOT EXISTS (SELECT 1 FROM tracks WHERE artist = artists.ID) AND "
+                "NOT EXISTS (SELECT 1 FROM tracks WHERE band = artists.ID)",
+                "DELETE FROM albums WHERE name = ? AND "
+                "NOT EXISTS (SELECT 1 FROM tracks WHERE album = albums.ID)",
+                "DELETE FROM genres WHERE name = ? AND "
+                "NOT EXISTS (SELECT 1 FROM tracks WHERE genre = genres.ID)"
+        };
+        sqlite3_stmt *stmt;
+        GHashTableIter iter;
+        gpointer name;
+        guint i;
+
+        for (i = 0; i < DB_NAMES_MAX; i++) {
+                if (g_hash_table_size(lost[i]) == 0) {
+                        continue;
+                }
+                stmt = _db_statement(conn, DB_STMT_PRUNE_ARTIST + i, sql[i]);
+                if (!stmt) {
+                        continue;
+                }
+                g_hash_table_iter_init(&iter, lost[i]);
+                while (g_hash_table_iter_next(&iter, &name, NULL)) {
+                        sqlite3_bind_text(stmt, 1, name, -1, NULL);
+                        if (sqlite3_step(stmt) != SQLITE_DONE) {
+                                g_warning("SQL failed to prune %s: %s",
+                                        (gchar*)name, sqlite3_errmsg(conn->db));
+                        }
+                        sqlite3_reset(stmt);
+                }
+                _db_statement_done(conn, stmt);
+        }
+}
+
+/**
+ * Whether the row found for info's path has the same tags and mime type,
+ * so that only its file stamps would change. Views need not hear of it.
+ */
+static gboolean _db_tags_unchanged(sqlite3_stmt *find, MediaInfo *info)
+{
+        return g_strcmp0((const gchar*)sqlite3_column_text(find, 1), info->title) == 0 &&
+                (guint)sqlite3_column_int(find, 2) == info->track_no &&
+                g_strcmp0((const gchar*)sqlite3_column_text(find, 3), info->artist) == 0 &&
+                g_strcmp0((const gchar*)sqlite3_column_text(find, 4), info->album) == 0 &&
+                g_strcmp0((const gchar*)sqlite3_column_text(find, 5), info->band) == 0 &&
+                g_strcmp0((const gchar*)sqlite3_column_text(find, 6), info->genre) == 0 &&
+                g_strcmp0((const gchar*)sqlite3_column_text(find, 7), info->mime) == 0;
+}
+
+/**
+ * Whether the row found for info's path already holds everything the
+ * upsert would write
+ */
+static gboolean _db_row_unchanged(sqlite3_stmt *find,
+                                  MediaInfo *info,
+                                  gint64 generation)
+{
+        return _db_tags_unchanged(find, info) &&
+                sqlite3_column_int64(find, 8) == info->mtime &&
+                sqlite3_column_int64(find, 9) == info->size &&
+                (guint64)sqlite3_column_int64(find, 10) == info->inode &&
+                sqlite3_column_int64(find, 11) == generation;
+}
+
+/**
+ * Write rows from batch, starting at index first, with an upsert built
+ * by _db_upsert_sql(rows)
+ */
+static gboolean _db_upsert(BudgieDBConn *conn,
+                           sqlite3_stmt *stmt,
+                           GPtrArray *batch,
+                           guint first,
+                           guint rows,
+                           gint64 generation)
+{
+        MediaInfo *info;
+        gint stat;
+        guint i, p;
+
+        for (i = 0; i < rows; i++) {
+                info = batch->pdata[first + i];
+                p = i * 12;
+                sqlite3_bind_text(stmt, p + 1, info->title, -1, NULL);
+                sqlite3_bind_int(stmt, p + 2, info->track_no);
+                sqlite3_bind_text(stmt, p + 3, info->artist, -1, NULL);
+                sqlite3_bind_text(stmt, p + 4, info->album, -1, NULL);
+                sqlite3_bind_text(stmt, p + 5, info->band, -1, NULL);
+                sqlite3_bind_text(stmt, p + 6, info->genre, -1, NULL);
+                sqlite3_bind_text(stmt, p + 7, info->path, -1, NULL);
+                sqlite3_bind_text(stmt, p + 8, info->mime, -1, NULL);
+                sqlite3_bind_int64(stmt, p + 9, info->mtime);
+                sqlite3_bind_int64(stmt, p + 10, info->size);
+                sqlite3_bind_int64(stmt, p + 11, (sqlite3_int64)info->inode);
+                sqlite3_bind_int64(stmt, p + 12, generation);
+        }
+
+        do {
+                stat = sqlite3_step(stmt);
+        } while (stat == SQLITE_ROW);
+        _db_statement_done(conn, stmt);
+
+        if (stat != SQLITE_DONE) {
+                g_warning("SQL failed to add %u items: %d", rows, stat);
+                return FALSE;
+        }
+        return TRUE;
+}
+
+/**
+ * Write out the gathered rows, full statements first. Stops at the first
+ * upsert that fails, returning FALSE.
+ */
+static gboolean _db_update_flush(BudgieDBConn *conn,
+                                 sqlite3_stmt *batch_stmt,
+                                 sqlite3_stmt *row_stmt,
+                                 GPtrArray *batch,
+                                 GHashTable *paths,
+                                 gint64 generation)
+{
+        gboolean ret = TRUE;
+        guint i;
+
+        for (i = 0; ret && i + DB_UPDATE_BATCH <= batch->len; i += DB_UPDATE_BATCH) {
+                ret = _db_upsert(conn, batch_stmt, batch, i, DB_UPDATE_BATCH, generation);
+        }
+        for (; ret && i < batch->len; i++) {
+                ret = _db_upsert(conn, row_stmt, batch, i, 1, generation);
+        }
+        g_ptr_array_set_size(batch, 0);
+        g_hash_table_remove_all(paths);
+
+        return ret;
+}
+
+gboolean budgie_db_update(BudgieDB *self, GSList *tracks)
+{
+        BudgieDBConn *conn;
+        GSList *ref;
+        MediaInfo *info;
+        sqlite3_stmt *batch_stmt, *row_stmt, *find;
+        GHashTable *paths, *fresh;
+        GHashTableIter iter;
+        GPtrArray *batch;
+        GHashTable *lost[DB_NAMES_MAX];
+        GArray *added, *changed;
+        gpointer path;
+        gchar *batch_sql, *row_sql;
+        gint64 generation, serial;
+        gboolean retagged, ok;
+        gint stat;
+        gint c;
+        gint id;
+        guint i;
+
+        g_return_val_if_fail(self != NULL, FALSE);
+
+        g_mutex_lock(&self->priv->write_lock);
+        conn = self->priv->writer;
+        generation = self->priv->generation;
+
+        /* Known paths keep their id, so we can tell additions apart, and
+         * rows that already match are skipped */
+        find = _db_statement(conn, DB_STMT_PATH_ROW,
+                "SELECT ID, title, track, artist, album, band, genre, "
+                "mimetype, mtime, size, inode, generation "
+                "FROM items WHERE path == ?");
+        batch_sql = _db_upsert_sql(DB_UPDATE_BATCH);
+        row_sql = _db_upsert_sql(1);
+        batch_stmt = _db_statement(conn, DB_STMT_UPDATE_BATCH, batch_sql);
+        row_stmt = _db_statement(conn, DB_STMT_UPDATE, row_sql);
+        g_free(batch_sql);
+        g_free(row_sql);
+        if (!batch_stmt || !row_stmt || !find) {
+                g_warning("Failed to update the database!");
+                g_mutex_unlock(&self->priv->write_lock);
+                return FALSE;
+        }
+        added = g_array_new(FALSE, FALSE, sizeof(gint));
+        changed = g_array_new(FALSE, FALSE, sizeof(gint));
+
+        /* BEGIN */
+        stat = sqlite3_exec(conn->db, "BEGIN",
+                NULL, NULL, &self->priv->zErrMesg);
+        if (stat != SQLITE_OK) {
+                g_error("SQL error: %d", stat);
+                g_error("Further info: %s", self->priv->zErrMesg);
+
+                g_mutex_unlock(&self->priv->write_lock);
+                return FALSE;
+        }
+
+        /* Now, go through the list and gather what needs writing */
+        batch = g_ptr_array_sized_new(DB_UPDATE_BATCH);
+        paths = g_hash_table_new(g_str_hash, g_str_equal);
+        fresh = g_hash_table_new(g_str_hash, g_str_equal);
+        for (i = 0; i < DB_NAMES_MAX; i++) {
+                lost[i] = g_hash_table_new_full(g_str_hash, g_str_equal,
+                        g_free, NULL);
+        }
+        ok = TRUE;
+        c = 0;
+        for (ref = tracks; ok && ref != NULL; ref = g_slist_next(ref)) {
+                info = (MediaInfo*) ref->data;
+
+                sqlite3_bind_text(find, 1, info->path, -1, NULL);
+                id = 0;
+                retagged = TRUE;
+                if (sqlite3_step(find) == SQLITE_ROW) {
+                        if (_db_row_unchanged(find, info, generation)) {
+                                sqlite3_reset(find);
+                                continue;
+                        }
+                        id = sqlite3_column_int(find, 0);
+                        retagged = !_db_tags_unchanged(find, info);
+                        if (retagged) {
+                                _db_lose_name(lost[DB_NAMES_ARTIST],
+                                        sqlite3_column_text(find, 3), info->artist);
+                                _db_lose_name(lost[DB_NAMES_ALBUM],
+                                        sqlite3_column_text(find, 4), info->album);
+                                _db_lose_name(lost[DB_NAMES_ARTIST],
+                                        sqlite3_column_text(find, 5), info->band);
+                                _db_lose_name(lost[DB_NAMES_GENRE],
+                                        sqlite3_column_text(find, 6), info->genre);
+                        }
+                }
+                sqlite3_reset(find);
+
+                /* A statement may only write each path once */
+                if (g_hash_table_contains(paths, info->path)) {
+                        ok = _db_update_flush(conn, batch_stmt, row_stmt, batch,
+                                paths, generation);
+                        if (!ok) {
+                                break;
+                        }
+                }
+                g_hash_table_add(paths, info->path);
+                g_ptr_array_add(batch, info);
+                _db_add_names(conn, info);
+                c++;
+
+                if (id > 0 && retagged) {
+                        g_array_append_val(changed, id);
+                } else if (id == 0) {
+                        g_hash_table_add(fresh, info->path);
+                }
+                if (batch->len == DB_UPDATE_BATCH) {
+                        ok = _db_update_flush(conn, batch_stmt, row_stmt, batch,
+                                paths, generation);
+                }
+        }
+        if (ok) {
+                ok = _db_update_flush(conn, batch_stmt, row_stmt, batch, paths,
+                        generation);
+        }
+        g_ptr_array_unref(batch);
+        g_hash_table_unref(paths);
+
+        /* Ids for the new rows */
+        g_hash_table_iter_init(&iter, fresh);
+        while (ok && g_hash_table_iter_next(&iter, &path, NULL)) {
+                sqlite3_bind_text(find, 1, path, -1, NULL);
+                if (sqlite3_step(find) == SQLITE_ROW) {
+                        id = sqlite3_column_int(find, 0);
+                        g_array_append_val(added, id);
+                }
+                sqlite3_reset(find);
+        }
+        g_hash_table_unref(fresh);
+        _db_statement_done(conn, find);
+
+        /* Only retagged rows can leave names behind */
+        if (ok) {
+                _db_prune_lost(conn, lost);
+        }
+        for (i = 0; i < DB_NAMES_MAX; i++) {
+                g_hash_table_unref(lost[i]);
+        }
+
+        /* END */
+        if (ok) {
+                stat = sqlite3_exec(conn->db, "COMMIT",
+                        NULL, NULL, &self->priv->zErrMesg);
+                if (stat != SQLITE_OK) {
+                        g_warning("SQL failed to write tracks: %s",
+                                self->priv->zErrMesg);
+                        _db_clear_error(self);
+                        ok = FALSE;
+                }
+        }
+        if (!ok) {
+                /* None of it was written, so there is nothing to tell */
+                sqlite3_exec(conn->db, "ROLLBACK", NULL, NULL, NULL);
+                g_mutex_unlock(&self->priv->write_lock);
+                g_array_unref(added);
+                g_array_unref(changed);
+                return FALSE;
+        }
+
+        g_debug("Wrote %d tracks", c);
+
+        /* Wrap up */
+        serial = _db_writer_serial(self);
+        g_mutex_unlock(&self->priv->write_lock);
+
+        _db_emit(self, "items-added", added, 0);
+        _db_emit(self, "items-changed", changed, serial);
+
+        return TRUE;
+}
+
+MediaInfo* budgie_db_get_media(BudgieDB *self, gchar *path)
+{
+        BudgieDBConn *conn;
+        MediaInfo *ret = NULL;
+        sqlite3_stmt *stmt = NULL;
+        int stat;
+
+        g_return_val_if_fail(self != NULL, NULL);
+
+        conn = _db_reader_get(self);
+
+        stmt = _db_statement(conn, DB_STMT_GET_MEDIA,
+                "SELECT * FROM items WHERE path == ?");
+        if (!stmt) {
+                goto end;
+        }
+
+        sqlite3_bind_text(stmt, 1, path, -1, NULL);
+        stat = sqlite3_step(stmt);
+        if (stat == SQLITE_DONE){
+                /* Ran out of things :( */
+                goto end;
+        }
+        else if (stat == SQLITE_ERROR){
+                g_error("SQL error: %s", sqlite3_errmsg(conn->db));
+                goto end;
+        }
+        else if (stat == SQLITE_ROW){
+                /* We have data to process */
+                ret = new_media_info(stmt);
+        }
+
+end:
+        _db_statement_done(conn, stmt);
+        _db_reader_put(self, conn);
+
+        return ret;
+}
+
+GPtrArray* budgie_db_get_media_ids(BudgieDB *self, GArray *ids)
+{
+        BudgieDBConn *conn;
+        GPtrArray *results;
+        sqlite3_stmt *stmt;
+        guint i;
+        int stat;
+
+        g_return_val_if_fail(self != NULL, NULL);
+        g_return_val_if_fail(ids != NULL, NULL);
+
+        results = g_ptr_array_new_with_free_func(media_info_unref);
+        conn = _db_reader_get(self);
+
+        stmt = _db_statement(conn, DB_STMT_GET_ID,
+                "SELECT * FROM items WHERE ID == ?");
+        if (!stmt) {
+                _db_reader_put(self, conn);
+                return results;
+        }
+
+        /* One read transaction, so that every row comes from the same
+         * version of the library */
+        sqlite3_exec(conn->db, "BEGIN", NULL, NULL, NULL);
+        for (i = 0; i < ids->len; i++) {
+                sqlite3_bind_int(stmt, 1, g_array_index(ids, gint, i));
+                stat = sqlite3_step(stmt);
+                if (stat == SQLITE_ROW) {
+                        g_ptr_array_add(results, new_media_info(stmt));
+                } else if (stat == SQLITE_ERROR) {
+                        g_error("SQL error: %s", sqlite3_errmsg(conn->db));
+                }
+                sqlite3_reset(stmt);
+        }
+        sqlite3_exec(conn->db, "COMMIT", NULL, NULL, NULL);
+
+        _db_statement_done(conn, stmt);
+        _db_reader_put(self, conn);
+
+        return results;
+}
+
+/**
+ * The change serial as seen by the writer, which must be held
+ */
+static gint64 _db_writer_serial(BudgieDB *self)
+{
+        sqlite3_stmt *stmt;
+        gint64 ret = 0;
+
+        stmt = _db_statement(self->priv->writer, DB_STMT_SERIAL,
+                "SELECT serial FROM changes");
+        if (stmt && sqlite3_step(stmt) == SQLITE_ROW) {
+                ret = sqlite3_column_int64(stmt, 0);
+        }
+        _db_statement_done(self->priv->writer, stmt);
+
+        return ret;
+}
+
+void budgie_db_set_plan_func(BudgieDB *self,
+                             BudgieDBPlanFunc func,
+                             gpointer userdata)
+{
+        g_return_if_fail(self != NULL);
+
+        self->priv->plan_func = func;
+        self->priv->plan_data = userdata;
+}
+
+gint64 budgie_db_get_emitted_serial(BudgieDB *self)
+{
+        g_return_val_if_fail(self != NULL, -1);
+
+        return self->priv->emitted_serial;
+}
+
+gint64 budgie_db_get_serial(BudgieDB *self)
+{
+        BudgieDBConn *conn;
+        sqlite3_stmt *stmt;
+        gint64 ret = -1;
+
+        g_return_val_if_fail(self != NULL, -1);
+
+        conn = _db_reader_get(self);
+        stmt = _db_statement(conn, DB_STMT_SERIAL,
+                "SELECT serial FROM changes");
+        if (stmt && sqlite3_step(stmt) == SQLITE_ROW) {
+                ret = sqlite3_column_int64(stmt, 0);
+        }
+        _db_statement_done(conn, stmt);
+        _db_reader_put(self, conn);
+
+        return ret;
+}
+
+gint budgie_db_file_unchanged(BudgieDB *self,
+                              const gchar *path,
+                              gint64 mtime,
+                              gint64 size,
+                              guint64 inode)
+{
+        BudgieDBConn *conn;
+        sqlite3_stmt *stmt = NULL;
+        gint ret = 0;
+        int stat;
+
+        g_return_val_if_fail(self != NULL, 0);
+
+        conn = _db_reader_get(self);
+
+        stmt = _db_statement(conn, DB_STMT_FILE_UNCHANGED,
+                "SELECT ID FROM tracks WHERE path == ? AND mtime == ? "
+                "AND size == ? AND inode == ?");
+        if (!stmt) {
+                goto end;
+        }
+
+        sqlite3_bind_text(stmt, 1, path, -1, NULL);
+        sqlite3_bind_int64(stmt, 2, mtime);
+        sqlite3_bind_int64(stmt, 3, size);
+        sqlite3_bind_int64(stmt, 4, (sqlite3_int64)inode);
+
+        stat = sqlite3_step(stmt);
+        if (stat == SQLITE_ROW) {
+                ret = sqlite3_column_int(stmt, 0);
+        } else if (stat == SQLITE_ERROR) {
+                g_warning("SQL error: %s", sqlite3_errmsg(conn->db));
+        }
+
+end:
+        _db_statement_done(conn, stmt);
+        _db_reader_put(self, conn);
+
+        return ret;
+}
+
+gint64 budgie_db_begin_scan(BudgieDB *self)
+{
+        BudgieDBConn *conn;
+        gint64 ret;
+        int stat;
+
+        g_return_val_if_fail(self != NULL, 0);
+
+        g_mutex_lock(&self->priv->write_lock);
+        conn = self->priv->writer;
+
+        /* Only the latest generation is needed, AUTOINCREMENT keeps
+         * the sequence going after older rows are removed */
+        stat = sqlite3_exec(conn->db,
+                "DELETE FROM scans;"
+                "INSERT INTO scans(started) VALUES (strftime('%s', 'now'));",
+                NULL, NULL, &self->priv->zErrMesg);
+        if (stat != SQLITE_OK) {
+                g_warning("SQL error: %s", self->priv->zErrMesg);
+                _db_clear_error(self);
+        } else {
+                self->priv->generation = sqlite3_last_insert_rowid(conn->db);
+        }
+        ret = self->priv->generation;
+
+        g_mutex_unlock(&self->priv->write_lock);
+
+        return ret;
+}
+
+gboolean budgie_db_touch(BudgieDB *self, GArray *ids)
+{
+        BudgieDBConn *conn;
+        sqlite3_stmt *stmt = NULL;
+        gboolean ret = FALSE;
+        guint i;
+        int stat;
+
+        g_return_val_if_fail(self != NULL, FALSE);
+
+        if (!ids || ids->len == 0) {
+                return TRUE;
+        }
+
+        g_mutex_lock(&self->priv->write_lock);
+        conn = self->priv->writer;
+
+        stmt = _db_statement(conn, DB_STMT_TOUCH,
+                "UPDATE tracks SET generation = ? WHERE ID == ?");
+        if (!stmt) {
+                goto end;
+        }
+
+        stat = sqlite3_exec(conn->db, "BEGIN",
+                NULL, NULL, &self->priv->zErrMesg);
+        if (stat != SQLITE_OK) {
+                g_warning("SQL error: %s", self->priv->zErrMesg);
+                _db_clear_error(self);
+                goto end;
+        }
+
+        ret = TRUE;
+        sqlite3_bind_int64(stmt, 1, self->priv->generation);
+        for (i=0; i < ids->len; i++) {
+                sqlite3_reset(stmt);
+                sqlite3_bind_int(stmt, 2, g_array_index(ids, gint, i));
+                if (sqlite3_step(stmt) != SQLITE_DONE) {
+                        g_warning("SQL failed to stamp an item: %s",
+                                sqlite3_errmsg(conn->db));
+                        ret = FALSE;
+                }
+        }
+
+        if (sqlite3_exec(conn->db, "COMMIT",
+                        NULL, NULL, &self->priv->zErrMesg) != SQLITE_OK) {
+                g_warning("SQL failed to stamp items: %s",
+                        self->priv->zErrMesg);
+                _db_clear_error(self);
+                sqlite3_exec(conn->db, "ROLLBACK", NULL, NULL, NULL);
+                ret = FALSE;
+        }
+
+end:
+        _db_statement_done(conn, stmt);
+        g_mutex_unlock(&self->priv->write_lock);
+
+        return ret;
+}
+
+gint budgie_db_count_stale(BudgieDB *self, const gchar *root, gint64 generation)
+{
+        BudgieDBConn *conn;
+        sqlite3_stmt *stmt = NULL;
+        gint ret = 0;
+
+        g_return_val_if_fail(self != NULL, 0);
+
+        conn = _db_reader_get(self);
+
+        stmt = _db_statement(conn, DB_STMT_STALE,
+                "SELECT COUNT(*) FROM tracks WHERE path > ?1 || '/' AND path < ?1 || '0' "
+                "AND generation < ?2");
+        if (!stmt) {
+                goto end;
+        }
+
+        sqlite3_bind_text(stmt, 1, root, -1, NULL);
+        sqlite3_bind_int64(stmt, 2, generation);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+                ret = sqlite3_column_int(stmt, 0);
+        } else {
+                g_warning("SQL error: %s", sqlite3_errmsg(conn->db));
+        }
+
+end:
+        _db_statement_done(conn, stmt);
+        _db_reader_put(self, conn);
+
+        return ret;
+}
+
+guint64 budgie_db_get_root_device(BudgieDB *self, const gchar *root)
+{
+        BudgieDBConn *conn;
+        sqlite3_stmt *stmt = NULL;
+        guint64 ret = 0;
+
+        g_return_val_if_fail(self != NULL, 0);
+
+        conn = _db_reader_get(self);
+
+        stmt = _db_statement(conn, DB_STMT_ROOT_DEVICE,
+                "SELECT device FROM roots WHERE path == ?");
+        if (stmt) {
+                sqlite3_bind_text(stmt, 1, root, -1, NULL);
+                if (sqlite3_step(stmt) == SQLITE_ROW) {
+                        ret = (guint64)sqlite3_column_int64(stmt, 0);
+                }
+        }
+        _db_statement_done(conn, stmt);
+        _db_reader_put(self, conn);
+
+        return ret;
+}
+
+gboolean budgie_db_set_root_device(BudgieDB *self,
+                                   const gchar *root,
+                                   guint64 device)
+{
+        BudgieDBConn *conn;
+        sqlite3_stmt *stmt = NULL;
+        gboolean ret = FALSE;
+
+        g_return_val_if_fail(self != NULL, FALSE);
+
+        g_mutex_lock(&self->priv->write_lock);
+        conn = self->priv->writer;
+
+        stmt = _db_statement(conn, DB_STMT_SET_ROOT_DEVICE,
+                "INSERT OR REPLACE INTO roots(path, device) VALUES (?, ?)");
+        if (stmt) {
+                sqlite3_bind_text(stmt, 1, root, -1, NULL);
+                sqlite3_bind_int64(stmt, 2, (sqlite3_int64)device);
+                ret = sqlite3_step(stmt) == SQLITE_DONE;
+                if (!ret) {
+                        g_warning("SQL failed to record %s: %s", root,
+                                sqlite3_errmsg(conn->db));
+                }
+        }
+        _db_statement_done(conn, stmt);
+        g_mutex_unlock(&self->priv->write_lock);
+
+        return ret;
+}
+
+gboolean budgie_db_prune(BudgieDB *self, const gchar *root, gint64 generation)
+{
+        BudgieDBConn *conn;
+        sqlite3_stmt *stmt = NULL, *ids_stmt;
+        GArray *removed;
+        gint64 serial;
+        gboolean ret = FALSE;
+
+        g_return_val_if_fail(self != NULL, FALSE);
+
+        removed = g_array_new(FALSE, FALSE, sizeof(gint));
+        g_mutex_lock(&self->priv->write_lock);
+        conn = self->priv->writer;
+
+        /* Only this connection writes, so the ids selected are exactly
+         * those deleted */
+        ids_stmt = _db_statement(conn, DB_STMT_PRUNE_IDS,
+                "SELECT ID FROM tracks WHERE path > ?1 || '/' AND path < ?1 || '0' "
+                "AND generation < ?2");
+        if (ids_stmt) {
+                sqlite3_bind_text(ids_stmt, 1, root, -1, NULL);
+                sqlite3_bind_int64(ids_stmt, 2, generation);
+                _db_collect_ids(ids_stmt, removed);
+                _db_statement_done(conn, ids_stmt);
+        }
+
+        /* Everything beneath root is a range over the path index */
+        stmt = _db_statement(conn, DB_STMT_PRUNE,
+                "DELETE FROM tracks WHERE path > ?1 || '/' AND path < ?1 || '0' "
+                "AND generation < ?2");
+        if (!stmt) {
+                g_array_set_size(removed, 0);
+                goto end;
+        }
+
+        sqlite3_bind_text(stmt, 1, root, -1, NULL);
+        sqlite3_bind_int64(stmt, 2, generation);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+                g_warning("SQL failed to prune %s: %s", root,
+                        sqlite3_errmsg(conn->db));
+                g_array_set_size(removed, 0);
+                goto end;
+        }
+        if (sqlite3_changes(conn->db) > 0) {
+                g_message("Removed %d missing tracks from %s",
+                        sqlite3_changes(conn->db), root);
+                _db_prune_names(self);
+        }
+        ret = TRUE;
+
+end:
+        _db_statement_done(conn, stmt);
+        serial = _db_writer_serial(self);
+        g_mutex_unlock(&self->priv->write_lock);
+        _db_emit(self, "items-removed", removed, serial);
+
+        return ret;
+}
+
+gboolean budgie_db_remove_paths(BudgieDB *self, GSList *paths)
+{
+        BudgieDBConn *conn;
+        GSList *ref;
+        sqlite3_stmt *stmt = NULL, *ids_stmt = NULL;
+        GArray *removed;
+        gint64 serial;
+        gboolean ret = FALSE;
+        int stat;
+
+        g_return_val_if_fail(self != NULL, FALSE);
+
+        if (!paths) {
+                return TRUE;
+        }
+
+        removed = g_array_new(FALSE, FALSE, sizeof(gint));
+        g_mutex_lock(&self->priv->write_lock);
+        conn = self->priv->writer;
+
+        /* Directories are matched as a range over the path index */
+        ids_stmt = _db_statement(conn, DB_STMT_REMOVE_PATH_IDS,
+                "SELECT ID FROM tracks WHERE path == ?1 "
+                "OR (path > ?1 || '/' AND path < ?1 || '0')");
+        stmt = _db_statement(conn, DB_STMT_REMOVE_PATH,
+                "DELETE FROM tracks WHERE path == ?1 "
+                "OR (path > ?1 || '/' AND path < ?1 || '0')");
+        if (!stmt || !ids_stmt) {
+                goto end;
+        }
+
+        stat = sqlite3_exec(conn->db, "BEGIN",
+                NULL, NULL, &self->priv->zErrMesg);
+        if (stat != SQLITE_OK) {
+                g_warning("SQL error: %s", self->priv->zErrMesg);
+                _db_clear_error(self);
+                goto end;
+        }
+
+        ret = TRUE;
+        for (ref = paths; ref != NULL; ref = g_slist_next(ref)) {
+                sqlite3_bind_text(ids_stmt, 1, (gchar*)ref->data, -1, NULL);
+                _db_collect_ids(ids_stmt, removed);
+
+                sqlite3_reset(stmt);
+                sqlite3_bind_text(stmt, 1, (gchar*)ref->data, -1, NULL);
+                if (sqlite3_step(stmt) != SQLITE_DONE) {
+                        g_warning("SQL failed to remove an item: %s",
+                                sqlite3_errmsg(conn->db));
+                        ret = FALSE;
+                }
+        }
+        if (removed->len > 0) {
+                _db_prune_names(self);
+        }
+
+        if (sqlite3_exec(conn->db, "COMMIT",
+                        NULL, NULL, &self->priv->zErrMesg) != SQLITE_OK) {
+                g_warning("SQL failed to remove items: %s",
+                        self->priv->zErrMesg);
+                _db_clear_error(self);
+                sqlite3_exec(conn->db, "ROLLBACK", NULL, NULL, NULL);
+                /* Nothing was removed after all */
+                g_array_set_size(removed, 0);
+                ret = FALSE;
+        }
+
+end:
+        _db_statement_done(conn, ids_stmt);
+        _db_statement_done(conn, stmt);
+        serial = _db_writer_serial(self);
+        g_mutex_unlock(&self->priv->write_lock);
+        _db_emit(self, "items-removed", removed, serial);
+
+        return ret;
+}
+
+GSList* budgie_db_get_all_media(BudgieDB* self)
+{
+        BudgieDBConn *conn;
+        GSList *ret = NULL;
+        MediaInfo *info;
+        sqlite3_stmt *stmt = NULL;
+        int stat;
+
+        conn = _db_reader_get(self);
+
+        stmt = _db_statement(conn, DB_STMT_ALL_MEDIA,
+                "SELECT * FROM items ORDER BY track ASC, id ASC");
+        if (!stmt) {
+                _db_reader_put(self, conn);
+                return NULL;
+        }
+
+        /* Iterate until we run out of things */
+        stat = sqlite3_step(stmt);
+        while (stat == SQLITE_ROW){
+                /* We have data to process */
+                info = new_media_info(stmt);
+
+                ret = g_slist_prepend(ret, info);
+
+                /* Continue. */
+                stat = sqlite3_step(stmt);
+        }
+
+        if (stat == SQLITE_ERROR){
+                g_error("SQL error: %s", sqlite3_errmsg(conn->db));
+        }
+
+        /* Wrap up */
+        _db_statement_done(conn, stmt);
+        _db_reader_put(self, conn);
+
+        return g_slist_reverse(ret);
+}
+
+gboolean budgie_db_get_all_by_field(BudgieDB *self,
+                                    MediaQuery query,
+                                    GPtrArray **results)
 {
         g_assert(query >= 0 && query < MEDIA_QUERY_MAX);
 
         GPtrArray *_results = NULL;
 
+        BudgieDBConn *conn;
         sqlite3_stmt *stmt;
         gchar *sql;
         gint stat;
 
         gchar *append;
 
-        g_mutex_lock(&_lock);
-        _results = g_ptr_array_new();
+        conn = _db_reader_get(self);
 
-        switch (query) {
-                case MEDIA_QUERY_TITLE:
-                        sql = g_strdup("SELECT DISTINCT title FROM items ORDER BY track ASC, id ASC;");
-                        break;
-                case MEDIA_QUERY_ALBUM:
-                        sql = g_strdup("SELECT DISTINCT album FROM items ORDER BY track ASC, id ASC;");
-                        break;
-                case MEDIA_QUERY_ARTIST:
-                        sql = g_strdup("SELECT DISTINCT artist FROM items ORDER BY track ASC, id ASC;");
-                        break;
-                case MEDIA_QUERY_GENRE:
-                        sql = g_strdup("SELECT DISTINCT genre FROM items ORDER BY track ASC, id ASC;");
-                        break;
-                case MEDIA_QUERY_MIME:
-                        sql = g_strdup("SELECT DISTINCT mime FROM items ORDER BY track ASC, id ASC;");
-                        break;
-                default:
-                        sql = g_strdup("SELECT DISTINCT path FROM items ORDER BY track ASC, id ASC;");
+        stmt = conn->stmts[DB_STMT_ALL_BY_FIELD + query];
+        if (!stmt && _db_tables[query]) {
+                /* Artists share a table with bands, so check for use */
+                sql = g_strdup_printf("SELECT name FROM %s WHERE EXISTS "
+                        "(SELECT 1 FROM tracks WHERE tracks.%s = %s.ID) "
+                        "ORDER BY name;",
+                        _db_tables[query], _db_fields[query], _db_tables[query]);
+                stmt = _db_statement(conn, DB_STMT_ALL_BY_FIELD + query, sql);
+                g_free(sql);
+        } else if (!stmt) {
+                sql = g_strdup_printf("SELECT DISTINCT %s FROM items ORDER BY track ASC, id ASC;",
+                        _db_fields[query]);
+                stmt = _db_statement(conn, DB_STMT_ALL_BY_FIELD + query, sql);
+                g_free(sql);
         }
-
-        stat = sqlite3_prepare_v2(self->priv->db, (const char *)sql,
-                -1, &stmt, NULL);
-
-        if (stat != SQLITE_OK) {
-                g_warning("SQL error: %d", stat);
+        if (!stmt) {
+                _db_reader_put(self, conn);
+                return FALSE;
         }
+
+        _results = g_ptr_array_new();
         stat = sqlite3_step(stmt);
         while (stat == SQLITE_ROW) {
                 /* We have data to process */
@@ -461,15 +2001,12 @@ gboolean budgie_db_get_all_by_field(BudgieDB *self,
                 stat = sqlite3_step(stmt);
         }
         if (stat == SQLITE_ERROR) {
-                g_error("SQL error: %s", sqlite3_errmsg(self->priv->db));
+                g_error("SQL error: %s", sqlite3_errmsg(conn->db));
         }
 
         /* Wrap up */
-        if (stmt){
-                sqlite3_finalize(stmt);
-        }
-        g_mutex_unlock(&_lock);
-        g_free(sql);
+        _db_statement_done(conn, stmt);
+        _db_reader_put(self, conn);
 
         /* No results */
         if (_results->len < 1) {
@@ -481,6 +2018,59 @@ gboolean budgie_db_get_all_by_field(BudgieDB *self,
         return TRUE;
 }
 
+/**
+ * Run a search, returning every match (which may be none). Stops early
+ * if cancellable is cancelled.
+ */
+static GPtrArray* _db_search(BudgieDB *self,
+                             MediaQuery query,
+                             MatchQuery match,
+                             const gchar *term,
+                             gint max,
+                             GCancellable *cancellable)
+{
+        GPtrArray *results = NULL;
+        BudgieDBConn *conn;
+        sqlite3_stmt *stmt;
+        gchar *pattern;
+        gint stat;
+
+        /* path is UNIQUE, so each row is already distinct */
+        results = g_ptr_array_new_with_free_func(media_info_unref);
+
+        pattern = _db_search_pattern(match, term);
+        conn = _db_reader_get(self);
+
+        stmt = _db_search_statement(conn, query, match);
+        if (!stmt) {
+                _db_reader_put(self, conn);
+                g_free(pattern);
+                return results;
+        }
+
+        sqlite3_bind_text(stmt, 1, pattern, -1, NULL);
+        sqlite3_bind_int(stmt, 2, max);
+
+        stat = sqlite3_step(stmt);
+        while (stat == SQLITE_ROW) {
+                g_ptr_array_add(results, new_media_info(stmt));
+                if (g_cancellable_is_cancelled(cancellable)) {
+                        break;
+                }
+                stat = sqlite3_step(stmt);
+        }
+        if (stat == SQLITE_ERROR) {
+                g_error("SQL error: %s", sqlite3_errmsg(conn->db));
+        }
+
+        /* Wrap up */
+        _db_statement_done(conn, stmt);
+        _db_reader_put(self, conn);
+        g_free(pattern);
+
+        return results;
+}
+
 gboolean budgie_db_search_field(BudgieDB *self,
                                 MediaQuery query,
                                 MatchQuery match,
@@ -493,131 +2083,573 @@ gboolean budgie_db_search_field(BudgieDB *self,
         g_assert(term != NULL);
 
         GPtrArray *_results = NULL;
-        MediaInfo *info, *cmp;
 
+        /* Ensure we're not null */
+        g_return_val_if_fail(self != NULL, FALSE);
+
+        _results = _db_search(self, query, match, term,
+                max == -1 ? -1 : (gint)max, NULL);
+
+        /* No results */
+        if (_results->len < 1) {
+                g_ptr_array_free(_results, TRUE);
+                return FALSE;
+        }
+
+        *results = _results;
+        return TRUE;
+}
+
+/* Arguments to a search on the query pool */
+typedef struct SearchData {
+        MediaQuery query;
+        MatchQuery match;
+        gchar *term;
+        gint max;
+} SearchData;
+
+static void search_data_free(gpointer p_data)
+{
+        SearchData *data = p_data;
+
+        g_free(data->term);
+        g_slice_free(SearchData, data);
+}
+
+static void _db_search_thread(GTask *task,
+                              gpointer source,
+                              gpointer task_data,
+                              GCancellable *cancellable)
+{
+        SearchData *data = task_data;
+        GPtrArray *results;
+
+        results = _db_search(BUDGIE_DB(source), data->query, data->match,
+                data->term, data->max, cancellable);
+        g_task_return_pointer(task, results,
+                (GDestroyNotify)g_ptr_array_unref);
+}
+
+void budgie_db_search_field_async(BudgieDB *self,
+                                  MediaQuery query,
+                                  MatchQuery match,
+                                  const gchar *term,
+                                  gint max,
+                                  GCancellable *cancellable,
+                                  GAsyncReadyCallback callback,
+                                  gpointer userdata)
+{
+        SearchData *data;
+        GTask *task;
+
+        g_return_if_fail(self != NULL);
+        g_return_if_fail(query >= 0 && query < MEDIA_QUERY_MAX);
+        g_return_if_fail(match >= 0 && match < MATCH_QUERY_MAX);
+        g_return_if_fail(term != NULL);
+
+        data = g_slice_new(SearchData);
+        data->query = query;
+        data->match = match;
+        data->term = g_strdup(term);
+        data->max = max;
+
+        task = g_task_new(self, cancellable, callback, userdata);
+        g_task_set_task_data(task, data, search_data_free);
+        _db_run_async(self, task, _db_search_thread);
+}
+
+GPtrArray* budgie_db_search_field_finish(BudgieDB *self,
+                                         GAsyncResult *result,
+                                         GError **error)
+{
+        g_return_val_if_fail(g_task_is_valid(result, self), NULL);
+
+        return g_task_propagate_pointer(G_TASK(result), error);
+}
+
+/**
+ * Turn free text into an FTS5 query: every word becomes a quoted prefix
+ * term, so that punctuation in the text is never parsed as syntax.
+ * Returns NULL if there are no words.
+ */
+static gchar* _db_fts_query(const gchar *text)
+{
+        GString *query;
+        gchar **words;
+        gchar **word;
+        const gchar *c;
+
+        query = g_string_new(NULL);
+        words = g_strsplit_set(text, " \t\n", -1);
+        for (word = words; *word; word++) {
+                if (**word == '\0') {
+                        continue;
+                }
+                if (query->len > 0) {
+                        g_string_append_c(query, ' ');
+                }
+                g_string_append_c(query, '"');
+                for (c = *word; *c; c++) {
+                        if (*c == '"') {
+                                g_string_append_c(query, '"');
+                        }
+                        g_string_append_c(query, *c);
+                }
+                g_string_append(query, "\"*");
+        }
+        g_strfreev(words);
+
+        return g_string_free(query, query->len == 0);
+}
+
+/**
+ * Full-text search across the tag fields, best matches first. Always
+ * returns an array, which may be empty.
+ */
+static GPtrArray* _db_fts_search(BudgieDB *self,
+                                 const gchar *text,
+                                 gint max,
+                                 GCancellable *cancellable)
+{
+        GPtrArray *results = NULL;
+        BudgieDBConn *conn;
         sqlite3_stmt *stmt;
-        gchar *sql, *like_match, *s_term, *test, *limit;
+        gchar *match;
         gint stat;
 
-        gint i;
-        gboolean should_append;
+        results = g_ptr_array_new_with_free_func(media_info_unref);
 
-        /* Ensure we're not null */
-        g_return_val_if_fail(self != NULL, FALSE);
+        match = _db_fts_query(text);
+        if (!match) {
+                return results;
+        }
 
-        _results = g_ptr_array_new();
+        conn = _db_reader_get(self);
+        stmt = _db_statement(conn, DB_STMT_FTS,
+                "SELECT items.* FROM items_fts "
+                "JOIN items ON items.ID = items_fts.rowid "
+                "WHERE items_fts MATCH ? ORDER BY rank LIMIT ?");
+        if (!stmt) {
+                _db_reader_put(self, conn);
+                g_free(match);
+                return results;
+        }
 
-        s_term = _sanitize_value(term);
+        sqlite3_bind_text(stmt, 1, match, -1, NULL);
+        sqlite3_bind_int(stmt, 2, max);
 
-        if (max == -1){
-                limit = g_strdup("");
+        stat = sqlite3_step(stmt);
+        while (stat == SQLITE_ROW) {
+                g_ptr_array_add(results, new_media_info(stmt));
+                if (g_cancellable_is_cancelled(cancellable)) {
+                        break;
+                }
+                stat = sqlite3_step(stmt);
         }
-        else {
-                limit = g_strdup_printf(" LIMIT %d", max);
+        /* A bad query is the user's typing, not a broken database */
+        if (stat == SQLITE_ERROR) {
+                g_warning("Search failed: %s", sqlite3_errmsg(conn->db));
         }
 
-        switch (match) {
-                case MATCH_QUERY_START:
-                        like_match = g_strdup_printf("LIKE '%s%%'", s_term);
-                        break;
-                case MATCH_QUERY_END:
-                        like_match = g_strdup_printf("LIKE '%%%s'", s_term);
-                        break;
-                case MATCH_QUERY_EXACT:
-                        like_match = g_strdup_printf("== '%s'", s_term);
-                        break;
-                case MATCH_QUERY_ANYWHERE:
-                default:
-                        like_match = g_strdup_printf("LIKE '%%%s%%'", s_term);
+        _db_statement_done(conn, stmt);
+        _db_reader_put(self, conn);
+        g_free(match);
+
+        return results;
+}
+
+/* Arguments to a full-text search on the query pool */
+typedef struct TextSearchData {
+        gchar *text;
+        gint max;
+} TextSearchData;
+
+static void text_search_data_free(gpointer p_data)
+{
+        TextSearchData *data = p_data;
+
+        g_free(data->text);
+        g_slice_free(TextSearchData, data);
+}
+
+static void _db_text_search_thread(GTask *task,
+                                   gpointer source,
+                                   gpointer task_data,
+                                   GCancellable *cancellable)
+{
+        TextSearchData *data = task_data;
+        GPtrArray *results;
+
+        results = _db_fts_search(BUDGIE_DB(source), data->text, data->max,
+                cancellable);
+        g_task_return_pointer(task, results,
+                (GDestroyNotify)g_ptr_array_unref);
+}
+
+void budgie_db_search_async(BudgieDB *self,
+                            const gchar *text,
+                            gint max,
+                            GCancellable *cancellable,
+                            GAsyncReadyCallback callback,
+                            gpointer userdata)
+{
+        TextSearchData *data;
+        GTask *task;
+
+        g_return_if_fail(self != NULL);
+        g_return_if_fail(text != NULL);
+
+        data = g_slice_new(TextSearchData);
+        data->text = g_strdup(text);
+        data->max = max;
+
+        task = g_task_new(self, cancellable, callback, userdata);
+        g_task_set_task_data(task, data, text_search_data_free);
+        _db_run_async(self, task, _db_text_search_thread);
+}
+
+GPtrArray* budgie_db_search_finish(BudgieDB *self,
+                                   GAsyncResult *result,
+                                   GError **error)
+{
+        g_return_val_if_fail(g_task_is_valid(result, self), NULL);
+
+        return g_task_propagate_pointer(G_TASK(result), error);
+}
+
+guint budgie_db_get_albums(BudgieDB *self,
+                           BudgieDBAlbumFunc func,
+                           gpointer userdata)
+{
+        BudgieDBConn *conn;
+        sqlite3_stmt *stmt;
+        AlbumInfo info;
+        guint ret = 0;
+        gint stat;
+
+        g_return_val_if_fail(self != NULL, 0);
+        g_return_val_if_fail(func != NULL, 0);
+
+        conn = _db_reader_get(self);
+
+        /* Bare columns come from the row holding the MIN(), which orders
+         * rows the same way as ORDER BY track, id. Each album's tracks
+         * are a range of the tracks_album index. */
+        stmt = _db_statement(conn, DB_STMT_ALBUMS,
+                "SELECT al.name, ar.name, b.name, COUNT(*), "
+                "MIN(t.track * 4294967296 + t.ID) "
+                "FROM albums al JOIN tracks t ON t.album = al.ID "
+                "LEFT JOIN artists ar ON ar.ID = t.artist "
+                "LEFT JOIN artists b ON b.ID = t.band "
+                "WHERE al.name != '' "
+                "GROUP BY al.ID ORDER BY al.name;");
+        if (!stmt) {
+                _db_reader_put(self, conn);
+                return 0;
         }
 
-        switch (query) {
-                case MEDIA_QUERY_TITLE:
-                        test = g_strdup("title");
-                        break;
-                case MEDIA_QUERY_ALBUM:
-                        test = g_strdup("album");
-                        break;
-                case MEDIA_QUERY_ARTIST:
-                        test = g_strdup("artist");
-                        break;
-                case MEDIA_QUERY_GENRE:
-                        test = g_strdup("genre");
+        while ((stat = sqlite3_step(stmt)) == SQLITE_ROW) {
+                info.album = (const gchar*)sqlite3_column_text(stmt, 0);
+                info.artist = (const gchar*)sqlite3_column_text(stmt, 1);
+                info.band = (const gchar*)sqlite3_column_text(stmt, 2);
+                info.n_tracks = (guint)sqlite3_column_int(stmt, 3);
+                ret++;
+                if (!func(&info, userdata)) {
                         break;
-                case MEDIA_QUERY_MIME:
-                        test = g_strdup("mimetype");
-                        break;
-                default:
-                        g_warning("Invalid query '%d'", query);
-                        g_free(like_match);
-                        g_free(s_term);
-                        g_free(_results);
-                        return FALSE;
+                }
+        }
+        if (stat == SQLITE_ERROR) {
+                g_warning("SQL error: %s", sqlite3_errmsg(conn->db));
         }
 
-        sql = g_strdup_printf("SELECT * FROM items WHERE %s %s ORDER BY track ASC, id ASC %s;",
-                test, like_match, limit);
+        _db_statement_done(conn, stmt);
+        _db_reader_put(self, conn);
 
-        g_free(test);
-        g_free(like_match);
-        g_free(limit);
-        g_free(s_term);
+        return ret;
+}
 
-        g_mutex_lock(&_lock);
-        stat = sqlite3_prepare_v2(self->priv->db, (const char *)sql,
-                -1, &stmt, NULL);
-        if (stat != SQLITE_OK) {
-                g_error("Failed to prepare SQL statement");
-                sqlite3_finalize(stmt);
-                g_mutex_unlock(&_lock);
-                g_free(sql);
-                g_ptr_array_free(_results, TRUE);
-                return FALSE;
+/* Where budgie_db_get_albums_async collects its albums */
+typedef struct AlbumCollect {
+        GArray *albums;
+        GCancellable *cancellable;
+} AlbumCollect;
+
+static gboolean _db_album_collect(AlbumInfo *info, gpointer userdata)
+{
+        AlbumCollect *collect = userdata;
+        AlbumInfo copy;
+
+        /* Interned, so the copies own nothing */
+        copy.album = g_intern_string(info->album);
+        copy.artist = g_intern_string(info->artist);
+        copy.band = g_intern_string(info->band);
+        copy.n_tracks = info->n_tracks;
+        g_array_append_val(collect->albums, copy);
+
+        return !g_cancellable_is_cancelled(collect->cancellable);
+}
+
+static void _db_albums_thread(GTask *task,
+                              gpointer source,
+                              gpointer task_data,
+                              GCancellable *cancellable)
+{
+        AlbumCollect collect;
+
+        collect.albums = g_array_new(FALSE, FALSE, sizeof(AlbumInfo));
+        collect.cancellable = cancellable;
+        budgie_db_get_albums(BUDGIE_DB(source), _db_album_collect, &collect);
+        g_task_return_pointer(task, collect.albums,
+                (GDestroyNotify)g_array_unref);
+}
+
+void budgie_db_get_albums_async(BudgieDB *self,
+                                GCancellable *cancellable,
+                                GAsyncReadyCallback callback,
+                                gpointer userdata)
+{
+        GTask *task;
+
+        g_return_if_fail(self != NULL);
+
+        task = g_task_new(self, cancellable, callback, userdata);
+        _db_run_async(self, task, _db_albums_thread);
+}
+
+GArray* budgie_db_get_albums_finish(BudgieDB *self,
+                                    GAsyncResult *result,
+                                    GError **error)
+{
+        g_return_val_if_fail(g_task_is_valid(result, self), NULL);
+
+        return g_task_propagate_pointer(G_TASK(result), error);
+}
+
+/**
+ * An open query. Nothing is held between fetches: each page is its own
+ * query, starting after the (track, id) of the last row fetched, so a
+ * cursor neither ties up a reader connection nor pins a WAL snapshot.
+ */
+struct _BudgieDBCursor {
+        gint ref_count;
+        BudgieDB *db;
+        MediaQuery query;
+        MatchQuery match;
+        gchar *pattern;
+        gint64 last_track;
+        gint64 last_id;
+        gboolean done;
+};
+
+BudgieDBCursor* budgie_db_cursor_open(BudgieDB *self,
+                                      MediaQuery query,
+                                      MatchQuery match,
+                                      const gchar *term)
+{
+        BudgieDBCursor *cursor;
+
+        g_return_val_if_fail(self != NULL, NULL);
+        g_return_val_if_fail(query >= 0 && query < MEDIA_QUERY_MAX, NULL);
+        g_return_val_if_fail(match >= 0 && match < MATCH_QUERY_MAX, NULL);
+
+        cursor = g_new0(BudgieDBCursor, 1);
+        cursor->ref_count = 1;
+        cursor->db = g_object_ref(self);
+        cursor->query = query;
+        cursor->match = match;
+        if (term) {
+                cursor->pattern = _db_search_pattern(match, term);
         }
+        /* Before every row */
+        cursor->last_track = G_MININT64;
+        cursor->last_id = G_MININT64;
 
-        stat = sqlite3_step(stmt);
-        while (stat == SQLITE_ROW) {
-                should_append = TRUE;
+        return cursor;
+}
 
-                /* We have data to process */
-                info = new_media_info(stmt);
+/**
+ * Return the statement for the next page of a cursor. The first
+ * parameter is the pattern, if any, the next two the (track, id) to
+ * start after and the last the page size.
+ */
+static sqlite3_stmt* _db_page_statement(BudgieDBConn *conn,
+                                        BudgieDBCursor *cursor)
+{
+        sqlite3_stmt *stmt;
+        const gchar *like_match;
+        gchar *sql;
+        guint id;
+
+        if (!cursor->pattern) {
+                return _db_statement(conn, DB_STMT_PAGE_ALL,
+                        "SELECT * FROM items WHERE (track, ID) > (?2, ?3) "
+                        "ORDER BY track ASC, id ASC LIMIT ?4");
+        }
+
+        id = DB_STMT_PAGE + cursor->query * MATCH_QUERY_MAX + cursor->match;
+        stmt = conn->stmts[id];
+        if (stmt) {
+                return stmt;
+        }
+
+        like_match = cursor->match == MATCH_QUERY_EXACT ? "== ?1" : "LIKE ?1 ESCAPE '\\'";
+        sql = g_strdup_printf("SELECT * FROM items WHERE %s %s "
+                "AND (track, ID) > (?2, ?3) ORDER BY track ASC, id ASC LIMIT ?4;",
+                _db_fields[cursor->query], like_match);
+        stmt = _db_statement(conn, id, sql);
+        g_free(sql);
+
+        return stmt;
+}
+
+static guint _db_cursor_fetch(BudgieDBCursor *cursor,
+                              guint max,
+                              GPtrArray *results,
+                              GCancellable *cancellable)
+{
+        BudgieDBConn *conn;
+        sqlite3_stmt *stmt;
+        guint ret = 0;
+        gint stat;
+
+        if (cursor->done || max == 0) {
+                return 0;
+        }
 
-                if (info == NULL){
-                        should_append = FALSE;
+        conn = _db_reader_get(cursor->db);
+        stmt = _db_page_statement(conn, cursor);
+        if (!stmt) {
+                _db_reader_put(cursor->db, conn);
+                cursor->done = TRUE;
+                return 0;
+        }
+
+        if (cursor->pattern) {
+                sqlite3_bind_text(stmt, 1, cursor->pattern, -1, NULL);
+        }
+        sqlite3_bind_int64(stmt, 2, cursor->last_track);
+        sqlite3_bind_int64(stmt, 3, cursor->last_id);
+        sqlite3_bind_int64(stmt, 4, max);
+
+        while (ret < max) {
+                if (g_cancellable_is_cancelled(cancellable)) {
+                        break;
                 }
-                else {
-                        for (i = 0; i < _results->len; i++){
-                                cmp = (MediaInfo*)_results->pdata[i];
-                                if (g_str_equal(cmp->path, info->path)){
-                                        should_append = FALSE;
-                                }
+                stat = sqlite3_step(stmt);
+                if (stat != SQLITE_ROW) {
+                        if (stat != SQLITE_DONE) {
+                                g_warning("SQL error: %s",
+                                        sqlite3_errmsg(conn->db));
                         }
+                        /* A short page is the last one */
+                        cursor->done = TRUE;
+                        break;
                 }
+                cursor->last_track = sqlite3_column_int64(stmt,
+                        BUDGIE_DB_COLUMN_TRACK);
+                cursor->last_id = sqlite3_column_int64(stmt,
+                        BUDGIE_DB_COLUMN_ID);
+                g_ptr_array_add(results, new_media_info(stmt));
+                ret++;
+        }
 
-                if (should_append){
-                        g_ptr_array_add(_results, info);
-                }
+        _db_statement_done(conn, stmt);
+        _db_reader_put(cursor->db, conn);
 
-                /* Continue. */
-                stat = sqlite3_step(stmt);
-        }
-        if (stat == SQLITE_ERROR) {
-                g_error("SQL error: %s", sqlite3_errmsg(self->priv->db));
+        return ret;
+}
+
+guint budgie_db_cursor_fetch(BudgieDBCursor *cursor,
+                             guint max,
+                             GPtrArray *results)
+{
+        g_return_val_if_fail(cursor != NULL, 0);
+        g_return_val_if_fail(results != NULL, 0);
+
+        return _db_cursor_fetch(cursor, max, results, NULL);
+}
+
+/* Arguments to a fetch on the query pool */
+typedef struct FetchData {
+        BudgieDBCursor *cursor;
+        guint max;
+} FetchData;
+
+static void fetch_data_free(gpointer p_data)
+{
+        FetchData *data = p_data;
+
+        _db_cursor_unref(data->cursor);
+        g_slice_free(FetchData, data);
+}
+
+static void _db_fetch_thread(GTask *task,
+                             gpointer source,
+                             gpointer task_data,
+                             GCancellable *cancellable)
+{
+        FetchData *data = task_data;
+        GPtrArray *results;
+
+        results = g_ptr_array_new_with_free_func(media_info_unref);
+        _db_cursor_fetch(data->cursor, data->max, results, cancellable);
+        g_task_return_pointer(task, results,
+                (GDestroyNotify)g_ptr_array_unref);
+}
+
+void budgie_db_cursor_fetch_async(BudgieDBCursor *cursor,
+                                  guint max,
+                                  GCancellable *cancellable,
+                                  GAsyncReadyCallback callback,
+                                  gpointer userdata)
+{
+        FetchData *data;
+        GTask *task;
+
+        g_return_if_fail(cursor != NULL);
+
+        data = g_slice_new(FetchData);
+        data->cursor = _db_cursor_ref(cursor);
+        data->max = max;
+
+        task = g_task_new(cursor->db, cancellable, callback, userdata);
+        g_task_set_task_data(task, data, fetch_data_free);
+        _db_run_async(cursor->db, task, _db_fetch_thread);
+}
+
+GPtrArray* budgie_db_cursor_fetch_finish(BudgieDB *self,
+                                         GAsyncResult *result,
+                                         GError **error)
+{
+        g_return_val_if_fail(g_task_is_valid(result, self), NULL);
+
+        return g_task_propagate_pointer(G_TASK(result), error);
+}
+
+static BudgieDBCursor* _db_cursor_ref(BudgieDBCursor *cursor)
+{
+        g_atomic_int_inc(&cursor->ref_count);
+        return cursor;
+}
+
+static void _db_cursor_unref(BudgieDBCursor *cursor)
+{
+        if (!g_atomic_int_dec_and_test(&cursor->ref_count)) {
+                return;
         }
 
-        /* Wrap up */
-        sqlite3_finalize(stmt);
-        g_mutex_unlock(&_lock);
-        g_free(sql);
+        g_object_unref(cursor->db);
+        g_free(cursor->pattern);
+        g_free(cursor);
+}
 
-        /* No results */
-        if (_results->len < 1) {
-                g_ptr_array_free(_results, TRUE);
-                return FALSE;
+void budgie_db_cursor_close(BudgieDBCursor *cursor)
+{
+        if (!cursor) {
+                return;
         }
 
-        *results = _results;
-        return TRUE;
+        _db_cursor_unref(cursor);
 }
 
 /** PRIVATE **/
@@ -24,11 +24,13 @@
 #define budgie_db_h
 
 #include <glib-object.h>
+#include <gio/gio.h>
 #include <sqlite3.h>
 
 typedef struct _BudgieDB BudgieDB;
 typedef struct _BudgieDBClass   BudgieDBClass;
 typedef struct _BudgieDBPrivate BudgieDBPrivate;
+typedef struct _BudgieDBCursor BudgieDBCursor;
 
 #define BUDGIE_DB_TYPE (budgie_db_get_type())
 #define BUDGIE_DB(obj)                  (G_TYPE_CHECK_INSTANCE_CAST ((obj), BUDGIE_DB_TYPE, BudgieDB))
@@ -39,7 +41,15 @@ typedef struct _BudgieDBPrivate BudgieDBPrivate;
 
 #define CONFIG_NAME "budgie-2.db"
 
-/* BudgieDB object */
+/**
+ * BudgieDB object
+ *
+ * Signals, each emitted on the main context BudgieDB was created in,
+ * with a GArray of the gint ids affected by one write:
+ *  - items-added: rows new to the library
+ *  - items-changed: rows rewritten in place, keeping their id
+ *  - items-removed: rows deleted, which can no longer be queried
+ */
 struct _BudgieDB {
         GObject parent;
 
@@ -52,29 +62,91 @@ struct _BudgieDBClass {
 };
 
 
-/* MediaInfo API */
-
-/**
- * Free a MediaInfo
- * @param p_info MediaInfo pointer
- */
-void free_media_info(gpointer p_info);
-
 /**
  * Represents relevant media information
+ *
+ * MediaInfo is reference counted, and shared between the database
+ * results, the views and the player rather than copied. The artist,
+ * album, band, genre and mime strings are not owned by the MediaInfo,
+ * so must never be freed or modified. Those read from the database are
+ * interned (g_intern_string), while the scanner's come from a string
+ * chunk freed once the scan's tracks are written.
  */
 typedef struct MediaInfo {
+        gint ref_count; /**<Reference count, see media_info_ref */
         gint id; /**<Id */
         guint track_no; /**<Track number */
         gchar *title; /**<Title */
-        gchar *artist; /**<Artist or author */
-        gchar *album; /**<Album */
-        gchar *band; /**<Band */
-        gchar *genre; /**<Genre */
+        const gchar *artist; /**<Artist or author, shared */
+        const gchar *album; /**<Album, shared */
+        const gchar *band; /**<Band, shared */
+        const gchar *genre; /**<Genre, shared */
         gchar *path; /**<File system path */
-        gchar *mime; /**<File mime type */
+        const gchar *mime; /**<File mime type, shared */
+        gint64 mtime; /**<Modification time of the file when scanned */
+        gint64 size; /**<Size of the file when scanned */
+        guint64 inode; /**<Inode of the file when scanned */
+        gint64 generation; /**<Scan generation that last saw the file */
 } MediaInfo;
 
+/* MediaInfo API */
+
+#define MEDIA_INFO_TYPE (media_info_get_type())
+
+/**
+ * Boxed type for MediaInfo, for storing references in models
+ */
+GType media_info_get_type(void);
+
+/**
+ * Allocate a new, empty MediaInfo with a single reference
+ * @return a new MediaInfo
+ */
+MediaInfo* media_info_new(void);
+
+/**
+ * Take a reference on a MediaInfo
+ * @param info MediaInfo pointer
+ * @return the same MediaInfo
+ */
+MediaInfo* media_info_ref(MediaInfo *info);
+
+/**
+ * Drop a reference on a MediaInfo, freeing it when none remain.
+ * Usable as a GDestroyNotify
+ * @param p_info MediaInfo pointer, may be NULL
+ */
+void media_info_unref(gpointer p_info);
+
+/**
+ * Summary of a single album, see budgie_db_get_albums
+ */
+typedef struct AlbumInfo {
+        const gchar *album; /**<Album */
+        const gchar *artist; /**<Artist of the album's first track */
+        const gchar *band; /**<Band of the album's first track */
+        guint n_tracks; /**<Number of tracks on the album */
+} AlbumInfo;
+
+/**
+ * Called for each album in turn
+ * The strings within info are only valid for the duration of the call
+ * @param info The current album
+ * @param userdata User data passed to budgie_db_get_albums
+ * @return FALSE to stop iterating, TRUE to continue
+ */
+typedef gboolean (*BudgieDBAlbumFunc)(AlbumInfo *info, gpointer userdata);
+
+/**
+ * Called after a statement runs, with the plan SQLite chose for it
+ * @param sql The statement, with ? in place of its values
+ * @param plan The EXPLAIN QUERY PLAN details, one per line
+ * @param userdata User data passed to budgie_db_set_plan_func
+ */
+typedef void (*BudgieDBPlanFunc)(const gchar *sql,
+                                 const gchar *plan,
+                                 gpointer userdata);
+
 enum {
         BUDGIE_DB_COLUMN_ID=0,
         BUDGIE_DB_COLUMN_TITLE,
@@ -85,6 +157,10 @@ enum {
         BUDGIE_DB_COLUMN_GENRE,
         BUDGIE_DB_COLUMN_PATH,
         BUDGIE_DB_COLUMN_MIME,
+        BUDGIE_DB_COLUMN_MTIME,
+        BUDGIE_DB_COLUMN_SIZE,
+        BUDGIE_DB_COLUMN_INODE,
+        BUDGIE_DB_COLUMN_GENERATION,
 
         BUDGIE_DB_NUM_COLUMNS
 };
@@ -131,16 +207,136 @@ gboolean budgie_db_update(BudgieDB *self, GSList *tracks);
 
 /**
  * Retrieve media information from BudgieDB by filesystem path
- * You must free the result of this call using free_media_info
+ * You must release the result of this call using media_info_unref
  * @param self BudgieDB instance
  * @param path Path to media file on the filesystem
  * @return a MediaInfo if the file is known, or NULL
  */
 MediaInfo* budgie_db_get_media(BudgieDB *self, gchar *path);
 
+/**
+ * Retrieve media information for a set of items by id. Ids no longer
+ * in the database are skipped.
+ * @param self BudgieDB instance
+ * @param ids Array of gint item ids
+ * @return a (possibly empty) array owning its MediaInfos
+ */
+GPtrArray* budgie_db_get_media_ids(BudgieDB *self, GArray *ids);
+
+/**
+ * Get the change serial, which increases with every change to the
+ * browse data (tags, paths and mime types) of any item
+ * @param self BudgieDB instance
+ * @return the current serial, or -1 on error
+ */
+gint64 budgie_db_get_serial(BudgieDB *self);
+
+/**
+ * Get the change serial as of the latest change signal emitted. Anything
+ * kept up to date from the signals received so far is current as of
+ * this serial, where budgie_db_get_serial may already count writes whose
+ * signals are still on their way. Call from the main context only.
+ * @param self BudgieDB instance
+ * @return the serial, or -1 on error
+ */
+gint64 budgie_db_get_emitted_serial(BudgieDB *self);
+
+/**
+ * Report the plan of every statement run from now on, for checking that
+ * queries use their indexes. Each plan costs another query, so this is
+ * for tests only. func is called on whichever thread ran the statement.
+ * Set it before running any queries.
+ * @param self BudgieDB instance
+ * @param func Function to call with each plan, or NULL to stop
+ * @param userdata User data to pass to func
+ */
+void budgie_db_set_plan_func(BudgieDB *self,
+                             BudgieDBPlanFunc func,
+                             gpointer userdata);
+
+/**
+ * Determine whether a file is already known with the given stamp
+ * Used by the scanner to avoid re-reading tags from unchanged files
+ * @param self BudgieDB instance
+ * @param path Path to media file on the filesystem
+ * @param mtime Current modification time of the file
+ * @param size Current size of the file
+ * @param inode Current inode of the file
+ * @return the id of the stored record if it matches the stamp, or 0
+ */
+gint budgie_db_file_unchanged(BudgieDB *self,
+                              const gchar *path,
+                              gint64 mtime,
+                              gint64 size,
+                              guint64 inode);
+
+/**
+ * Start a new scan generation
+ * Tracks written or touched from now on are stamped with it
+ * @param self BudgieDB instance
+ * @return the new generation
+ */
+gint64 budgie_db_begin_scan(BudgieDB *self);
+
+/**
+ * Stamp unchanged tracks with the current generation, in one transaction
+ * @param self BudgieDB instance
+ * @param ids Array of gint track ids seen by the current scan
+ * @return TRUE if all tracks were stamped, FALSE otherwise
+ */
+gboolean budgie_db_touch(BudgieDB *self, GArray *ids);
+
+/**
+ * Count the tracks beneath a directory that weren't seen since a generation
+ * i.e. those budgie_db_prune would remove
+ * @param self BudgieDB instance
+ * @param root Directory that was scanned
+ * @param generation Generation returned by budgie_db_begin_scan
+ * @return the number of tracks not seen
+ */
+gint budgie_db_count_stale(BudgieDB *self, const gchar *root, gint64 generation);
+
+/**
+ * Get the device a media directory was on when it was last pruned
+ * @param self BudgieDB instance
+ * @param root Media directory
+ * @return the device number, or 0 if it was never recorded
+ */
+guint64 budgie_db_get_root_device(BudgieDB *self, const gchar *root);
+
+/**
+ * Record the device a media directory is on
+ * @param self BudgieDB instance
+ * @param root Media directory
+ * @param device Device number, as from stat()
+ * @return a boolean value, indicating success of the operation
+ */
+gboolean budgie_db_set_root_device(BudgieDB *self,
+                                   const gchar *root,
+                                   guint64 device);
+
+/**
+ * Remove tracks beneath a directory that weren't seen since a generation
+ * @param self BudgieDB instance
+ * @param root Directory that was completely scanned
+ * @param generation Generation returned by budgie_db_begin_scan
+ * @return a boolean value, indicating success of the operation
+ */
+gboolean budgie_db_prune(BudgieDB *self, const gchar *root, gint64 generation);
+
+/**
+ * Remove media from the database, in a single transaction
+ * Paths naming a directory remove everything beneath that directory
+ * @param self BudgieDB instance
+ * @param paths A list of filesystem paths to remove
+ * @return TRUE if all paths were removed, FALSE otherwise
+ */
+gboolean budgie_db_remove_paths(BudgieDB *self, GSList *paths);
+
 /**
  * Get all media known to BudgieDB
  * You must free the result of this call using g_slist_free_full
+ * and media_info_unref
  * @param self BudgieDB instance
  * @return a singly linked list of results, or NULL
  */
@@ -148,6 +344,7 @@ GSList* budgie_db_get_all_media(BudgieDB* self);
 
 /**
  * Return string values of one field for all MediaInfo in the database
+ * Artists, albums and genres are sorted by name.
  * @param self BudgieDB instance
  * @param query The query to perform
  * @param results Pointer to store results in
@@ -164,7 +361,7 @@ gboolean budgie_db_get_all_by_field(BudgieDB *self,
  * @param match Type of match to perform
  * @param term Term to search for
  * @param max Maximum results to return, or -1 for unlimited
- * @param results Pointer to store results in
+ * @param results Pointer to store results in, which owns its MediaInfos
  * @return a boolean value, indicating success of the operation
  */
 gboolean budgie_db_search_field(BudgieDB *self,
@@ -174,6 +371,174 @@ gboolean budgie_db_search_field(BudgieDB *self,
                                 guint max,
                                 GPtrArray **results);
 
+/**
+ * Search all media for a given term, without blocking
+ *
+ * The query runs on the database's own thread pool, and callback is
+ * invoked on the thread-default main context of the caller.
+ *
+ * @param self BudgieDB instance
+ * @param query The query to perform
+ * @param match Type of match to perform
+ * @param term Term to search for
+ * @param max Maximum results to return, or -1 for unlimited
+ * @param cancellable Optional GCancellable
+ * @param callback Called when the search completes
+ * @param userdata User data to pass to callback
+ */
+void budgie_db_search_field_async(BudgieDB *self,
+                                  MediaQuery query,
+                                  MatchQuery match,
+                                  const gchar *term,
+                                  gint max,
+                                  GCancellable *cancellable,
+                                  GAsyncReadyCallback callback,
+                                  gpointer userdata);
+
+/**
+ * Complete a search started with budgie_db_search_field_async
+ * @param self BudgieDB instance
+ * @param result The GAsyncResult passed to the callback
+ * @param error Return location for an error, i.e. G_IO_ERROR_CANCELLED
+ * @return a (possibly empty) array owning its MediaInfos, or NULL on error
+ */
+GPtrArray* budgie_db_search_field_finish(BudgieDB *self,
+                                         GAsyncResult *result,
+                                         GError **error);
+
+/**
+ * Search the title, artist, album, band and genre of all media at once,
+ * treating each word of text as a prefix. Runs on the query pool.
+ * @param self BudgieDB instance
+ * @param text Free text as typed by the user
+ * @param max Maximum number of results, best matches first
+ * @param cancellable Optional GCancellable
+ * @param callback Called on the calling thread's main context when done
+ * @param userdata User data to pass to callback
+ */
+void budgie_db_search_async(BudgieDB *self,
+                            const gchar *text,
+                            gint max,
+                            GCancellable *cancellable,
+                            GAsyncReadyCallback callback,
+                            gpointer userdata);
+
+/**
+ * Complete a search started with budgie_db_search_async
+ * @param self BudgieDB instance
+ * @param result The GAsyncResult passed to the callback
+ * @param error Return location for an error, i.e. G_IO_ERROR_CANCELLED
+ * @return a (possibly empty) array owning its MediaInfos, or NULL on error
+ */
+GPtrArray* budgie_db_search_finish(BudgieDB *self,
+                                   GAsyncResult *result,
+                                   GError **error);
+
+/**
+ * Iterate every album in one grouped query, streaming the results
+ *
+ * The artist and band are those of the album's first track, which
+ * along with the album name is enough to find its album art.
+ *
+ * @param self BudgieDB instance
+ * @param func Function to call for each album
+ * @param userdata User data to pass to func
+ * @return the number of albums visited
+ */
+guint budgie_db_get_albums(BudgieDB *self,
+                           BudgieDBAlbumFunc func,
+                           gpointer userdata);
+
+/**
+ * Collect every album, without blocking
+ * @param self BudgieDB instance
+ * @param cancellable Optional GCancellable
+ * @param callback Called on the caller's main context once complete
+ * @param userdata User data to pass to callback
+ */
+void budgie_db_get_albums_async(BudgieDB *self,
+                                GCancellable *cancellable,
+                                GAsyncReadyCallback callback,
+                                gpointer userdata);
+
+/**
+ * Complete budgie_db_get_albums_async
+ * The strings within each AlbumInfo are interned, and never freed.
+ * @param self BudgieDB instance
+ * @param result The GAsyncResult passed to the callback
+ * @param error Return location for an error
+ * @return a GArray of AlbumInfo, or NULL on error
+ */
+GArray* budgie_db_get_albums_finish(BudgieDB *self,
+                                    GAsyncResult *result,
+                                    GError **error);
+
+/**
+ * Open a cursor over media, ordered by track number
+ *
+ * Opening a cursor doesn't touch the database, and nothing is held
+ * between fetches. Each page starts after the last row fetched, so rows
+ * written in between appear on later pages if they sort after it.
+ *
+ * @param self BudgieDB instance
+ * @param query The field to match against
+ * @param match Type of match to perform
+ * @param term Term to search for, or NULL for all media
+ * @return a new BudgieDBCursor
+ */
+BudgieDBCursor* budgie_db_cursor_open(BudgieDB *self,
+                                      MediaQuery query,
+                                      MatchQuery match,
+                                      const gchar *term);
+
+/**
+ * Fetch the next page of results from a cursor
+ * Each MediaInfo appended must be released using media_info_unref
+ * @param cursor An open BudgieDBCursor
+ * @param max Maximum number of results to fetch
+ * @param results Array to append the results to
+ * @return the number of results fetched, 0 once the cursor is exhausted
+ */
+guint budgie_db_cursor_fetch(BudgieDBCursor *cursor,
+                             guint max,
+                             GPtrArray *results);
+
+/**
+ * Fetch the next page of results from a cursor, without blocking
+ *
+ * Only one fetch may be in progress on a cursor at a time. The cursor
+ * may be closed while a fetch is in progress.
+ *
+ * @param cursor An open BudgieDBCursor
+ * @param max Maximum number of results to fetch
+ * @param cancellable Optional GCancellable
+ * @param callback Called on the caller's main context once complete
+ * @param userdata User data to pass to callback
+ */
+void budgie_db_cursor_fetch_async(BudgieDBCursor *cursor,
+                                  guint max,
+                                  GCancellable *cancellable,
+                                  GAsyncReadyCallback callback,
+                                  gpointer userdata);
+
+/**
+ * Complete budgie_db_cursor_fetch_async
+ * @param self BudgieDB instance the cursor was opened on
+ * @param result The GAsyncResult passed to the callback
+ * @param error Return location for an error, i.e. G_IO_ERROR_CANCELLED
+ * @return an array owning its MediaInfos, empty once the cursor is
+ * exhausted, or NULL on error
+ */
+GPtrArray* budgie_db_cursor_fetch_finish(BudgieDB *self,
+                                         GAsyncResult *result,
+                                         GError **error);
+
+/**
+ * Close a cursor
+ * @param cursor BudgieDBCursor to close, may be NULL
+ */
+void budgie_db_cursor_close(BudgieDBCursor *cursor);
+
 /**
  * Default sort mechanism for BudgieDB arrays
  */
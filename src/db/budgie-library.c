@@ -0,0 +1,1200 @@
+/*
+ * budgie-library.c
+ * 
+ * Copyright 2013 Ikey Doherty <ikey.doherty@gmail.com>
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ * 
+ * 
+ */
+#include <string.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "budgie-library.h"
+
+/* Rows read from the database at a time while building a snapshot */
+#define LIBRARY_LOAD_PAGE 2000
+
+/* Snapshot cache, kept with the album thumbnails in the user cache
+ * directory */
+#define LIBRARY_CACHE_NAME "budgie/library.cache"
+#define LIBRARY_CACHE_MAGIC "BUDGIELC"
+#define LIBRARY_CACHE_VERSION 1
+
+/* Quiet period after a change before the cache is rewritten (seconds) */
+#define LIBRARY_SAVE_DELAY 5
+
+/**
+ * Cache file header, in host byte order. It is followed by the live
+ * rows' keys (guint64), then ids, tracks, titles, paths, artists,
+ * albums, bands, genres and mimes (guint32 each), the string offset
+ * of each dictionary value (guint32), and finally the string blob.
+ */
+typedef struct LibraryCacheHeader {
+        gchar magic[8];
+        guint32 version;
+        guint32 n_rows;
+        guint32 n_values;
+        guint32 strings_len;
+        gint64 serial; /* budgie_db_get_serial when written */
+        guint8 digest[16]; /* MD5 of everything after the header */
+} LibraryCacheHeader;
+
+/* Number of guint32 columns in the cache */
+#define LIBRARY_CACHE_COLUMNS 9
+
+/**
+ * The library as parallel columns, one entry per row. Titles and paths
+ * are offsets into a single string blob, and tag values are ids into a
+ * dictionary of interned strings, with 0 meaning no value.
+ */
+typedef struct LibrarySnapshot {
+        GArray *ids; /* gint, 0 once the row is removed */
+        GArray *tracks; /* guint */
+        GArray *keys; /* guint64 sort key, track then id */
+        GArray *titles; /* guint offset into strings */
+        GArray *paths; /* guint offset into strings */
+        GArray *artists; /* guint dictionary id */
+        GArray *albums;
+        GArray *bands;
+        GArray *genres;
+        GArray *mimes;
+
+        GByteArray *strings;
+        GPtrArray *values; /* Interned strings by dictionary id */
+        GHashTable *value_ids; /* Interned string to dictionary id */
+
+        GHashTable *rows; /* Item id to row */
+        GArray *order; /* guint rows, sorted by key */
+        gboolean sorted;
+        guint garbage; /* Rows and strings left behind by changes */
+        gboolean cached; /* Read from the cache, rather than the database */
+} LibrarySnapshot;
+
+/* Private storage */
+struct _BudgieLibraryPrivate {
+        BudgieDB *db;
+        LibrarySnapshot *snapshot;
+
+        /* Ids waiting to be fetched, and those removed while a job was
+         * running, which its results must not bring back */
+        GHashTable *pending;
+        GHashTable *dropped;
+        gboolean reload;
+
+        /* The running job, one at a time */
+        GCancellable *cancellable;
+
+        /* Cache file, and rewriting it once changes settle */
+        gchar *cache_path;
+        guint save_id;
+        guint changes;
+};
+
+/* A job for the worker thread, holding its own database reference */
+typedef struct LibraryJob {
+        BudgieDB *db;
+        GArray *ids;
+        gchar *path;
+        GByteArray *data;
+        guint changes;
+        gint64 serial;
+} LibraryJob;
+
+G_DEFINE_TYPE_WITH_PRIVATE(BudgieLibrary, budgie_library, G_TYPE_OBJECT)
+
+/* Boilerplate GObject code */
+static void budgie_library_class_init(BudgieLibraryClass *klass);
+static void budgie_library_init(BudgieLibrary *self);
+static void budgie_library_dispose(GObject *object);
+
+static void items_changed_cb(BudgieDB *db, GArray *ids, gpointer userdata);
+static void items_removed_cb(BudgieDB *db, GArray *ids, gpointer userdata);
+static void _library_sync(BudgieLibrary *self);
+static void _library_changed(BudgieLibrary *self);
+
+/* Snapshot */
+static LibrarySnapshot* _snapshot_new(void)
+{
+        LibrarySnapshot *snap;
+
+        snap = g_slice_new0(LibrarySnapshot);
+        snap->ids = g_array_new(FALSE, FALSE, sizeof(gint));
+        snap->tracks = g_array_new(FALSE, FALSE, sizeof(guint));
+        snap->keys = g_array_new(FALSE, FALSE, sizeof(guint64));
+        snap->titles = g_array_new(FALSE, FALSE, sizeof(guint));
+        snap->paths = g_array_new(FALSE, FALSE, sizeof(guint));
+        snap->artists = g_array_new(FALSE, FALSE, sizeof(guint));
+        snap->albums = g_array_new(FALSE, FALSE, sizeof(guint));
+        snap->bands = g_array_new(FALSE, FALSE, sizeof(guint));
+        snap->genres = g_array_new(FALSE, FALSE, sizeof(guint));
+        snap->mimes = g_array_new(FALSE, FALSE, sizeof(guint));
+        snap->order = g_array_new(FALSE, FALSE, sizeof(guint));
+
+        snap->strings = g_byte_array_new();
+        snap->values = g_ptr_array_new();
+        snap->value_ids = g_hash_table_new(NULL, NULL);
+        snap->rows = g_hash_table_new(NULL, NULL);
+
+        /* Dictionary id 0 is no value */
+        g_ptr_array_add(snap->values, NULL);
+
+        return snap;
+}
+
+static void _snapshot_free(gpointer p_snap)
+{
+        LibrarySnapshot *snap = p_snap;
+
+        g_array_unref(snap->ids);
+        g_array_unref(snap->tracks);
+        g_array_unref(snap->keys);
+        g_array_unref(snap->titles);
+        g_array_unref(snap->paths);
+        g_array_unref(snap->artists);
+        g_array_unref(snap->albums);
+        g_array_unref(snap->bands);
+        g_array_unref(snap->genres);
+        g_array_unref(snap->mimes);
+        g_array_unref(snap->order);
+
+        g_byte_array_unref(snap->strings);
+        g_ptr_array_unref(snap->values);
+        g_hash_table_unref(snap->value_ids);
+        g_hash_table_unref(snap->rows);
+        g_slice_free(LibrarySnapshot, snap);
+}
+
+static guint _snapshot_string(LibrarySnapshot *snap, const gchar *str)
+{
+        guint offset;
+
+        offset = snap->strings->len;
+        if (!str) {
+                str = "";
+        }
+        g_byte_array_append(snap->strings, (const guint8*)str, strlen(str) + 1);
+
+        return offset;
+}
+
+/**
+ * Dictionary id for a tag value. MediaInfo tags are interned, so
+ * pointers may be compared directly.
+ */
+static guint _snapshot_value(LibrarySnapshot *snap, const gchar *value)
+{
+        gpointer id;
+
+        if (!value) {
+                return 0;
+        }
+        id = g_hash_table_lookup(snap->value_ids, value);
+        if (id) {
+                return GPOINTER_TO_UINT(id);
+        }
+        g_ptr_array_add(snap->values, (gpointer)value);
+        g_hash_table_insert(snap->value_ids, (gpointer)value,
+                GUINT_TO_POINTER(snap->values->len - 1));
+
+        return snap->values->len - 1;
+}
+
+#define COLUMN(snap, name, type, row) g_array_index((snap)->name, type, (row))
+
+/**
+ * Add an item, or replace the row already holding it
+ */
+static void _snapshot_add(LibrarySnapshot *snap, MediaInfo *info)
+{
+        gpointer p_row;
+        guint row;
+        guint64 key;
+
+        if (g_hash_table_lookup_extended(snap->rows,
+                GINT_TO_POINTER(info->id), NULL, &p_row)) {
+                /* The old strings stay in the blob until a rebuild */
+                row = GPOINTER_TO_UINT(p_row);
+                snap->garbage++;
+                key = ((guint64)info->track_no << 32) | (guint32)info->id;
+                if (COLUMN(snap, keys, guint64, row) != key) {
+                        snap->sorted = FALSE;
+                }
+        } else {
+                row = snap->ids->len;
+                g_array_set_size(snap->ids, row + 1);
+                g_array_set_size(snap->tracks, row + 1);
+                g_array_set_size(snap->keys, row + 1);
+                g_array_set_size(snap->titles, row + 1);
+                g_array_set_size(snap->paths, row + 1);
+                g_array_set_size(snap->artists, row + 1);
+                g_array_set_size(snap->albums, row + 1);
+                g_array_set_size(snap->bands, row + 1);
+                g_array_set_size(snap->genres, row + 1);
+                g_array_set_size(snap->mimes, row + 1);
+                g_hash_table_insert(snap->rows, GINT_TO_POINTER(info->id),
+                        GUINT_TO_POINTER(row));
+                g_array_append_val(snap->order, row);
+                snap->sorted = FALSE;
+        }
+
+        key = ((guint64)info->track_no << 32) | (guint32)info->id;
+        COLUMN(snap, ids, gint, row) = info->id;
+        COLUMN(snap, tracks, guint, row) = info->track_no;
+        COLUMN(snap, keys, guint64, row) = key;
+        COLUMN(snap, titles, guint, row) = _snapshot_string(snap, info->title);
+        COLUMN(snap, paths, guint, row) = _snapshot_string(snap, info->path);
+        COLUMN(snap, artists, guint, row) = _snapshot_value(snap, info->artist);
+        COLUMN(snap, albums, guint, row) = _snapshot_value(snap, info->album);
+        COLUMN(snap, bands, guint, row) = _snapshot_value(snap, info->band);
+        COLUMN(snap, genres, guint, row) = _snapshot_value(snap, info->genre);
+        COLUMN(snap, mimes, guint, row) = _snapshot_value(snap, info->mime);
+}
+
+static void _snapshot_remove(LibrarySnapshot *snap, gint id)
+{
+        gpointer p_row;
+
+        if (!g_hash_table_lookup_extended(snap->rows, GINT_TO_POINTER(id),
+                NULL, &p_row)) {
+                return;
+        }
+        /* Dead rows are skipped, and dropped at the next rebuild */
+        COLUMN(snap, ids, gint, GPOINTER_TO_UINT(p_row)) = 0;
+        g_hash_table_remove(snap->rows, GINT_TO_POINTER(id));
+        snap->garbage++;
+}
+
+static gint _snapshot_key_cmp(gconstpointer a, gconstpointer b, gpointer userdata)
+{
+        GArray *keys = userdata;
+        guint64 key_a, key_b;
+
+        key_a = g_array_index(keys, guint64, *(const guint*)a);
+        key_b = g_array_index(keys, guint64, *(const guint*)b);
+
+        return key_a < key_b ? -1 : (key_a > key_b ? 1 : 0);
+}
+
+/**
+ * Order the rows by track then id, as the database lists them. Only
+ * needed after the keys change, which is rare once loaded.
+ */
+static void _snapshot_sort(LibrarySnapshot *snap)
+{
+        if (snap->sorted) {
+                return;
+        }
+        g_array_sort_with_data(snap->order, _snapshot_key_cmp, snap->keys);
+        snap->sorted = TRUE;
+}
+
+/**
+ * Whether value matches term, following SQLite's LIKE: ASCII letters
+ * are compared without case, EXACT compares bytes.
+ */
+static gboolean _library_match(const gchar *value,
+                               MatchQuery match,
+                               const gchar *term,
+                               gsize term_len)
+{
+        gsize len;
+        const gchar *c;
+
+        if (!value) {
+                return FALSE;
+        }
+        switch (match) {
+                case MATCH_QUERY_EXACT:
+                        return g_str_equal(value, term);
+                case MATCH_QUERY_START:
+                        return g_ascii_strncasecmp(value, term, term_len) == 0;
+                case MATCH_QUERY_END:
+                        len = strlen(value);
+                        return len >= term_len &&
+                                g_ascii_strcasecmp(value + len - term_len, term) == 0;
+                case MATCH_QUERY_ANYWHERE:
+                default:
+                        for (c = value; *c; c++) {
+                                if (g_ascii_strncasecmp(c, term, term_len) == 0) {
+                                        return TRUE;
+                                }
+                        }
+                        return term_len == 0;
+        }
+}
+
+/* Cache */
+
+/**
+ * Flatten the live rows into the cache format, compacting the strings
+ * on the way. The serial and digest are filled in by the writer.
+ */
+static GByteArray* _snapshot_serialize(LibrarySnapshot *snap)
+{
+        LibraryCacheHeader *header;
+        GArray *columns[LIBRARY_CACHE_COLUMNS];
+        GArray *live, *titles, *paths;
+        GByteArray *strings, *data;
+        const gchar *blob, *str;
+        guint32 *offsets, *out;
+        guint64 *keys;
+        guint i, c, row, n_rows;
+        gsize size;
+
+        _snapshot_sort(snap);
+
+        live = g_array_new(FALSE, FALSE, sizeof(guint));
+        for (i = 0; i < snap->order->len; i++) {
+                row = g_array_index(snap->order, guint, i);
+                if (COLUMN(snap, ids, gint, row) != 0) {
+                        g_array_append_val(live, row);
+                }
+        }
+        n_rows = live->len;
+
+        /* Only the strings still referenced are kept */
+        blob = (const gchar*)snap->strings->data;
+        strings = g_byte_array_new();
+        titles = g_array_sized_new(FALSE, FALSE, sizeof(guint32), n_rows);
+        paths = g_array_sized_new(FALSE, FALSE, sizeof(guint32), n_rows);
+        for (i = 0; i < n_rows; i++) {
+                row = g_array_index(live, guint, i);
+                c = strings->len;
+                str = blob + COLUMN(snap, titles, guint, row);
+                g_byte_array_append(strings, (const guint8*)str, strlen(str) + 1);
+                g_array_append_val(titles, c);
+                c = strings->len;
+                str = blob + COLUMN(snap, paths, guint, row);
+                g_byte_array_append(strings, (const guint8*)str, strlen(str) + 1);
+                g_array_append_val(paths, c);
+        }
+
+        size = sizeof(LibraryCacheHeader) + n_rows * sizeof(guint64) +
+                (gsize)n_rows * LIBRARY_CACHE_COLUMNS * sizeof(guint32) +
+                snap->values->len * sizeof(guint32);
+        data = g_byte_array_sized_new(size + strings->len);
+        g_byte_array_set_size(data, size);
+
+        header = (LibraryCacheHeader*)data->data;
+        memset(header, 0, sizeof(LibraryCacheHeader));
+        memcpy(header->magic, LIBRARY_CACHE_MAGIC, sizeof(header->magic));
+        header->version = LIBRARY_CACHE_VERSION;
+        header->n_rows = n_rows;
+        header->n_values = snap->values->len;
+
+        keys = (guint64*)(data->data + sizeof(LibraryCacheHeader));
+        for (i = 0; i < n_rows; i++) {
+                keys[i] = COLUMN(snap, keys, guint64, g_array_index(live, guint, i));
+        }
+
+        /* Columns are written in key order. The compacted titles and
+         * paths are already in that order, the rest are by row. */
+        columns[0] = snap->ids;
+        columns[1] = snap->tracks;
+        columns[2] = titles;
+        columns[3] = paths;
+        columns[4] = snap->artists;
+        columns[5] = snap->albums;
+        columns[6] = snap->bands;
+        columns[7] = snap->genres;
+        columns[8] = snap->mimes;
+        out = (guint32*)(keys + n_rows);
+        for (c = 0; c < LIBRARY_CACHE_COLUMNS; c++) {
+                for (i = 0; i < n_rows; i++) {
+                        row = c == 2 || c == 3 ? i : g_array_index(live, guint, i);
+                        out[i] = g_array_index(columns[c], guint32, row);
+                }
+                out += n_rows;
+        }
+
+        /* Dictionary values follow the row strings, 0 has no value */
+        offsets = out;
+        offsets[0] = G_MAXUINT32;
+        for (i = 1; i < snap->values->len; i++) {
+                offsets[i] = strings->len;
+                str = snap->values->pdata[i];
+                g_byte_array_append(strings, (const guint8*)str, strlen(str) + 1);
+        }
+        header->strings_len = strings->len;
+        g_byte_array_append(data, strings->data, strings->len);
+
+        g_byte_array_unref(strings);
+        g_array_unref(titles);
+        g_array_unref(paths);
+        g_array_unref(live);
+
+        return data;
+}
+
+/**
+ * Read the cache and rebuild a snapshot from it, if it was written at
+ * the given serial and is intact. Returns NULL otherwise.
+ */
+static LibrarySnapshot* _snapshot_load(const gchar *path, gint64 serial)
+{
+        LibraryCacheHeader header;
+        LibrarySnapshot *snap = NULL;
+        GMappedFile *file;
+        GChecksum *checksum;
+        guint8 digest[16];
+        gsize digest_len = sizeof(digest);
+        const gchar *data, *strings, *value;
+        const guint64 *keys;
+        const guint32 *columns, *offsets;
+        guint64 size;
+        guint32 n, i, c, row, limit;
+
+        if (serial < 0) {
+                return NULL;
+        }
+        file = g_mapped_file_new(path, FALSE, NULL);
+        if (!file) {
+                return NULL;
+        }
+        data = g_mapped_file_get_contents(file);
+        size = g_mapped_file_get_length(file);
+
+        if (size < sizeof(header)) {
+                goto bad;
+        }
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, LIBRARY_CACHE_MAGIC, sizeof(header.magic)) != 0) {
+                goto bad;
+        }
+        if (header.version != LIBRARY_CACHE_VERSION || header.serial != serial) {
+                /* Another format, or written before the latest changes */
+                goto end;
+        }
+        n = header.n_rows;
+        if (size != sizeof(header) + (guint64)n * sizeof(guint64) +
+            (guint64)n * LIBRARY_CACHE_COLUMNS * sizeof(guint32) +
+            (guint64)header.n_values * sizeof(guint32) + header.strings_len ||
+            header.n_values == 0 || header.strings_len == 0 ||
+            data[size - 1] != '\0') {
+                goto bad;
+        }
+
+        checksum = g_checksum_new(G_CHECKSUM_MD5);
+        g_checksum_update(checksum, (const guchar*)data + sizeof(header),
+                size - sizeof(header));
+        g_checksum_get_digest(checksum, digest, &digest_len);
+        g_checksum_free(checksum);
+        if (memcmp(digest, header.digest, sizeof(digest)) != 0) {
+                goto bad;
+        }
+
+        keys = (const guint64*)(data + sizeof(header));
+        columns = (const guint32*)(keys + n);
+        offsets = columns + (gsize)n * LIBRARY_CACHE_COLUMNS;
+        strings = (const gchar*)(offsets + header.n_values);
+
+        /* String offsets and dictionary ids must stay in bounds */
+        for (c = 2; c < LIBRARY_CACHE_COLUMNS; c++) {
+                limit = c < 4 ? header.strings_len : header.n_values;
+                for (i = 0; i < n; i++) {
+                        if (columns[c * n + i] >= limit) {
+                                goto bad;
+                        }
+                }
+        }
+        for (i = 1; i < header.n_values; i++) {
+                if (offsets[i] >= header.strings_len) {
+                        goto bad;
+                }
+        }
+
+        snap = _snapshot_new();
+        for (i = 1; i < header.n_values; i++) {
+                value = g_intern_string(strings + offsets[i]);
+                g_ptr_array_add(snap->values, (gpointer)value);
+                g_hash_table_insert(snap->value_ids, (gpointer)value,
+                        GUINT_TO_POINTER(i));
+        }
+
+        g_array_append_vals(snap->keys, keys, n);
+        g_array_append_vals(snap->ids, columns, n);
+        g_array_append_vals(snap->tracks, columns + n, n);
+        g_array_append_vals(snap->titles, columns + 2 * n, n);
+        g_array_append_vals(snap->paths, columns + 3 * n, n);
+        g_array_append_vals(snap->artists, columns + 4 * n, n);
+        g_array_append_vals(snap->albums, columns + 5 * n, n);
+        g_array_append_vals(snap->bands, columns + 6 * n, n);
+        g_array_append_vals(snap->genres, columns + 7 * n, n);
+        g_array_append_vals(snap->mimes, columns + 8 * n, n);
+        g_byte_array_append(snap->strings, (const guint8*)strings,
+                header.strings_len);
+
+        for (row = 0; row < n; row++) {
+                g_hash_table_insert(snap->rows,
+                        GINT_TO_POINTER(COLUMN(snap, ids, gint, row)),
+                        GUINT_TO_POINTER(row));
+                g_array_append_val(snap->order, row);
+        }
+        snap->sorted = TRUE;
+        snap->cached = TRUE;
+        goto end;
+
+bad:
+        g_warning("Ignoring damaged library cache: %s", path);
+end:
+        g_mapped_file_unref(file);
+        return snap;
+}
+
+/* Initialisation */
+static void budgie_library_class_init(BudgieLibraryClass *klass)
+{
+        GObjectClass *g_object_class;
+
+        g_object_class = G_OBJECT_CLASS(klass);
+        g_object_class->dispose = &budgie_library_dispose;
+
+        g_signal_new("changed",
+                G_TYPE_FROM_CLASS(klass), G_SIGNAL_RUN_FIRST,
+                0, NULL, NULL, NULL, G_TYPE_NONE, 0);
+}
+
+static void budgie_library_init(BudgieLibrary *self)
+{
+        self->priv = budgie_library_get_instance_private(self);
+
+        self->priv->pending = g_hash_table_new(NULL, NULL);
+        self->priv->dropped = g_hash_table_new(NULL, NULL);
+        self->priv->cache_path = g_strdup_printf("%s/%s",
+                g_get_user_cache_dir(), LIBRARY_CACHE_NAME);
+}
+
+static void budgie_library_dispose(GObject *object)
+{
+        BudgieLibrary *self;
+
+        self = BUDGIE_LIBRARY(object);
+
+        if (self->priv->save_id > 0) {
+                g_source_remove(self->priv->save_id);
+                self->priv->save_id = 0;
+        }
+        if (self->priv->cancellable) {
+                g_cancellable_cancel(self->priv->cancellable);
+                g_object_unref(self->priv->cancellable);
+                self->priv->cancellable = NULL;
+        }
+        if (self->priv->db) {
+                g_signal_handlers_disconnect_by_data(self->priv->db, self);
+                g_object_unref(self->priv->db);
+                self->priv->db = NULL;
+        }
+        if (self->priv->snapshot) {
+                _snapshot_free(self->priv->snapshot);
+                self->priv->snapshot = NULL;
+        }
+        g_clear_pointer(&self->priv->pending, g_hash_table_unref);
+        g_clear_pointer(&self->priv->dropped, g_hash_table_unref);
+        g_clear_pointer(&self->priv->cache_path, g_free);
+
+        /* Destruct */
+        G_OBJECT_CLASS (budgie_library_parent_class)->dispose (object);
+}
+
+/* Jobs */
+static void library_job_free(gpointer p_job)
+{
+        LibraryJob *job = p_job;
+
+        g_object_unref(job->db);
+        if (job->ids) {
+                g_array_unref(job->ids);
+        }
+        if (job->data) {
+                g_byte_array_unref(job->data);
+        }
+        g_free(job->path);
+        g_slice_free(LibraryJob, job);
+}
+
+static void _library_load_thread(GTask *task,
+                                 gpointer source,
+                                 gpointer task_data,
+                                 GCancellable *cancellable)
+{
+        LibraryJob *job = task_data;
+        LibrarySnapshot *snap;
+        BudgieDBCursor *cursor;
+        GPtrArray *page;
+        guint fetched, i;
+
+        /* The serial is read before the cache, so a change racing the
+         * load can only make the cache look stale, never current */
+        snap = _snapshot_load(job->path, budgie_db_get_serial(job->db));
+        if (snap) {
+                g_task_return_pointer(task, snap, _snapshot_free);
+                return;
+        }
+
+        snap = _snapshot_new();
+        page = g_ptr_array_new_with_free_func(media_info_unref);
+
+        /* Rows arrive by track then id, so the order starts out sorted */
+        cursor = budgie_db_cursor_open(job->db, MEDIA_QUERY_TITLE,
+                MATCH_QUERY_EXACT, NULL);
+        do {
+                fetched = budgie_db_cursor_fetch(cursor, LIBRARY_LOAD_PAGE,
+                        page);
+                for (i = 0; i < page->len; i++) {
+                        _snapshot_add(snap, page->pdata[i]);
+                }
+                g_ptr_array_set_size(page, 0);
+        } while (fetched == LIBRARY_LOAD_PAGE &&
+                 !g_cancellable_is_cancelled(cancellable));
+        budgie_db_cursor_close(cursor);
+        g_ptr_array_unref(page);
+
+        if (g_task_return_error_if_cancelled(task)) {
+                _snapshot_free(snap);
+                return;
+        }
+        snap->sorted = TRUE;
+        g_task_return_pointer(task, snap, _snapshot_free);
+}
+
+static void _library_fetch_thread(GTask *task,
+                                  gpointer source,
+                                  gpointer task_data,
+                                  GCancellable *cancellable)
+{
+        LibraryJob *job = task_data;
+        GPtrArray *infos;
+
+        infos = budgie_db_get_media_ids(job->db, job->ids);
+        if (g_task_return_error_if_cancelled(task)) {
+                g_ptr_array_unref(infos);
+                return;
+        }
+        g_task_return_pointer(task, infos, (GDestroyNotify)g_ptr_array_unref);
+}
+
+static void _library_save_thread(GTask *task,
+                                 gpointer source,
+                                 gpointer task_data,
+                                 GCancellable *cancellable)
+{
+        LibraryJob *job = task_data;
+        LibraryCacheHeader *header;
+        GChecksum *checksum;
+        GError *error = NULL;
+        gchar *dir, *tmp;
+        gsize digest_len;
+
+        header = (LibraryCacheHeader*)job->data->data;
+        header->serial = job->serial;
+
+        checksum = g_checksum_new(G_CHECKSUM_MD5);
+        g_checksum_update(checksum, job->data->data + sizeof(LibraryCacheHeader),
+                job->data->len - sizeof(LibraryCacheHeader));
+        digest_len = sizeof(header->digest);
+        g_checksum_get_digest(checksum, header->digest, &digest_len);
+        g_checksum_free(checksum);
+
+        dir = g_path_get_dirname(job->path);
+        g_mkdir_with_parents(dir, 0700);
+        g_free(dir);
+
+        /* Written aside, and only put in place if still current */
+        tmp = g_strdup_printf("%s.new", job->path);
+        if (!g_file_set_contents(tmp, (const gchar*)job->data->data,
+                job->data->len, &error)) {
+                g_warning("Unable to write the library cache: %s",
+                        error->message);
+                g_error_free(error);
+                g_free(tmp);
+                g_task_return_boolean(task, FALSE);
+                return;
+        }
+        g_free(tmp);
+        g_task_return_boolean(task, TRUE);
+}
+
+static void _library_saved_cb(GObject *source,
+                              GAsyncResult *result,
+                              gpointer userdata)
+{
+        BudgieLibrary *self;
+        LibraryJob *job;
+        GError *error = NULL;
+        gchar *tmp;
+        gboolean saved;
+
+        job = g_task_get_task_data(G_TASK(result));
+        tmp = g_strdup_printf("%s.new", job->path);
+        saved = g_task_propagate_boolean(G_TASK(result), &error);
+        if (error) {
+                /* Cancelled, we're being disposed */
+                g_error_free(error);
+                g_unlink(tmp);
+                g_free(tmp);
+                return;
+        }
+
+        self = BUDGIE_LIBRARY(source);
+        g_clear_object(&self->priv->cancellable);
+
+        /* Removals went straight into the snapshot */
+        g_hash_table_remove_all(self->priv->dropped);
+
+        /* The file matches its serial either way, but one already behind
+         * the snapshot would only be replaced again shortly */
+        if (saved && job->changes == self->priv->changes) {
+                if (g_rename(tmp, job->path) != 0) {
+                        g_warning("Unable to replace the library cache: %s",
+                                job->path);
+                        g_unlink(tmp);
+                }
+        } else if (saved) {
+                g_unlink(tmp);
+        }
+        g_free(tmp);
+
+        _library_sync(self);
+}
+
+static gboolean _library_save_cb(gpointer userdata)
+{
+        BudgieLibrary *self;
+        LibraryJob *job;
+        GTask *task;
+
+        self = BUDGIE_LIBRARY(userdata);
+        self->priv->save_id = 0;
+
+        /* Wait until the snapshot has caught up */
+        if (self->priv->cancellable ||
+            g_hash_table_size(self->priv->pending) > 0) {
+                _library_changed(self);
+                return FALSE;
+        }
+
+        job = g_slice_new0(LibraryJob);
+        job->db = g_object_ref(self->priv->db);
+        job->path = g_strdup(self->priv->cache_path);
+        job->data = _snapshot_serialize(self->priv->snapshot);
+        job->changes = self->priv->changes;
+        /* Nothing is pending, so the snapshot holds every change
+         * signalled so far, and no more */
+        job->serial = budgie_db_get_emitted_serial(self->priv->db);
+
+        self->priv->cancellable = g_cancellable_new();
+        task = g_task_new(self, self->priv->cancellable,
+                _library_saved_cb, NULL);
+        g_task_set_task_data(task, job, library_job_free);
+        g_task_run_in_thread(task, _library_save_thread);
+        g_object_unref(task);
+
+        return FALSE;
+}
+
+/**
+ * The snapshot changed, let the views know, and rewrite the cache
+ * once things settle
+ */
+static void _library_changed(BudgieLibrary *self)
+{
+        if (self->priv->save_id > 0) {
+                g_source_remove(self->priv->save_id);
+        }
+        self->priv->save_id = g_timeout_add_seconds(LIBRARY_SAVE_DELAY,
+                _library_save_cb, self);
+}
+
+/**
+ * Removals seen while a job ran, applied once its results are in
+ */
+static void _library_drop(BudgieLibrary *self)
+{
+        GHashTableIter iter;
+        gpointer id;
+
+        g_hash_table_iter_init(&iter, self->priv->dropped);
+        while (g_hash_table_iter_next(&iter, &id, NULL)) {
+                _snapshot_remove(self->priv->snapshot, GPOINTER_TO_INT(id));
+        }
+        g_hash_table_remove_all(self->priv->dropped);
+}
+
+static void _library_loaded_cb(GObject *source,
+                               GAsyncResult *result,
+                               gpointer userdata)
+{
+        BudgieLibrary *self;
+        LibrarySnapshot *snap;
+
+        snap = g_task_propagate_pointer(G_TASK(result), NULL);
+        if (!snap) {
+                /* Cancelled, we're being disposed */
+                return;
+        }
+
+        self = BUDGIE_LIBRARY(source);
+        g_clear_object(&self->priv->cancellable);
+
+        if (self->priv->snapshot) {
+                _snapshot_free(self->priv->snapshot);
+        }
+        self->priv->snapshot = snap;
+        _library_drop(self);
+        if (!snap->cached) {
+                _library_changed(self);
+        }
+        g_signal_emit_by_name(self, "changed");
+
+        _library_sync(self);
+}
+
+static void _library_fetched_cb(GObject *source,
+                                GAsyncResult *result,
+                                gpointer userdata)
+{
+        BudgieLibrary *self;
+        LibrarySnapshot *snap;
+        GPtrArray *infos;
+        MediaInfo *info;
+        gpointer id;
+        guint i;
+
+        infos = g_task_propagate_pointer(G_TASK(result), NULL);
+        if (!infos) {
+                /* Cancelled, we're being disposed */
+                return;
+        }
+
+        self = BUDGIE_LIBRARY(source);
+        g_clear_object(&self->priv->cancellable);
+
+        snap = self->priv->snapshot;
+        for (i = 0; i < infos->len; i++) {
+                info = infos->pdata[i];
+                id = GINT_TO_POINTER(info->id);
+                /* Read before it was removed, unless it's since returned */
+                if (g_hash_table_contains(self->priv->dropped, id) &&
+                    !g_hash_table_contains(self->priv->pending, id)) {
+                        continue;
+                }
+                _snapshot_add(snap, info);
+        }
+        g_hash_table_remove_all(self->priv->dropped);
+        g_ptr_array_unref(infos);
+
+        /* Compact once half of the snapshot is dead weight */
+        if (snap->garbage > snap->ids->len / 2) {
+                self->priv->reload = TRUE;
+        }
+        _library_changed(self);
+        g_signal_emit_by_name(self, "changed");
+
+        _library_sync(self);
+}
+
+/**
+ * Start the next job, if one is needed and none is running
+ */
+static void _library_sync(BudgieLibrary *self)
+{
+        GHashTableIter iter;
+        LibraryJob *job;
+        GTask *task;
+        gpointer id;
+        gint item;
+
+        if (self->priv->cancellable) {
+                return;
+        }
+
+        job = g_slice_new0(LibraryJob);
+        job->db = g_object_ref(self->priv->db);
+
+        if (!self->priv->snapshot || self->priv->reload) {
+                /* The load sees everything pending so far */
+                self->priv->reload = FALSE;
+                g_hash_table_remove_all(self->priv->pending);
+
+                job->path = g_strdup(self->priv->cache_path);
+                self->priv->cancellable = g_cancellable_new();
+                task = g_task_new(self, self->priv->cancellable,
+                        _library_loaded_cb, NULL);
+                g_task_set_task_data(task, job, library_job_free);
+                g_task_run_in_thread(task, _library_load_thread);
+                g_object_unref(task);
+                return;
+        }
+
+        if (g_hash_table_size(self->priv->pending) == 0) {
+                library_job_free(job);
+                return;
+        }
+
+        job->ids = g_array_sized_new(FALSE, FALSE, sizeof(gint),
+                g_hash_table_size(self->priv->pending));
+        g_hash_table_iter_init(&iter, self->priv->pending);
+        while (g_hash_table_iter_next(&iter, &id, NULL)) {
+                item = GPOINTER_TO_INT(id);
+                g_array_append_val(job->ids, item);
+        }
+        g_hash_table_remove_all(self->priv->pending);
+
+        self->priv->cancellable = g_cancellable_new();
+        task = g_task_new(self, self->priv->cancellable,
+                _library_fetched_cb, NULL);
+        g_task_set_task_data(task, job, library_job_free);
+        g_task_run_in_thread(task, _library_fetch_thread);
+        g_object_unref(task);
+}
+
+/* Database changes */
+static void items_changed_cb(BudgieDB *db, GArray *ids, gpointer userdata)
+{
+        BudgieLibrary *self;
+        guint i;
+
+        self = BUDGIE_LIBRARY(userdata);
+        self->priv->changes++;
+        for (i = 0; i < ids->len; i++) {
+                g_hash_table_add(self->priv->pending,
+                        GINT_TO_POINTER(g_array_index(ids, gint, i)));
+        }
+        _library_sync(self);
+}
+
+static void items_removed_cb(BudgieDB *db, GArray *ids, gpointer userdata)
+{
+        BudgieLibrary *self;
+        LibrarySnapshot *snap;
+        gpointer id;
+        guint i;
+
+        self = BUDGIE_LIBRARY(userdata);
+        self->priv->changes++;
+        snap = self->priv->snapshot;
+        for (i = 0; i < ids->len; i++) {
+                id = GINT_TO_POINTER(g_array_index(ids, gint, i));
+                g_hash_table_remove(self->priv->pending, id);
+                if (self->priv->cancellable) {
+                        g_hash_table_add(self->priv->dropped, id);
+                }
+                if (snap) {
+                        _snapshot_remove(snap, GPOINTER_TO_INT(id));
+                }
+        }
+
+        if (!snap) {
+                return;
+        }
+        _library_changed(self);
+        g_signal_emit_by_name(self, "changed");
+
+        if (snap->garbage > snap->ids->len / 2) {
+                self->priv->reload = TRUE;
+                _library_sync(self);
+        }
+}
+
+/* API */
+BudgieLibrary* budgie_library_new(BudgieDB *db)
+{
+        BudgieLibrary *self;
+
+        g_return_val_if_fail(db != NULL, NULL);
+
+        self = g_object_new(BUDGIE_LIBRARY_TYPE, NULL);
+        self->priv->db = g_object_ref(db);
+        g_signal_connect(db, "items-added",
+                G_CALLBACK(items_changed_cb), self);
+        g_signal_connect(db, "items-changed",
+                G_CALLBACK(items_changed_cb), self);
+        g_signal_connect(db, "items-removed",
+                G_CALLBACK(items_removed_cb), self);
+
+        _library_sync(self);
+
+        return self;
+}
+
+gboolean budgie_library_is_loaded(BudgieLibrary *self)
+{
+        g_return_val_if_fail(self != NULL, FALSE);
+
+        return self->priv->snapshot != NULL;
+}
+
+GArray* budgie_library_filter(BudgieLibrary *self,
+                              MediaQuery query,
+                              MatchQuery match,
+                              const gchar *term)
+{
+        LibrarySnapshot *snap;
+        GArray *ids, *column = NULL;
+        guint8 *hits = NULL;
+        gsize term_len = 0;
+        guint i, row;
+        gint id;
+
+        g_return_val_if_fail(self != NULL, NULL);
+        g_return_val_if_fail(query >= 0 && query < MEDIA_QUERY_MAX, NULL);
+        g_return_val_if_fail(match >= 0 && match < MATCH_QUERY_MAX, NULL);
+
+        snap = self->priv->snapshot;
+        if (!snap) {
+                return NULL;
+        }
+        _snapshot_sort(snap);
+
+        switch (query) {
+                case MEDIA_QUERY_ARTIST:
+                        column = snap->artists;
+                        break;
+                case MEDIA_QUERY_ALBUM:
+                        column = snap->albums;
+                        break;
+                case MEDIA_QUERY_GENRE:
+                        column = snap->genres;
+                        break;
+                case MEDIA_QUERY_MIME:
+                        column = snap->mimes;
+                        break;
+                default:
+                        /* Titles are per row, and matched as we go */
+                        break;
+        }
+
+        /* Tag values repeat across many rows, so match each only once */
+        if (term) {
+                term_len = strlen(term);
+        }
+        if (term && column) {
+                hits = g_malloc0(snap->values->len);
+                for (i = 1; i < snap->values->len; i++) {
+                        hits[i] = _library_match(snap->values->pdata[i],
+                                match, term, term_len);
+                }
+        }
+
+        ids = g_array_new(FALSE, FALSE, sizeof(gint));
+        for (i = 0; i < snap->order->len; i++) {
+                row = g_array_index(snap->order, guint, i);
+                id = COLUMN(snap, ids, gint, row);
+                if (id == 0) {
+                        continue;
+                }
+                if (hits && !hits[g_array_index(column, guint, row)]) {
+                        continue;
+                }
+                if (term && !column && !_library_match(
+                    (const gchar*)snap->strings->data + COLUMN(snap, titles, guint, row),
+                    match, term, term_len)) {
+                        continue;
+                }
+                g_array_append_val(ids, id);
+        }
+        g_free(hits);
+
+        return ids;
+}
+
+MediaInfo* budgie_library_get_info(BudgieLibrary *self, gint id)
+{
+        LibrarySnapshot *snap;
+        MediaInfo *info;
+        const gchar *strings;
+        gpointer p_row;
+        guint row;
+
+        g_return_val_if_fail(self != NULL, NULL);
+
+        snap = self->priv->snapshot;
+        if (!snap || !g_hash_table_lookup_extended(snap->rows,
+                GINT_TO_POINTER(id), NULL, &p_row)) {
+                return NULL;
+        }
+        row = GPOINTER_TO_UINT(p_row);
+        strings = (const gchar*)snap->strings->data;
+
+        info = media_info_new();
+        info->id = id;
+        info->track_no = COLUMN(snap, tracks, guint, row);
+        info->title = g_strdup(strings + COLUMN(snap, titles, guint, row));
+        info->path = g_strdup(strings + COLUMN(snap, paths, guint, row));
+        info->artist = snap->values->pdata[COLUMN(snap, artists, guint, row)];
+        info->album = snap->values->pdata[COLUMN(snap, albums, guint, row)];
+        info->band = snap->values->pdata[COLUMN(snap, bands, guint, row)];
+        info->genre = snap->values->pdata[COLUMN(snap, genres, guint, row)];
+        info->mime = snap->values->pdata[COLUMN(snap, mimes, guint, row)];
+
+        return info;
+}
+
+static gint _library_album_compare(gconstpointer a, gconstpointer b)
+{
+        return strcmp(((const AlbumInfo*)a)->album,
+                ((const AlbumInfo*)b)->album);
+}
+
+GArray* budgie_library_get_albums(BudgieLibrary *self)
+{
+        LibrarySnapshot *snap;
+        GHashTable *index;
+        GArray *albums;
+        AlbumInfo info, *album;
+        gpointer p_index;
+        guint i, row, value;
+
+        g_return_val_if_fail(self != NULL, NULL);
+
+        snap = self->priv->snapshot;
+        if (!snap) {
+                return NULL;
+        }
+        _snapshot_sort(snap);
+
+        /* Walking in key order, the first row seen is the first track */
+        index = g_hash_table_new(NULL, NULL);
+        albums = g_array_new(FALSE, FALSE, sizeof(AlbumInfo));
+        for (i = 0; i < snap->order->len; i++) {
+                row = g_array_index(snap->order, guint, i);
+                value = COLUMN(snap, albums, guint, row);
+                if (COLUMN(snap, ids, gint, row) == 0 || value == 0 ||
+                    *(const gchar*)snap->values->pdata[value] == '\0') {
+                        continue;
+                }
+                if (g_hash_table_lookup_extended(index, GUINT_TO_POINTER(value),
+                        NULL, &p_index)) {
+                        album = &g_array_index(albums, AlbumInfo,
+                                GPOINTER_TO_UINT(p_index));
+                        album->n_tracks++;
+                        continue;
+                }
+                info.album = snap->values->pdata[value];
+                info.artist = snap->values->pdata[COLUMN(snap, artists, guint, row)];
+                info.band = snap->values->pdata[COLUMN(snap, bands, guint, row)];
+                info.n_tracks = 1;
+                g_hash_table_insert(index, GUINT_TO_POINTER(value),
+                        GUINT_TO_POINTER(albums->len));
+                g_array_append_val(albums, info);
+        }
+        g_hash_table_unref(index);
+        g_array_sort(albums, _library_album_compare);
+
+        return albums;
+}
@@ -0,0 +1,117 @@
+/*
+ * budgie-library.h
+ * 
+ * Copyright 2013 Ikey Doherty <ikey.doherty@gmail.com>
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ * 
+ * 
+ */
+#ifndef budgie_library_h
+#define budgie_library_h
+
+#include <glib-object.h>
+
+#include "budgie-db.h"
+
+typedef struct _BudgieLibrary BudgieLibrary;
+typedef struct _BudgieLibraryClass   BudgieLibraryClass;
+typedef struct _BudgieLibraryPrivate BudgieLibraryPrivate;
+
+#define BUDGIE_LIBRARY_TYPE (budgie_library_get_type())
+#define BUDGIE_LIBRARY(obj)                  (G_TYPE_CHECK_INSTANCE_CAST ((obj), BUDGIE_LIBRARY_TYPE, BudgieLibrary))
+#define IS_BUDGIE_LIBRARY(obj)               (G_TYPE_CHECK_INSTANCE_TYPE ((obj), BUDGIE_LIBRARY_TYPE))
+#define BUDGIE_LIBRARY_CLASS(klass)          (G_TYPE_CHECK_CLASS_CAST ((klass), BUDGIE_LIBRARY_TYPE, BudgieLibraryClass))
+#define IS_BUDGIE_LIBRARY_CLASS(klass)       (G_TYPE_CHECK_CLASS_TYPE ((klass), BUDGIE_LIBRARY_TYPE))
+#define BUDGIE_LIBRARY_GET_CLASS(obj)        (G_TYPE_INSTANCE_GET_CLASS ((obj), BUDGIE_LIBRARY_TYPE, BudgieLibraryClass))
+
+/* BudgieLibrary object */
+struct _BudgieLibrary {
+        GObject parent;
+
+        BudgieLibraryPrivate *priv;
+};
+
+/* BudgieLibrary class definition */
+struct _BudgieLibraryClass {
+        GObjectClass parent_class;
+};
+
+GType budgie_library_get_type(void);
+
+/* BudgieLibrary methods */
+
+/**
+ * Construct a new BudgieLibrary
+ *
+ * The library is an in-memory snapshot of every item in the database,
+ * held as parallel columns so that listings can be filtered and sorted
+ * without going back to SQLite. It is built on a worker thread, then
+ * kept up to date from the database's change signals on the main loop.
+ * Until the first build completes, callers should query the database.
+ *
+ * The snapshot is written to the user's cache directory a few seconds
+ * after it settles, stamped with the database's change serial. At
+ * startup a cache with a matching serial is read in place of a full
+ * query of the database. The "changed" signal is emitted whenever the
+ * snapshot is loaded or updated.
+ *
+ * @param db Database to mirror
+ * @return A new BudgieLibrary
+ */
+BudgieLibrary* budgie_library_new(BudgieDB *db);
+
+/**
+ * Whether the snapshot has been built and may be queried
+ * @param self BudgieLibrary instance
+ * @return TRUE once loaded
+ */
+gboolean budgie_library_is_loaded(BudgieLibrary *self);
+
+/**
+ * Find items in the snapshot, with the same matching rules as
+ * budgie_db_search_field, ordered by track then id.
+ * @param self BudgieLibrary instance
+ * @param query The field to match
+ * @param match Type of match to perform
+ * @param term Term to search for, or NULL for every item
+ * @return a new array of gint item ids, or NULL if not yet loaded
+ */
+GArray* budgie_library_filter(BudgieLibrary *self,
+                              MediaQuery query,
+                              MatchQuery match,
+                              const gchar *term);
+
+/**
+ * Build media information for an item from the snapshot. File stamps
+ * and scan generations are not kept, so those fields are zero.
+ * You must release the result of this call using media_info_unref
+ * @param self BudgieLibrary instance
+ * @param id Item id, i.e. from budgie_library_filter
+ * @return a MediaInfo, or NULL if the item has since been removed
+ */
+MediaInfo* budgie_library_get_info(BudgieLibrary *self, gint id);
+
+/**
+ * Summarise the albums in the snapshot, as budgie_db_get_albums_async
+ * would, ordered by album name.
+ * The strings within each AlbumInfo are interned, and never freed.
+ * @param self BudgieLibrary instance
+ * @return a new GArray of AlbumInfo, or NULL if not yet loaded
+ */
+GArray* budgie_library_get_albums(BudgieLibrary *self);
+
+#endif /* budgie_library_h */
@@ -26,124 +26,11 @@
 
 #include "util.h"
 
-#include <taglib/tag_c.h>
-
 /* Unneeded constants but improve readability */
 #define MINUTE 60
 #define HOUR MINUTE*60
 
 
-/**
- * Using taglib we'll query the relevant tags.
- */
-static MediaInfo* media_from_file(gchar *path, GFileInfo *file_info, const gchar *file_mime)
-{
-        MediaInfo* media = NULL;
-        TagLib_File *tagfile = NULL;
-        TagLib_Tag *tag = NULL;
-        char *ktmp = NULL;
-
-        media = malloc(sizeof(MediaInfo));
-        memset(media, 0, sizeof(MediaInfo));
-
-        tagfile = taglib_file_new(path);
-        if (!tagfile) {
-                g_message("%s provides no tag information", path);
-                goto end;
-        }
-
-        tag = taglib_file_tag(tagfile);
-        if (!tag) {
-                goto clean;
-        }
-
-        /* Set fields from taglib */
-        media->track_no = taglib_tag_track(tag);
-
-        ktmp = taglib_tag_title(tag);
-        if (ktmp && strlen(ktmp) != 0) {
-                media->title = g_strdup(ktmp);
-        }
-        ktmp = taglib_tag_album(tag);
-        if (ktmp && strlen(ktmp) != 0) {
-                media->album = g_strdup(ktmp);
-        }
-        ktmp = taglib_tag_artist(tag);
-        if (ktmp && strlen(ktmp) != 0) {
-                media->artist = g_strdup(ktmp);
-        }
-        ktmp = taglib_tag_album(tag);
-        if (ktmp && strlen(ktmp) != 0) {
-                media->album = g_strdup(ktmp);
-        }
-        ktmp = taglib_tag_genre(tag);
-        if (ktmp && strlen(ktmp) != 0) {
-                media->genre = g_strdup(ktmp);
-        }
-
-        taglib_tag_free_strings();
-clean:
-        taglib_file_free(tagfile);
-end:
-
-        if (!media->title) {
-                media->title = g_strdup(g_file_info_get_display_name(file_info));
-        }
-        media->path = g_strdup(path);
-        media->mime = g_strdup(file_mime);
-
-        return media;
-}
-
-void search_directory(const gchar *path, GSList **list, int n_params, const gchar **mimes)
-{
-        GFile *file = NULL;
-        GFileInfo *next_file;
-        GFileType type;
-        GFileEnumerator *listing;
-        const gchar *next_path;
-        const gchar *file_mime;
-        gchar *full_path = NULL;
-        MediaInfo *media;
-        guint i;
-
-        file = g_file_new_for_path(path);
-        type = g_file_query_file_type(file, G_FILE_QUERY_INFO_NONE, NULL);
-        if (type == G_FILE_TYPE_DIRECTORY) {
-                /* Enumerate children (needs less query flags!) */
-                listing = g_file_enumerate_children(file, "standard::*", G_FILE_QUERY_INFO_NONE,
-                        NULL, NULL);
-
-                /* Lets go through them */
-                while ((next_file = g_file_enumerator_next_file(listing, NULL, NULL)) != NULL) {
-                        next_path = g_file_info_get_name(next_file);
-                        full_path = g_strdup_printf("%s/%s", path, next_path);
-
-                        /* Recurse if its a directory */
-                        if (g_file_info_get_file_type(next_file) == G_FILE_TYPE_DIRECTORY) {
-                                search_directory(full_path, list, n_params, mimes);
-                        } else {
-                                /* Not exactly a regex but it'll do for now */
-                                file_mime = g_file_info_get_content_type(next_file);
-                                for (i=0; i < n_params; i++) {
-                                        if (g_str_has_prefix(file_mime, mimes[i])) {
-                                                media = media_from_file(full_path, next_file, file_mime);
-                                                /* Probably switch to a new struct in the future */
-                                                *list = g_slist_append(*list, media);
-                                        }
-                                }
-                        }
-                        g_free(full_path);
-                        g_object_unref(next_file);
-                        full_path = NULL;
-                }
-                g_file_enumerator_close(listing, NULL, NULL);
-                g_object_unref(listing);
-        }
-
-        g_object_unref(file);
-}
-
 GtkWidget* new_button_with_icon(GtkIconTheme *theme,
                                 const gchar *icon_name,
                                 gboolean toolbar,
@@ -329,7 +216,7 @@ albumart_strip_invalid_entities (const gchar *original)
         return str;
 }
 
-gchar *cleaned_string(gchar *string)
+gchar *cleaned_string(const gchar *string)
 {
         gchar *stripped, *normalized, *lower;
 
@@ -366,3 +253,15 @@ gchar *albumart_name_for_media(MediaInfo *info, gchar *extension)
 
         return album_string;
 }
+
+GdkPixbuf *albumart_load(const gchar *path,
+                         gint width,
+                         gint height,
+                         gboolean preserve_aspect)
+{
+        if (!path) {
+                return NULL;
+        }
+        return gdk_pixbuf_new_from_file_at_scale(path, width, height,
+                preserve_aspect, NULL);
+}
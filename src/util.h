@@ -40,15 +40,6 @@ GtkWidget* new_button_with_icon(GtkIconTheme *theme,
                                 gboolean toggle,
                                 const gchar *description);
 
-/**
- * Search a directory for files, and populate the list
- * @param dir The directory to search
- * @param list A singly-linked list to populate with search results
- * @param n_params Number of following mime type prefixes
- * @param mimes Array of mime prefixes to find (i.e. audio/)
- */
-void search_directory(const gchar *dir, GSList **list, int n_params, const gchar **mimes);
-
 /**
  * Convert seconds into human readable time
  *
@@ -71,6 +62,23 @@ gchar *format_seconds(gint64 time, gboolean remaining);
  */
 gchar *albumart_name_for_media(MediaInfo *info, gchar *extension);
 
+/**
+ * Load album art at the size it will be shown. The image is decoded at
+ * that size where the format allows, i.e. JPEG scales while decoding,
+ * so a large cover never exists at full resolution in memory.
+ *
+ * @param path Path of the image
+ * @param width Width to load at
+ * @param height Height to load at
+ * @param preserve_aspect Whether to fit within width and height, rather
+ * than fill them
+ * @return a new GdkPixbuf, or NULL if the image couldn't be loaded
+ */
+GdkPixbuf *albumart_load(const gchar *path,
+                         gint width,
+                         gint height,
+                         gboolean preserve_aspect);
+
 /**
  * Following are taken from GNOME Wiki/Tracker code to ensure we stay
  * compatible in our mediaart spec
@@ -88,4 +96,4 @@ albumart_strip_invalid_entities (const gchar *original);
 /**
  * Utility of mine to clean the album string before processing
  */
-gchar *cleaned_string(gchar *string);
+gchar *cleaned_string(const gchar *string);
@@ -0,0 +1,271 @@
+/*
+ * art-decode.c
+ * 
+ * Copyright 2013 Ikey Doherty <ikey.doherty@gmail.com>
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ * 
+ * 
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <glib/gstdio.h>
+
+#include "util.h"
+
+/* The grid's cover and the track list header, see budgie-media-view.c */
+#define GRID_SIZE 150
+#define HEADER_SIZE 256
+
+/* A scaled decode may use at most this fraction of a full one's memory */
+#define MAX_FOOTPRINT 0.25
+
+/* Large covers, as found embedded and in album folders */
+typedef struct Cover {
+        gint width;
+        gint height;
+} Cover;
+
+static const Cover covers[] = {
+        { 3000, 3000 },
+        { 4000, 2500 },
+        { 2000, 3200 },
+        { 2400, 2400 }
+};
+
+/* What one decode cost */
+typedef struct Decode {
+        gsize bytes; /* gdk_pixbuf_get_byte_length of the result */
+        glong peak; /* Growth of ru_maxrss, in KiB */
+        gint64 time; /* Microseconds */
+} Decode;
+
+static gchar *cover_path(const gchar *dir, guint i)
+{
+        return g_strdup_printf("%s/cover-%u.jpeg", dir, i);
+}
+
+/**
+ * Write a JPEG with a gradient, so it doesn't compress to nothing
+ */
+static gboolean write_cover(const gchar *path, gint width, gint height)
+{
+        GdkPixbuf *pixbuf;
+        GError *error = NULL;
+        guchar *pixels, *p;
+        gint rowstride, x, y;
+        gboolean ret;
+
+        pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+        pixels = gdk_pixbuf_get_pixels(pixbuf);
+        rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+        for (y = 0; y < height; y++) {
+                p = pixels + y * rowstride;
+                for (x = 0; x < width; x++, p += 3) {
+                        p[0] = (guchar)x;
+                        p[1] = (guchar)y;
+                        p[2] = (guchar)(x ^ y);
+                }
+        }
+        ret = gdk_pixbuf_save(pixbuf, path, "jpeg", &error,
+                "quality", "90", NULL);
+        if (!ret) {
+                g_printerr("Unable to write %s: %s\n", path, error->message);
+                g_error_free(error);
+        }
+        g_object_unref(pixbuf);
+
+        return ret;
+}
+
+/**
+ * Write every cover, and a small one to warm up the JPEG loader. This
+ * runs in a child process, so that our own peak memory stays low.
+ */
+static gboolean make_covers(const gchar *dir)
+{
+        gchar *path;
+        gboolean ret;
+        gint status;
+        guint i;
+        pid_t pid;
+
+        pid = fork();
+        if (pid < 0) {
+                return FALSE;
+        }
+        if (pid > 0) {
+                return waitpid(pid, &status, 0) == pid &&
+                        WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        }
+
+        path = g_strdup_printf("%s/warm.jpeg", dir);
+        ret = write_cover(path, 16, 16);
+        g_free(path);
+        for (i = 0; ret && i < G_N_ELEMENTS(covers); i++) {
+                path = cover_path(dir, i);
+                ret = write_cover(path, covers[i].width, covers[i].height);
+                g_free(path);
+        }
+        _exit(ret ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static glong max_rss(void)
+{
+        struct rusage usage;
+
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+}
+
+/**
+ * Decode path in a child process, as albumart_load does for the view, or
+ * at full size if width is 0. A child's peak only counts the pages it
+ * touches itself, so its growth is what the decode cost. Fails if the
+ * image isn't within width and height.
+ */
+static gboolean decode(const gchar *path,
+                       gint width,
+                       gint height,
+                       gboolean preserve_aspect,
+                       Decode *result)
+{
+        GdkPixbuf *pixbuf;
+        Decode child;
+        glong before;
+        gint fds[2], status;
+        gboolean got;
+        pid_t pid;
+
+        if (pipe(fds) != 0) {
+                return FALSE;
+        }
+        pid = fork();
+        if (pid < 0) {
+                close(fds[0]);
+                close(fds[1]);
+                return FALSE;
+        }
+        if (pid > 0) {
+                close(fds[1]);
+                got = read(fds[0], result, sizeof(*result)) == sizeof(*result);
+                close(fds[0]);
+                if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+                        return FALSE;
+                }
+                return got && WEXITSTATUS(status) == 0;
+        }
+
+        close(fds[0]);
+        before = max_rss();
+        child.time = g_get_monotonic_time();
+        if (width > 0) {
+                pixbuf = albumart_load(path, width, height, preserve_aspect);
+        } else {
+                pixbuf = gdk_pixbuf_new_from_file(path, NULL);
+        }
+        child.time = g_get_monotonic_time() - child.time;
+        child.peak = max_rss() - before;
+        if (!pixbuf) {
+                g_printerr("Unable to load %s\n", path);
+                _exit(EXIT_FAILURE);
+        }
+        child.bytes = gdk_pixbuf_get_byte_length(pixbuf);
+        if (width > 0 && (gdk_pixbuf_get_width(pixbuf) > width ||
+                gdk_pixbuf_get_height(pixbuf) > height)) {
+                g_printerr("Asked for %dx%d, got %dx%d\n", width, height,
+                        gdk_pixbuf_get_width(pixbuf),
+                        gdk_pixbuf_get_height(pixbuf));
+                _exit(EXIT_FAILURE);
+        }
+        if (write(fds[1], &child, sizeof(child)) != sizeof(child)) {
+                _exit(EXIT_FAILURE);
+        }
+        _exit(EXIT_SUCCESS);
+}
+
+/**
+ * Whether a scaled decode stayed well clear of the full one's footprint
+ */
+static gboolean check_decode(const gchar *what,
+                             const Cover *cover,
+                             Decode *scaled,
+                             Decode *full)
+{
+        g_print("%dx%d at %s: %" G_GSIZE_FORMAT " bytes, peak +%ldKiB, %"
+                G_GINT64_FORMAT "us\n", cover->width, cover->height, what,
+                scaled->bytes, scaled->peak, scaled->time);
+        if (scaled->bytes > full->bytes * MAX_FOOTPRINT ||
+            scaled->peak > full->peak * MAX_FOOTPRINT) {
+                g_printerr("%dx%d at %s costs too much next to a full decode\n",
+                        cover->width, cover->height, what);
+                return FALSE;
+        }
+        return TRUE;
+}
+
+int main(int argc, char **argv)
+{
+        GdkPixbuf *warm;
+        Decode grid, header, full;
+        gchar *dir, *path;
+        gboolean made, ret = TRUE;
+        guint i;
+
+        dir = g_dir_make_tmp("budgie-check-XXXXXX", NULL);
+        if (!dir) {
+                return EXIT_FAILURE;
+        }
+        made = make_covers(dir);
+
+        /* Load the JPEG loader once here, so no decode pays for it */
+        path = g_strdup_printf("%s/warm.jpeg", dir);
+        warm = made ? gdk_pixbuf_new_from_file(path, NULL) : NULL;
+        if (warm) {
+                g_object_unref(warm);
+        }
+        g_unlink(path);
+        g_free(path);
+
+        for (i = 0; made && i < G_N_ELEMENTS(covers); i++) {
+                path = cover_path(dir, i);
+                if (!decode(path, 0, 0, FALSE, &full) ||
+                    !decode(path, GRID_SIZE, GRID_SIZE, FALSE, &grid) ||
+                    !decode(path, HEADER_SIZE, HEADER_SIZE, TRUE, &header)) {
+                        ret = FALSE;
+                } else {
+                        g_print("%dx%d at full size: %" G_GSIZE_FORMAT
+                                " bytes, peak +%ldKiB, %" G_GINT64_FORMAT "us\n",
+                                covers[i].width, covers[i].height,
+                                full.bytes, full.peak, full.time);
+                        ret &= check_decode("150x150", &covers[i], &grid, &full);
+                        ret &= check_decode("256x256", &covers[i], &header, &full);
+                }
+                g_unlink(path);
+                g_free(path);
+        }
+        g_rmdir(dir);
+        g_free(dir);
+
+        /* No JPEG saver means nothing was checked */
+        if (!made) {
+                return 77;
+        }
+        return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,297 @@
+/*
+ * query-plans.c
+ * 
+ * Copyright 2013 Ikey Doherty <ikey.doherty@gmail.com>
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ * 
+ * 
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include "db/budgie-db.h"
+
+/* A statement BudgieDB should run, found by part of its SQL, and what
+ * its plan must and must not mention */
+typedef struct PlanCheck {
+        const gchar *sql;
+        const gchar *expected;
+        const gchar *unexpected;
+} PlanCheck;
+
+static const PlanCheck checks[] = {
+        /* Full listing, in index order */
+        { "SELECT * FROM items ORDER BY track ASC",
+          "SCAN t USING INDEX tracks_track", "TEMP B-TREE" },
+        /* Cursor pages carry on from the last (track, id) fetched */
+        { "SELECT * FROM items WHERE (track, ID) > (?2, ?3)",
+          "SEARCH t USING INDEX tracks_track (track>?)", "TEMP B-TREE" },
+        { "WHERE album == ?1 AND (track, ID) > (?2, ?3)",
+          "SEARCH t USING INDEX tracks_album (album=? AND track>?)", "TEMP B-TREE" },
+        /* Exact field lookups, in index order */
+        { "WHERE album == ? ORDER BY",
+          "SEARCH t USING INDEX tracks_album", "TEMP B-TREE" },
+        { "WHERE artist == ? ORDER BY",
+          "SEARCH t USING INDEX tracks_artist", "TEMP B-TREE" },
+        { "WHERE genre == ? ORDER BY",
+          "SEARCH t USING INDEX tracks_genre", "TEMP B-TREE" },
+        /* Prefix match on the mimetype is a range of its index. The range
+         * isn't in track order, so this one does sort. */
+        { "WHERE mimetype LIKE ? ESCAPE",
+          "SEARCH t USING INDEX tracks_mimetype", "SCAN t" },
+        /* Album grid, each album's tracks a range of tracks_album */
+        { "FROM albums al JOIN tracks t",
+          "SEARCH t USING INDEX tracks_album", "SCAN t" },
+        /* Browsing the names in use */
+        { "SELECT name FROM artists WHERE EXISTS",
+          "USING COVERING INDEX tracks_artist", "TEMP B-TREE" },
+        { "SELECT name FROM albums WHERE EXISTS",
+          "USING COVERING INDEX tracks_album", "TEMP B-TREE" },
+        { "SELECT name FROM genres WHERE EXISTS",
+          "USING COVERING INDEX tracks_genre", "TEMP B-TREE" },
+        /* Scanner lookups by path, and pruning beneath a directory */
+        { "FROM tracks WHERE path == ? AND mtime",
+          "SEARCH tracks USING INDEX sqlite_autoindex_tracks_1 (path=?)", NULL },
+        { "FROM items WHERE path == ?",
+          "SEARCH t USING INDEX sqlite_autoindex_tracks_1 (path=?)", NULL },
+        { "SELECT COUNT(*) FROM tracks WHERE path > ?1",
+          "SEARCH tracks USING INDEX sqlite_autoindex_tracks_1 (path>? AND path<?)", NULL },
+        { "DELETE FROM tracks WHERE path > ?1",
+          "SEARCH tracks USING INDEX sqlite_autoindex_tracks_1 (path>? AND path<?)", NULL },
+        /* Names a retag stopped using, a probe of the tracks index each */
+        { "DELETE FROM artists WHERE name = ?",
+          "SEARCH tracks USING COVERING INDEX tracks_band (band=?)", "SCAN" },
+        { "DELETE FROM albums WHERE name = ?",
+          "SEARCH tracks USING COVERING INDEX tracks_album (album=?)", "SCAN" },
+        { "DELETE FROM genres WHERE name = ?",
+          "SEARCH tracks USING COVERING INDEX tracks_genre (genre=?)", "SCAN" },
+        /* Full-text search */
+        { "WHERE items_fts MATCH ?",
+          "SEARCH t USING INTEGER PRIMARY KEY", "SCAN t" }
+};
+
+/* Latest plan of each statement run, by SQL. Async queries report from
+ * the query pool, hence the lock. */
+static GHashTable *plans;
+static GMutex plans_lock;
+
+static void record_plan(const gchar *sql, const gchar *plan, gpointer userdata)
+{
+        g_mutex_lock(&plans_lock);
+        g_hash_table_replace(plans, g_strdup(sql), g_strdup(plan));
+        g_mutex_unlock(&plans_lock);
+}
+
+/**
+ * Write tracks in one album, by one artist in one genre
+ */
+static void add_tracks(BudgieDB *db, const gchar *suffix)
+{
+        GSList *tracks = NULL;
+        MediaInfo *info;
+        gchar name[64];
+        gint i;
+
+        for (i = 0; i < 10; i++) {
+                info = media_info_new();
+                info->title = g_strdup_printf("Track %d", i);
+                info->track_no = (guint)i + 1;
+                g_snprintf(name, sizeof(name), "Album%s", suffix);
+                info->album = g_intern_string(name);
+                g_snprintf(name, sizeof(name), "Artist%s", suffix);
+                info->artist = g_intern_string(name);
+                info->band = info->artist;
+                g_snprintf(name, sizeof(name), "Genre%s", suffix);
+                info->genre = g_intern_string(name);
+                info->path = g_strdup_printf("/music/%02d.ogg", i);
+                info->mime = g_intern_string("audio/ogg");
+                info->mtime = 1;
+                tracks = g_slist_prepend(tracks, info);
+        }
+        if (!budgie_db_update(db, tracks)) {
+                g_printerr("Update failed\n");
+                exit(EXIT_FAILURE);
+        }
+        g_slist_free_full(tracks, media_info_unref);
+}
+
+static gboolean album_cb(AlbumInfo *info, gpointer userdata)
+{
+        return TRUE;
+}
+
+static void search_cb(GObject *source, GAsyncResult *result, gpointer userdata)
+{
+        GPtrArray *results;
+
+        results = budgie_db_search_finish(BUDGIE_DB(source), result, NULL);
+        if (results) {
+                g_ptr_array_free(results, TRUE);
+        }
+        g_main_loop_quit(userdata);
+}
+
+/**
+ * Page through a cursor to the end
+ */
+static void read_cursor(BudgieDB *db, MediaQuery query, const gchar *term)
+{
+        BudgieDBCursor *cursor;
+        GPtrArray *results;
+
+        cursor = budgie_db_cursor_open(db, query, MATCH_QUERY_EXACT, term);
+        results = g_ptr_array_new_with_free_func(media_info_unref);
+        while (budgie_db_cursor_fetch(cursor, 4, results) > 0) {
+                g_ptr_array_set_size(results, 0);
+        }
+        g_ptr_array_free(results, TRUE);
+        budgie_db_cursor_close(cursor);
+}
+
+/**
+ * Run every kind of query BudgieDB has, so each statement reports its plan
+ */
+static void run_queries(BudgieDB *db)
+{
+        const MediaQuery fields[] = {
+                MEDIA_QUERY_ARTIST, MEDIA_QUERY_ALBUM, MEDIA_QUERY_GENRE
+        };
+        const gchar *terms[] = { "Artist", "Album", "Genre" };
+        GPtrArray *results = NULL;
+        GSList *all;
+        GMainLoop *loop;
+        gint64 generation;
+        guint i;
+
+        /* Retagging drops the old names */
+        add_tracks(db, "");
+        add_tracks(db, " 2");
+        add_tracks(db, "");
+
+        generation = budgie_db_begin_scan(db);
+        budgie_db_file_unchanged(db, "/music/00.ogg", 1, 0, 0);
+
+        all = budgie_db_get_all_media(db);
+        g_slist_free_full(all, media_info_unref);
+        read_cursor(db, MEDIA_QUERY_TITLE, NULL);
+        read_cursor(db, MEDIA_QUERY_ALBUM, "Album");
+
+        for (i = 0; i < G_N_ELEMENTS(fields); i++) {
+                if (budgie_db_search_field(db, fields[i], MATCH_QUERY_EXACT,
+                        (gchar*)terms[i], -1, &results)) {
+                        g_ptr_array_free(results, TRUE);
+                }
+                if (budgie_db_get_all_by_field(db, fields[i], &results)) {
+                        g_ptr_array_set_free_func(results, g_free);
+                        g_ptr_array_free(results, TRUE);
+                }
+        }
+        if (budgie_db_search_field(db, MEDIA_QUERY_MIME, MATCH_QUERY_START,
+                "audio/", -1, &results)) {
+                g_ptr_array_free(results, TRUE);
+        }
+        budgie_db_get_albums(db, album_cb, NULL);
+
+        loop = g_main_loop_new(NULL, FALSE);
+        budgie_db_search_async(db, "Track", 10, NULL, search_cb, loop);
+        g_main_loop_run(loop);
+        g_main_loop_unref(loop);
+
+        /* Nothing was seen by the new scan, so this empties the library */
+        budgie_db_count_stale(db, "/music", generation);
+        budgie_db_prune(db, "/music", generation);
+}
+
+/**
+ * Check the plan of one statement
+ * @return TRUE if the statement ran with the plan expected
+ */
+static gboolean check_plan(const PlanCheck *check)
+{
+        GHashTableIter iter;
+        const gchar *sql, *plan = NULL;
+
+        g_hash_table_iter_init(&iter, plans);
+        while (g_hash_table_iter_next(&iter, (gpointer*)&sql, NULL)) {
+                if (strstr(sql, check->sql)) {
+                        plan = g_hash_table_lookup(plans, sql);
+                        break;
+                }
+        }
+        if (!plan) {
+                g_printerr("FAIL: nothing ran matching: %s\n", check->sql);
+                return FALSE;
+        }
+        if (!strstr(plan, check->expected)) {
+                g_printerr("FAIL: no '%s' in the plan of: %s\n%s\n",
+                        check->expected, sql, plan);
+                return FALSE;
+        }
+        if (check->unexpected && strstr(plan, check->unexpected)) {
+                g_printerr("FAIL: '%s' in the plan of: %s\n%s\n",
+                        check->unexpected, sql, plan);
+                return FALSE;
+        }
+        return TRUE;
+}
+
+/**
+ * Check that the queries BudgieDB runs are answered from the indexes
+ * meant for them, on a fresh database. The plans come from the statements
+ * the library itself prepares, with the values each ran with.
+ */
+int main(int argc, char **argv)
+{
+        BudgieDB *db;
+        gchar *dir, *path;
+        const gchar *files[] = { "", "-wal", "-shm" };
+        gboolean ok = TRUE;
+        guint i;
+
+        /* A scratch database, in place of the user's */
+        dir = g_dir_make_tmp("budgie-check-XXXXXX", NULL);
+        if (!dir) {
+                return EXIT_FAILURE;
+        }
+        g_setenv("XDG_CONFIG_HOME", dir, TRUE);
+
+        plans = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+        db = budgie_db_new();
+        budgie_db_set_plan_func(db, record_plan, NULL);
+        run_queries(db);
+        budgie_db_set_plan_func(db, NULL, NULL);
+        g_object_unref(db);
+
+        for (i = 0; i < G_N_ELEMENTS(checks); i++) {
+                if (!check_plan(&checks[i])) {
+                        ok = FALSE;
+                }
+        }
+        g_hash_table_unref(plans);
+
+        for (i = 0; i < G_N_ELEMENTS(files); i++) {
+                path = g_strdup_printf("%s/%s%s", dir, CONFIG_NAME, files[i]);
+                g_unlink(path);
+                g_free(path);
+        }
+        g_rmdir(dir);
+        g_free(dir);
+
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
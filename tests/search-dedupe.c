@@ -0,0 +1,140 @@
+/*
+ * search-dedupe.c
+ * 
+ * Copyright 2013 Ikey Doherty <ikey.doherty@gmail.com>
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ * 
+ * 
+ */
+
+#include <stdlib.h>
+#include <glib/gstdio.h>
+
+#include "db/budgie-db.h"
+
+/* Tracks in the small and large libraries. Quadratic work takes
+ * (LARGE / SMALL)^2 = 16 times as long on the large one, linear 4 times
+ * plus the sort. These sizes are large enough for that to dominate the
+ * fixed costs, where a few thousand tracks hid a quadratic dedupe. */
+#define SMALL 20000
+#define LARGE 80000
+#define MAX_RATIO 8.0
+
+/**
+ * Add tracks from first up to last, all audio
+ */
+static void add_tracks(BudgieDB *db, gint first, gint last)
+{
+        GSList *tracks = NULL;
+        MediaInfo *info;
+        gint i;
+
+        for (i = first; i < last; i++) {
+                info = media_info_new();
+                info->title = g_strdup_printf("Track %d", i);
+                info->track_no = (guint)(i % 20);
+                info->album = g_intern_string("Album");
+                info->artist = g_intern_string("Artist");
+                info->path = g_strdup_printf("/music/%06d.ogg", i);
+                info->mime = g_intern_string("audio/ogg");
+                tracks = g_slist_prepend(tracks, info);
+        }
+        budgie_db_update(db, tracks);
+        g_slist_free_full(tracks, media_info_unref);
+}
+
+/**
+ * Search for all audio, check each track comes back once, and return
+ * the quickest of a few runs in microseconds
+ */
+static gint64 search_all(BudgieDB *db, guint expected)
+{
+        GPtrArray *results = NULL;
+        GHashTable *paths;
+        MediaInfo *info;
+        gint64 start, best = G_MAXINT64;
+        guint i, run;
+
+        for (run = 0; run < 3; run++) {
+                start = g_get_monotonic_time();
+                if (!budgie_db_search_field(db, MEDIA_QUERY_MIME,
+                        MATCH_QUERY_START, "audio/", -1, &results)) {
+                        g_printerr("Search failed\n");
+                        exit(EXIT_FAILURE);
+                }
+                best = MIN(best, g_get_monotonic_time() - start);
+
+                paths = g_hash_table_new(g_str_hash, g_str_equal);
+                for (i = 0; i < results->len; i++) {
+                        info = results->pdata[i];
+                        if (!g_hash_table_add(paths, info->path)) {
+                                g_printerr("%s returned twice\n", info->path);
+                                exit(EXIT_FAILURE);
+                        }
+                }
+                if (results->len != expected) {
+                        g_printerr("Expected %u tracks, found %u\n",
+                                expected, results->len);
+                        exit(EXIT_FAILURE);
+                }
+                g_hash_table_unref(paths);
+                g_ptr_array_free(results, TRUE);
+                results = NULL;
+        }
+
+        return best;
+}
+
+int main(int argc, char **argv)
+{
+        BudgieDB *db;
+        gchar *dir, *path;
+        gint64 small, large;
+        const gchar *files[] = { "", "-wal", "-shm" };
+        guint i;
+
+        /* A scratch database, in place of the user's */
+        dir = g_dir_make_tmp("budgie-check-XXXXXX", NULL);
+        if (!dir) {
+                return EXIT_FAILURE;
+        }
+        g_setenv("XDG_CONFIG_HOME", dir, TRUE);
+        db = budgie_db_new();
+
+        add_tracks(db, 0, SMALL);
+        small = search_all(db, SMALL);
+        add_tracks(db, SMALL, LARGE);
+        large = search_all(db, LARGE);
+        g_print("%d tracks: %" G_GINT64_FORMAT "us, %d tracks: %"
+                G_GINT64_FORMAT "us\n", SMALL, small, LARGE, large);
+
+        g_object_unref(db);
+        for (i = 0; i < G_N_ELEMENTS(files); i++) {
+                path = g_strdup_printf("%s/%s%s", dir, CONFIG_NAME, files[i]);
+                g_unlink(path);
+                g_free(path);
+        }
+        g_rmdir(dir);
+        g_free(dir);
+
+        if ((gdouble)large > (gdouble)MAX(small, 1) * MAX_RATIO) {
+                g_printerr("Search time grows faster than the library\n");
+                return EXIT_FAILURE;
+        }
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,146 @@
+/*
+ * upsert-bench.c
+ * 
+ * Copyright 2013 Ikey Doherty <ikey.doherty@gmail.com>
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ * 
+ * 
+ */
+
+#include <stdlib.h>
+#include <glib/gstdio.h>
+
+#include "db/budgie-db.h"
+
+/* Rows written by default, and how many go to each budgie_db_update, as
+ * the scanner does. A million rows takes a while, so make check builds
+ * this without running it: run tests/upsert-bench [rows] by hand. */
+#define ROWS 1000000
+#define BATCH_SIZE 200
+
+/* What each pass changes */
+typedef enum {
+        PASS_INSERT = 0,
+        PASS_UNCHANGED,
+        PASS_RESTAMP,
+        PASS_RETAG,
+        PASS_MAX
+} Pass;
+
+static const gchar *pass_names[PASS_MAX] = {
+        "insert",
+        "unchanged",
+        "restamp",
+        "retag"
+};
+
+/**
+ * A synthetic track. Albums hold ten tracks, artists ten albums.
+ */
+static MediaInfo *make_track(gint i, Pass pass)
+{
+        MediaInfo *info;
+        gchar name[64];
+
+        info = media_info_new();
+        info->title = g_strdup_printf(pass == PASS_RETAG ? "Retitled %d" :
+                "Track %d", i);
+        info->track_no = (guint)(i % 10) + 1;
+        g_snprintf(name, sizeof(name), "Album %d", i / 10);
+        info->album = g_intern_string(name);
+        g_snprintf(name, sizeof(name), "Artist %d", i / 100);
+        info->artist = g_intern_string(name);
+        g_snprintf(name, sizeof(name), "Genre %d", i % 20);
+        info->genre = g_intern_string(name);
+        info->path = g_strdup_printf("/music/%07d.ogg", i);
+        info->mime = g_intern_string("audio/ogg");
+        info->mtime = pass >= PASS_RESTAMP ? 2 : 1;
+        info->size = 4096;
+        info->inode = (guint64)i;
+
+        return info;
+}
+
+/**
+ * Write rows tracks a batch at a time, and return how long the writes
+ * took in microseconds. Building the batches isn't counted.
+ */
+static gint64 run_pass(BudgieDB *db, gint rows, Pass pass)
+{
+        GSList *tracks;
+        gint64 start, total = 0;
+        gint i, j;
+
+        for (i = 0; i < rows; i += BATCH_SIZE) {
+                tracks = NULL;
+                for (j = MIN(i + BATCH_SIZE, rows) - 1; j >= i; j--) {
+                        tracks = g_slist_prepend(tracks, make_track(j, pass));
+                }
+                start = g_get_monotonic_time();
+                if (!budgie_db_update(db, tracks)) {
+                        g_printerr("Update failed in the %s pass\n",
+                                pass_names[pass]);
+                        exit(EXIT_FAILURE);
+                }
+                total += g_get_monotonic_time() - start;
+                g_slist_free_full(tracks, media_info_unref);
+        }
+
+        return total;
+}
+
+int main(int argc, char **argv)
+{
+        BudgieDB *db;
+        gchar *dir, *path;
+        const gchar *files[] = { "", "-wal", "-shm" };
+        gint64 time;
+        gint rows;
+        guint i;
+
+        rows = argc > 1 ? atoi(argv[1]) : ROWS;
+        if (rows <= 0) {
+                g_printerr("Usage: %s [rows]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        /* A scratch database, in place of the user's */
+        dir = g_dir_make_tmp("budgie-check-XXXXXX", NULL);
+        if (!dir) {
+                return EXIT_FAILURE;
+        }
+        g_setenv("XDG_CONFIG_HOME", dir, TRUE);
+        db = budgie_db_new();
+
+        for (i = 0; i < PASS_MAX; i++) {
+                time = run_pass(db, rows, (Pass)i);
+                g_print("%-10s %d rows in %.2fs: %.0f rows/s\n",
+                        pass_names[i], rows, time / 1e6,
+                        rows / (MAX(time, 1) / 1e6));
+        }
+
+        g_object_unref(db);
+        for (i = 0; i < G_N_ELEMENTS(files); i++) {
+                path = g_strdup_printf("%s/%s%s", dir, CONFIG_NAME, files[i]);
+                g_unlink(path);
+                g_free(path);
+        }
+        g_rmdir(dir);
+        g_free(dir);
+
+        return EXIT_SUCCESS;
+}